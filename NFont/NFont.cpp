@@ -17,6 +17,27 @@ See NFont.h for license info.
 #include <string>
 #include <cstring>
 #include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define NFONT_USE_SSE2
+#endif
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define NFONT_USE_AVX2
+#endif
+#if (defined(__ARM_NEON) || defined(__ARM_NEON__)) && !defined(__ARM_BIG_ENDIAN)
+    #include <arm_neon.h>
+    #define NFONT_USE_NEON
+#endif
+
+#ifdef NFONT_USE_SDL_IMAGE
+    #include "SDL_image.h"
+#endif
 using std::string;
 using std::list;
 
@@ -33,6 +54,7 @@ using std::list;
 #define MIN(a,b) ((a) < (b)? (a) : (b))
 #define MAX(a,b) ((a) > (b)? (a) : (b))
 
+// Initial size of each thread's formatting buffer, which grows to fit longer text
 #define NFONT_BUFFER_SIZE 1024
 
 // vsnprintf replacement adapted from Valentin Milea:
@@ -55,6 +77,14 @@ static int c99_vsnprintf(char *outBuf, size_t size, const char *format, va_list
 
 #endif
 
+#ifndef va_copy
+    #ifdef __va_copy
+        #define va_copy(dest, src) __va_copy(dest, src)
+    #else
+        #define va_copy(dest, src) ((dest) = (src))
+    #endif
+#endif
+
 
 
 static inline SDL_Surface* createSurface24(Uint32 width, Uint32 height)
@@ -75,6 +105,15 @@ static inline SDL_Surface* createSurface32(Uint32 width, Uint32 height)
     #endif
 }
 
+static inline SDL_Surface* createSurface32From(void* pixels, Uint32 width, Uint32 height)
+{
+    #if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        return SDL_CreateRGBSurfaceFrom(pixels, width, height, 32, width*4, 0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF);
+    #else
+        return SDL_CreateRGBSurfaceFrom(pixels, width, height, 32, width*4, 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000);
+    #endif
+}
+
 static inline char* copyString(const char* c)
 {
     if(c == NULL)
@@ -258,6 +297,257 @@ static inline void drawPixel(SDL_Surface *surface, Sint16 x, Sint16 y, Uint32 co
     }
 }
 
+// Span blending for the formats surfaces are usually in.  Each blends one color into a row of pixels with an
+// alpha per pixel, giving exactly what drawPixel() would for every pixel with a nonzero alpha, and leaving the
+// others alone.  The vector loops return how many pixels they did and the scalar loop finishes the row.
+//
+// Per channel, drawPixel() gives d + floor((c - d)*a/256), which is (d*(256 - a) + c*a) >> 8.  Every term of
+// that fits in 16 bits unsigned.  The 32-bit formats take opaque pixels as they are (a = 256).
+typedef void (*NFont_SpanBlender)(Uint8* row, const Uint8* alpha, int n, Uint32 color);
+
+// 32-bit formats with the color in the low three bytes: ARGB8888 and ABGR8888 (KeepAlpha), RGB888 and
+// BGR888.  Channel order does not matter, as each byte blends alike.  Like drawPixel(), the top byte keeps
+// the destination's alpha or is cleared.
+template<bool KeepAlpha>
+struct SpanFormat8888
+{
+    typedef Uint32 Pixel;
+
+    static inline Uint32 blend(Uint32 dest, Uint32 color, Uint8 alpha)
+    {
+        Uint32 w = (alpha == 255? 256 : alpha);
+        Uint32 rb = (((dest & 0xFF00FF)*(256 - w) + (color & 0xFF00FF)*w) >> 8) & 0xFF00FF;
+        Uint32 g = (((dest & 0xFF00)*(256 - w) + (color & 0xFF00)*w) >> 8) & 0xFF00;
+        return rb | g | (KeepAlpha? (dest & 0xFF000000) : 0);
+    }
+
+    static inline int blendVector(Uint32* row, const Uint8* alpha, int n, Uint32 color)
+    {
+        int x = 0;
+        #if defined(NFONT_USE_AVX2)
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i full = _mm256_set1_epi16(256);
+        const __m256i opaque = _mm256_set1_epi16(255);
+        const __m256i colorMask = _mm256_set1_epi32(0x00FFFFFF);
+        const __m256i c = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)color), zero);
+        for(; x + 8 <= n; x += 8)
+        {
+            __m128i a8 = _mm_loadl_epi64((const __m128i*)(alpha + x));
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(a8, _mm_setzero_si128())) == 0xFFFF)
+                continue;
+
+            // Each pixel's alpha in all four of its bytes
+            __m256i a = _mm256_mullo_epi32(_mm256_cvtepu8_epi32(a8), _mm256_set1_epi32(0x01010101));
+            __m256i d = _mm256_loadu_si256((const __m256i*)(row + x));
+            __m256i wLo = _mm256_unpacklo_epi8(a, zero);
+            __m256i wHi = _mm256_unpackhi_epi8(a, zero);
+            wLo = _mm256_sub_epi16(wLo, _mm256_cmpeq_epi16(wLo, opaque));
+            wHi = _mm256_sub_epi16(wHi, _mm256_cmpeq_epi16(wHi, opaque));
+            __m256i lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(full, wLo)), _mm256_mullo_epi16(c, wLo)), 8);
+            __m256i hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(full, wHi)), _mm256_mullo_epi16(c, wHi)), 8);
+            __m256i result = _mm256_and_si256(_mm256_packus_epi16(lo, hi), colorMask);
+            if(KeepAlpha)
+                result = _mm256_or_si256(result, _mm256_andnot_si256(colorMask, d));
+
+            // Pixels with no alpha are not touched
+            __m256i skip = _mm256_cmpeq_epi32(a, zero);
+            result = _mm256_or_si256(_mm256_and_si256(skip, d), _mm256_andnot_si256(skip, result));
+            _mm256_storeu_si256((__m256i*)(row + x), result);
+        }
+        #elif defined(NFONT_USE_SSE2)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i full = _mm_set1_epi16(256);
+        const __m128i opaque = _mm_set1_epi16(255);
+        const __m128i colorMask = _mm_set1_epi32(0x00FFFFFF);
+        const __m128i c = _mm_unpacklo_epi8(_mm_set1_epi32((int)color), zero);
+        for(; x + 4 <= n; x += 4)
+        {
+            Uint32 alphas;
+            memcpy(&alphas, alpha + x, 4);
+            if(alphas == 0)
+                continue;
+
+            // Each pixel's alpha in all four of its bytes
+            __m128i a = _mm_cvtsi32_si128((int)alphas);
+            a = _mm_unpacklo_epi8(a, a);
+            a = _mm_unpacklo_epi16(a, a);
+            __m128i d = _mm_loadu_si128((const __m128i*)(row + x));
+            __m128i wLo = _mm_unpacklo_epi8(a, zero);
+            __m128i wHi = _mm_unpackhi_epi8(a, zero);
+            wLo = _mm_sub_epi16(wLo, _mm_cmpeq_epi16(wLo, opaque));
+            wHi = _mm_sub_epi16(wHi, _mm_cmpeq_epi16(wHi, opaque));
+            __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(full, wLo)), _mm_mullo_epi16(c, wLo)), 8);
+            __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(full, wHi)), _mm_mullo_epi16(c, wHi)), 8);
+            __m128i result = _mm_and_si128(_mm_packus_epi16(lo, hi), colorMask);
+            if(KeepAlpha)
+                result = _mm_or_si128(result, _mm_andnot_si128(colorMask, d));
+
+            // Pixels with no alpha are not touched
+            __m128i skip = _mm_cmpeq_epi32(a, zero);
+            result = _mm_or_si128(_mm_and_si128(skip, d), _mm_andnot_si128(skip, result));
+            _mm_storeu_si128((__m128i*)(row + x), result);
+        }
+        #elif defined(NFONT_USE_NEON)
+        const uint16x8_t full = vdupq_n_u16(256);
+        const uint8x8_t zero = vdup_n_u8(0);
+        uint8x8_t c[3];
+        for(int i = 0; i < 3; ++i)
+            c[i] = vdup_n_u8(Uint8(color >> (8*i)));
+        for(; x + 8 <= n; x += 8)
+        {
+            uint8x8_t a = vld1_u8(alpha + x);
+            if(vget_lane_u64(vreinterpret_u64_u8(a), 0) == 0)
+                continue;
+
+            // The channels are split by byte, so one weight covers all of them
+            uint8x8x4_t d = vld4_u8((const uint8_t*)(row + x));
+            uint16x8_t w = vmovl_u8(a);
+            w = vsubq_u16(w, vceqq_u16(w, vdupq_n_u16(255)));
+            uint16x8_t inverse = vsubq_u16(full, w);
+            uint8x8_t skip = vceq_u8(a, zero);
+            uint8x8x4_t result;
+            for(int i = 0; i < 3; ++i)
+            {
+                uint8x8_t blended = vshrn_n_u16(vmlaq_u16(vmulq_u16(vmovl_u8(d.val[i]), inverse), vmovl_u8(c[i]), w), 8);
+                result.val[i] = vbsl_u8(skip, d.val[i], blended);
+            }
+            result.val[3] = (KeepAlpha? d.val[3] : vbsl_u8(skip, d.val[3], zero));
+            vst4_u8((uint8_t*)(row + x), result);
+        }
+        #endif
+        return x;
+    }
+};
+
+// RGB565 and BGR565.  drawPixel() blends 16-bit pixels without taking opaque ones as they are, so neither
+// does this.
+struct SpanFormat565
+{
+    typedef Uint16 Pixel;
+
+    static inline Uint16 blend(Uint16 dest, Uint32 color, Uint8 alpha)
+    {
+        Uint32 w = alpha;
+        Uint32 hi = (((dest >> 11)*(256 - w) + ((color >> 11) & 0x1F)*w) >> 8) << 11;
+        Uint32 mid = ((((dest >> 5) & 0x3F)*(256 - w) + ((color >> 5) & 0x3F)*w) >> 8) << 5;
+        Uint32 lo = ((dest & 0x1F)*(256 - w) + (color & 0x1F)*w) >> 8;
+        return Uint16(hi | mid | lo);
+    }
+
+    static inline int blendVector(Uint16* row, const Uint8* alpha, int n, Uint32 color)
+    {
+        int x = 0;
+        #if defined(NFONT_USE_AVX2)
+        const __m256i full = _mm256_set1_epi16(256);
+        const __m256i mask5 = _mm256_set1_epi16(0x1F);
+        const __m256i mask6 = _mm256_set1_epi16(0x3F);
+        const __m256i cHi = _mm256_set1_epi16(short((color >> 11) & 0x1F));
+        const __m256i cMid = _mm256_set1_epi16(short((color >> 5) & 0x3F));
+        const __m256i cLo = _mm256_set1_epi16(short(color & 0x1F));
+        for(; x + 16 <= n; x += 16)
+        {
+            __m128i a8 = _mm_loadu_si128((const __m128i*)(alpha + x));
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(a8, _mm_setzero_si128())) == 0xFFFF)
+                continue;
+
+            __m256i w = _mm256_cvtepu8_epi16(a8);
+            __m256i inverse = _mm256_sub_epi16(full, w);
+            __m256i d = _mm256_loadu_si256((const __m256i*)(row + x));
+            __m256i hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_srli_epi16(d, 11), inverse), _mm256_mullo_epi16(cHi, w)), 8);
+            __m256i mid = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi16(d, 5), mask6), inverse), _mm256_mullo_epi16(cMid, w)), 8);
+            __m256i lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(d, mask5), inverse), _mm256_mullo_epi16(cLo, w)), 8);
+            __m256i result = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi16(hi, 11), _mm256_slli_epi16(mid, 5)), lo);
+
+            __m256i skip = _mm256_cmpeq_epi16(w, _mm256_setzero_si256());
+            result = _mm256_or_si256(_mm256_and_si256(skip, d), _mm256_andnot_si256(skip, result));
+            _mm256_storeu_si256((__m256i*)(row + x), result);
+        }
+        #elif defined(NFONT_USE_SSE2)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i full = _mm_set1_epi16(256);
+        const __m128i mask5 = _mm_set1_epi16(0x1F);
+        const __m128i mask6 = _mm_set1_epi16(0x3F);
+        const __m128i cHi = _mm_set1_epi16(short((color >> 11) & 0x1F));
+        const __m128i cMid = _mm_set1_epi16(short((color >> 5) & 0x3F));
+        const __m128i cLo = _mm_set1_epi16(short(color & 0x1F));
+        for(; x + 8 <= n; x += 8)
+        {
+            __m128i a8 = _mm_loadl_epi64((const __m128i*)(alpha + x));
+            if((_mm_movemask_epi8(_mm_cmpeq_epi8(a8, zero)) & 0xFF) == 0xFF)
+                continue;
+
+            __m128i w = _mm_unpacklo_epi8(a8, zero);
+            __m128i inverse = _mm_sub_epi16(full, w);
+            __m128i d = _mm_loadu_si128((const __m128i*)(row + x));
+            __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_srli_epi16(d, 11), inverse), _mm_mullo_epi16(cHi, w)), 8);
+            __m128i mid = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(d, 5), mask6), inverse), _mm_mullo_epi16(cMid, w)), 8);
+            __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_and_si128(d, mask5), inverse), _mm_mullo_epi16(cLo, w)), 8);
+            __m128i result = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(hi, 11), _mm_slli_epi16(mid, 5)), lo);
+
+            __m128i skip = _mm_cmpeq_epi16(w, zero);
+            result = _mm_or_si128(_mm_and_si128(skip, d), _mm_andnot_si128(skip, result));
+            _mm_storeu_si128((__m128i*)(row + x), result);
+        }
+        #elif defined(NFONT_USE_NEON)
+        const uint16x8_t full = vdupq_n_u16(256);
+        const uint16x8_t mask5 = vdupq_n_u16(0x1F);
+        const uint16x8_t mask6 = vdupq_n_u16(0x3F);
+        const uint16x8_t cHi = vdupq_n_u16(Uint16((color >> 11) & 0x1F));
+        const uint16x8_t cMid = vdupq_n_u16(Uint16((color >> 5) & 0x3F));
+        const uint16x8_t cLo = vdupq_n_u16(Uint16(color & 0x1F));
+        for(; x + 8 <= n; x += 8)
+        {
+            uint8x8_t a = vld1_u8(alpha + x);
+            if(vget_lane_u64(vreinterpret_u64_u8(a), 0) == 0)
+                continue;
+
+            uint16x8_t w = vmovl_u8(a);
+            uint16x8_t inverse = vsubq_u16(full, w);
+            uint16x8_t d = vld1q_u16(row + x);
+            uint16x8_t hi = vshrq_n_u16(vmlaq_u16(vmulq_u16(vshrq_n_u16(d, 11), inverse), cHi, w), 8);
+            uint16x8_t mid = vshrq_n_u16(vmlaq_u16(vmulq_u16(vandq_u16(vshrq_n_u16(d, 5), mask6), inverse), cMid, w), 8);
+            uint16x8_t lo = vshrq_n_u16(vmlaq_u16(vmulq_u16(vandq_u16(d, mask5), inverse), cLo, w), 8);
+            uint16x8_t result = vorrq_u16(vorrq_u16(vshlq_n_u16(hi, 11), vshlq_n_u16(mid, 5)), lo);
+            vst1q_u16(row + x, vbslq_u16(vceqq_u16(w, vdupq_n_u16(0)), d, result));
+        }
+        #endif
+        return x;
+    }
+};
+
+template<class Format>
+static void blendSpan(Uint8* row, const Uint8* alpha, int n, Uint32 color)
+{
+    typename Format::Pixel* pixels = (typename Format::Pixel*)row;
+    for(int x = Format::blendVector(pixels, alpha, n, color); x < n; ++x)
+    {
+        if(alpha[x] != 0)
+            pixels[x] = Format::blend(pixels[x], color, alpha[x]);
+    }
+}
+
+static inline bool isByteMask(Uint32 mask)
+{
+    return (mask == 0xFF || mask == 0xFF00 || mask == 0xFF0000);
+}
+
+// Returns the span blender for a surface format, or NULL if its pixels go through drawPixel().
+static NFont_SpanBlender getSpanBlender(const SDL_PixelFormat* format)
+{
+    if(format->BytesPerPixel == 4 && isByteMask(format->Rmask) && isByteMask(format->Gmask) && isByteMask(format->Bmask)
+       && (format->Rmask | format->Gmask | format->Bmask) == 0xFFFFFF)
+    {
+        if(format->Amask == 0xFF000000)
+            return blendSpan<SpanFormat8888<true> >;
+        if(format->Amask == 0)
+            return blendSpan<SpanFormat8888<false> >;
+    }
+    if(format->BytesPerPixel == 2 && format->Amask == 0 && format->Gmask == 0x07E0
+       && ((format->Rmask == 0xF800 && format->Bmask == 0x001F) || (format->Rmask == 0x001F && format->Bmask == 0xF800)))
+        return blendSpan<SpanFormat565>;
+    return NULL;
+}
+
 static inline NFont::Rectf rectUnion(const NFont::Rectf& A, const NFont::Rectf& B)
 {
     float x,x2,y,y2;
@@ -308,210 +598,6087 @@ static inline SDL_Surface* copySurface(SDL_Surface *Surface)
 }
 
 
-
-
-
-
-
-
-
-NFont::Color::Color()
-    : r(0), g(0), b(0), a(255)
-{}
-NFont::Color::Color(Uint8 r, Uint8 g, Uint8 b)
-    : r(r), g(g), b(b), a(255)
-{}
-NFont::Color::Color(Uint8 r, Uint8 g, Uint8 b, Uint8 a)
-    : r(r), g(g), b(b), a(a)
-{}
-NFont::Color::Color(const SDL_Color& color)
-    : r(color.r), g(color.g), b(color.b), a(color.a)
-{}
-
-NFont::Color& NFont::Color::rgb(Uint8 R, Uint8 G, Uint8 B)
+// Formatting scratch space.  Each thread gets its own buffer so that fonts can be
+// formatted and measured from worker threads without any global lock.  The buffer
+// only grows, so steady-state formatting does not allocate.
+struct ScratchBuffer
 {
-    r = R;
-    g = G;
-    b = B;
+    char* data;
+    size_t size;
+};
 
-    return *this;
-}
+static SDL_atomic_t scratch_tls_id;
+static SDL_SpinLock scratch_tls_lock = 0;
 
-NFont::Color& NFont::Color::rgba(Uint8 R, Uint8 G, Uint8 B, Uint8 A)
+static void freeScratchBuffer(void* data)
 {
-    r = R;
-    g = G;
-    b = B;
-    a = A;
-
-    return *this;
+    ScratchBuffer* scratch = (ScratchBuffer*)data;
+    delete[] scratch->data;
+    delete scratch;
 }
 
-NFont::Color& NFont::Color::color(const SDL_Color& color)
+static ScratchBuffer* getScratchBuffer()
 {
-    r = color.r;
-    g = color.g;
-    b = color.b;
-    a = color.a;
+    SDL_TLSID id = SDL_AtomicGet(&scratch_tls_id);
+    if(id == 0)
+    {
+        SDL_AtomicLock(&scratch_tls_lock);
+        id = SDL_AtomicGet(&scratch_tls_id);
+        if(id == 0)
+        {
+            id = SDL_TLSCreate();
+            SDL_AtomicSet(&scratch_tls_id, id);
+        }
+        SDL_AtomicUnlock(&scratch_tls_lock);
+    }
 
-    return *this;
+    ScratchBuffer* scratch = (ScratchBuffer*)SDL_TLSGet(id);
+    if(scratch == NULL)
+    {
+        scratch = new ScratchBuffer;
+        scratch->data = new char[NFONT_BUFFER_SIZE];
+        scratch->size = NFONT_BUFFER_SIZE;
+        SDL_TLSSet(id, scratch, &freeScratchBuffer);
+    }
+    return scratch;
 }
 
-SDL_Color NFont::Color::to_SDL_Color() const
+// Holds a font's mutex for the lifetime of the scope.
+class FontLock
 {
-    SDL_Color c = {r, g, b, a};
-    return c;
-}
-
+public:
+    FontLock(SDL_mutex* mutex)
+        : mutex(mutex)
+    {
+        SDL_LockMutex(mutex);
+    }
+    ~FontLock()
+    {
+        SDL_UnlockMutex(mutex);
+    }
 
+private:
+    SDL_mutex* mutex;
+};
 
+// Generations come from one counter, so a copy's and its shared font's can be combined by taking the larger.
+static SDL_atomic_t last_generation;
 
-NFont::Rectf::Rectf()
-    : x(0), y(0), w(0), h(0)
-{}
+static Uint32 nextGeneration()
+{
+    return Uint32(SDL_AtomicAdd(&last_generation, 1) + 1);
+}
 
-NFont::Rectf::Rectf(float x, float y)
-    : x(x), y(y), w(0), h(0)
-{}
+struct SDFAtlas;
+struct SurfaceAtlas;
+struct GlyphStage;
+struct BitmapFontMetrics;
 
-NFont::Rectf::Rectf(float x, float y, float w, float h)
-    : x(x), y(y), w(w), h(h)
-{}
+// Kerning pairs in SDL_FontCache's packed codepoint form, sorted by first and then second
+struct KerningPair
+{
+    Uint32 first;
+    Uint32 second;
+    int amount;
+};
 
-NFont::Rectf::Rectf(const SDL_Rect& rect)
-    : x(rect.x), y(rect.y), w(rect.w), h(rect.h)
-{}
+typedef std::vector<KerningPair> KerningTable;
 
-#ifdef NFONT_USE_SDL_GPU
-NFont::Rectf::Rectf(const GPU_Rect& rect)
-    : x(rect.x), y(rect.y), w(rect.w), h(rect.h)
-{}
-#endif
+// Glyph metrics kept as dense arrays indexed by Unicode value, so measuring a string is a tight loop instead
+// of a glyph cache lookup per character.  Each entry is one word: the advance in the low 16 bits, the height
+// in the next 14 and the GlyphMetricsState in the top 2, so that 0 is GLYPH_UNKNOWN.
+enum GlyphMetricsState
+{
+    GLYPH_UNKNOWN,
+    GLYPH_PRESENT,
+    GLYPH_MISSING  // Measured with the space's advance, as SDL_FontCache does
+};
 
-SDL_Rect NFont::Rectf::to_SDL_Rect() const
+struct GlyphMetricsPage
 {
-    SDL_Rect r = {int(x), int(y), int(w), int(h)};
-    return r;
+    Uint32 entries[256];
+};
+
+// The glyph metrics that copies of a font share.  Only a locked font fills them in, but copies measure from
+// them without locking: they check that the generation is the same, and not 0, before and after reading.
+// Pages are cleared in place and never freed before the font data, so a reader never holds a freed one.
+// The font's own metrics, as getHeight(), getAscent() and the like report them
+struct FontLineMetrics
+{
+    Uint16 height;
+    int ascent;
+    int descent;
+    int baseline;
+    Uint16 max_width;
+};
+
+struct NFont_GlyphMetrics
+{
+    SDL_atomic_t generation;  // The font's generation when the table was reset, or 0 until it is reset again
+    FontLineMetrics line;
+    bool kerned;  // The font has kerning pairs, which the table leaves out
+    GlyphMetricsPage direct;  // U+0000 to U+00FF
+    GlyphMetricsPage** planes[17];  // 256 pages for each Unicode plane, allocated as glyphs are measured
+};
+
+// What NFont::getStats() reports, kept with the glyph cache it describes.  The font must be locked.
+struct NFont_Stats
+{
+    NFont::Stats counts;  // Never reset, so that getTotalStats() can add them up
+    NFont::Stats reset_counts;  // counts at the last resetStats()
+    Uint32 font_id;  // For trace zones.  See NFont::getID().
+    SDL_atomic_t formatted_bytes;  // Counted by formatText() without locking, until collectFormatStats()
+    SDL_atomic_t long_formats;
+    bool seen_stale;  // Set when the glyph cache is replaced, so that seen is filled from it again
+    std::vector<Uint32> seen;  // Bits by Unicode value for the glyphs that were cached or looked up, a plane at a time
+    std::set<Uint32> seen_malformed;  // The same for codepoints that are not valid UTF-8
+    int num_levels;  // Cache levels counted so far
+};
+
+// What copies of an NFont share: the SDL_FontCache font with its glyph cache, and where it came from
+struct NFont_FontData
+{
+    SDL_atomic_t refcount;
+    FC_Font* font;
+    SDL_mutex* mutex;
+    Uint32 generation;  // Changes when the glyphs or line metrics do
+    char* source_filename;  // The TTF file that was loaded, for preloadGlyphs() threads to open again
+    Uint32 source_size;
+    int source_style;
+    TTF_Font* owned_ttf;  // Opened by loadAsync(), as SDL_FontCache only borrows it
+    NFont_AsyncLoad* async_load;  // NULL unless a loadAsync() is in flight
+    SDFAtlas* sdf;  // NULL unless loaded by loadSDF()
+    SurfaceAtlas* surface_glyphs;  // Glyphs copied out of the glyph cache for drawing into surfaces
+    GlyphStage* stage;  // Where draws render their new glyphs, or NULL
+    BitmapFontMetrics* bitmap_metrics;  // NULL unless loaded from an image or a BMFont
+    KerningTable kerning;  // A BMFont's kerning pairs
+    NFont_GlyphMetrics metrics;  // Read without locking the font
+    NFont_Target* renderer;  // What the glyph cache was loaded with, for reading it back
+    #ifndef NFONT_USE_SDL_GPU
+    SDL_Renderer* own_renderer;  // Made for fonts loaded without a renderer
+    SDL_Surface* own_renderer_target;
+    #endif
+    bool registered;  // Handed out by NFont::Registry, which must never see it change
+    Uint64 cache_budget;  // Texture bytes the glyph cache may grow to before it is evicted, or 0
+    Uint64 cache_bytes;  // Texture bytes of the glyph cache when it had budget_levels levels
+    int budget_levels;
+    Uint32 draw_clock;  // Counts draws of a font with a budget
+    std::vector<Uint32> level_draws;  // draw_clock when each cache level was last drawn from
+    NFont_Stats stats;
+};
+
+// Gives the glyphs and line metrics a new generation.  The font must be locked.
+static void changeGeneration(NFont_FontData* data)
+{
+    data->generation = nextGeneration();
+    // Unlocked measurements take the lock until the glyph metrics are reset for it
+    SDL_AtomicSet(&data->metrics.generation, 0);
 }
 
-#ifdef NFONT_USE_SDL_GPU
-GPU_Rect NFont::Rectf::to_GPU_Rect() const
+// Notes that a cache level was drawn from, for evicting the ones that have not been for longest
+static void touchCacheLevel(NFont_FontData* data, int level)
 {
-    return GPU_MakeRect(x, y, w, h);
+    if(level >= 0 && level < int(data->level_draws.size()))
+        data->level_draws[level] = data->draw_clock;
 }
-#endif
-
-
-
-
-
 
+static void addStats(NFont::Stats* result, const NFont::Stats& stats)
+{
+    result->draw_calls += stats.draw_calls;
+    result->glyphs_submitted += stats.glyphs_submitted;
+    result->cache_hits += stats.cache_hits;
+    result->cache_misses += stats.cache_misses;
+    result->glyphs_rasterized += stats.glyphs_rasterized;
+    result->texture_uploads += stats.texture_uploads;
+    result->texture_upload_bytes += stats.texture_upload_bytes;
+    result->new_cache_levels += stats.new_cache_levels;
+    result->cache_evictions += stats.cache_evictions;
+    result->bytes_formatted += stats.bytes_formatted;
+    result->long_formats += stats.long_formats;
+    result->truncations += stats.truncations;
+}
 
-char* NFont::buffer = NULL;  // Shared buffer for efficient drawing
+static NFont::Stats subtractStats(const NFont::Stats& A, const NFont::Stats& B)
+{
+    NFont::Stats result;
+    result.draw_calls = A.draw_calls - B.draw_calls;
+    result.glyphs_submitted = A.glyphs_submitted - B.glyphs_submitted;
+    result.cache_hits = A.cache_hits - B.cache_hits;
+    result.cache_misses = A.cache_misses - B.cache_misses;
+    result.glyphs_rasterized = A.glyphs_rasterized - B.glyphs_rasterized;
+    result.texture_uploads = A.texture_uploads - B.texture_uploads;
+    result.texture_upload_bytes = A.texture_upload_bytes - B.texture_upload_bytes;
+    result.new_cache_levels = A.new_cache_levels - B.new_cache_levels;
+    result.cache_evictions = A.cache_evictions - B.cache_evictions;
+    result.bytes_formatted = A.bytes_formatted - B.bytes_formatted;
+    result.long_formats = A.long_formats - B.long_formats;
+    result.truncations = A.truncations - B.truncations;
+    return result;
+}
 
+// Every font's counts, for NFont::getTotalStats().  Lock order is this mutex, then a font's.
+static std::set<NFont_FontData*> stats_fonts;
+static NFont::Stats freed_stats;  // Counts of the fonts that were freed
+static NFont::Stats total_reset_counts;  // The total at the last resetTotalStats()
+static SDL_mutex* stats_mutex = NULL;
+static SDL_SpinLock stats_mutex_lock = 0;
 
-// Constructors
-NFont::NFont()
+static SDL_mutex* getStatsMutex()
 {
-    init();
+    SDL_AtomicLock(&stats_mutex_lock);
+    if(stats_mutex == NULL)
+        stats_mutex = SDL_CreateMutex();
+    SDL_AtomicUnlock(&stats_mutex_lock);
+    return stats_mutex;
 }
 
-NFont::NFont(const NFont& font)
+// Moves what formatText() counted into the counts.  The font must be locked.
+static void collectFormatStats(NFont_Stats* stats)
 {
-    init();
-    // FIXME: Duplicate font data
+    stats->counts.bytes_formatted += Uint32(SDL_AtomicSet(&stats->formatted_bytes, 0));
+    stats->counts.long_formats += Uint32(SDL_AtomicSet(&stats->long_formats, 0));
 }
 
-#ifdef NFONT_USE_SDL_GPU
-NFont::NFont(TTF_Font* ttf)
+// Adds up the counts of every font, freed ones included
+static NFont::Stats sumStats()
 {
-    init();
-    load(ttf, FC_GetDefaultColor(font));
+    NFont::Stats result = freed_stats;
+    for(std::set<NFont_FontData*>::const_iterator e = stats_fonts.begin(); e != stats_fonts.end(); ++e)
+    {
+        FontLock lock((*e)->mutex);
+        collectFormatStats(&(*e)->stats);
+        addStats(&result, (*e)->stats.counts);
+    }
+    return result;
 }
-NFont::NFont(TTF_Font* ttf, const NFont::Color& color)
+
+static SDL_atomic_t last_font_id;
+
+static NFont_FontData* createFontData()
 {
-    init();
-    load(ttf, color);
+    NFont_FontData* data = new NFont_FontData;
+    SDL_AtomicSet(&data->refcount, 1);
+    data->font = FC_CreateFont();
+    data->mutex = SDL_CreateMutex();
+    data->generation = nextGeneration();
+    data->source_filename = NULL;
+    data->source_size = 0;
+    data->source_style = 0;
+    data->owned_ttf = NULL;
+    data->async_load = NULL;
+    data->sdf = NULL;
+    data->surface_glyphs = NULL;
+    data->stage = NULL;
+    data->bitmap_metrics = NULL;
+    memset(&data->metrics, 0, sizeof(data->metrics));
+    data->renderer = NULL;
+    #ifndef NFONT_USE_SDL_GPU
+    data->own_renderer = NULL;
+    data->own_renderer_target = NULL;
+    #endif
+    data->registered = false;
+    data->cache_budget = 0;
+    data->cache_bytes = 0;
+    data->budget_levels = 0;
+    data->draw_clock = 0;
+    data->stats.font_id = Uint32(SDL_AtomicAdd(&last_font_id, 1) + 1);
+    SDL_AtomicSet(&data->stats.formatted_bytes, 0);
+    SDL_AtomicSet(&data->stats.long_formats, 0);
+    data->stats.seen_stale = true;
+    data->stats.num_levels = 0;
+
+    FontLock stats_lock(getStatsMutex());
+    stats_fonts.insert(data);
+    return data;
 }
-NFont::NFont(const char* filename_ttf, Uint32 pointSize)
+
+// Keeps the counts of a font that is about to be freed in the total
+static void freeFontStats(NFont_FontData* data)
 {
-    init();
-    load(filename_ttf, pointSize);
+    FontLock stats_lock(getStatsMutex());
+    stats_fonts.erase(data);
+    collectFormatStats(&data->stats);
+    addStats(&freed_stats, data->stats.counts);
 }
-NFont::NFont(const char* filename_ttf, Uint32 pointSize, const NFont::Color& color, int style)
+
+// Packs a Unicode value into SDL_FontCache's codepoint form (its UTF-8 bytes)
+static Uint32 packCodepoint(Uint32 unicode)
 {
-    init();
-    load(filename_ttf, pointSize, color, style);
+    if(unicode < 0x80)
+        return unicode;
+    if(unicode < 0x800)
+        return ((0xC0 | (unicode >> 6)) << 8) | (0x80 | (unicode & 0x3F));
+    if(unicode < 0x10000)
+        return ((0xE0 | (unicode >> 12)) << 16) | ((0x80 | ((unicode >> 6) & 0x3F)) << 8) | (0x80 | (unicode & 0x3F));
+    return ((0xF0 | (unicode >> 18)) << 24) | ((0x80 | ((unicode >> 12) & 0x3F)) << 16)
+           | ((0x80 | ((unicode >> 6) & 0x3F)) << 8) | (0x80 | (unicode & 0x3F));
 }
-NFont::NFont(SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color, int style)
+
+// The Unicode value of a packed codepoint.  Returns false for malformed UTF-8, which has no place in the
+// glyph metrics and is measured without them.
+static inline bool getUnicode(Uint32 codepoint, Uint32* unicode)
 {
-    init();
-    load(file_rwops_ttf, own_rwops, pointSize, color, style);
+    if(codepoint < 0x80)
+        *unicode = codepoint;
+    else if(codepoint < 0x10000)
+        *unicode = ((codepoint >> 8) & 0x1F) << 6 | (codepoint & 0x3F);
+    else if(codepoint < 0x1000000)
+        *unicode = ((codepoint >> 16) & 0x0F) << 12 | ((codepoint >> 8) & 0x3F) << 6 | (codepoint & 0x3F);
+    else
+        *unicode = ((codepoint >> 24) & 0x07) << 18 | ((codepoint >> 16) & 0x3F) << 12 | ((codepoint >> 8) & 0x3F) << 6 | (codepoint & 0x3F);
+    return (*unicode <= 0x10FFFF && packCodepoint(*unicode) == codepoint);
 }
 
-#else
+static bool isGlyphSeen(const NFont_Stats* stats, Uint32 codepoint)
+{
+    Uint32 unicode;
+    if(!getUnicode(codepoint, &unicode))
+        return (stats->seen_malformed.find(codepoint) != stats->seen_malformed.end());
+    return (unicode/32 < stats->seen.size() && (stats->seen[unicode/32] & (Uint32(1) << (unicode%32))) != 0);
+}
 
-NFont::NFont(NFont_Target* renderer, TTF_Font* ttf)
+static void markGlyphSeen(NFont_Stats* stats, Uint32 codepoint)
 {
-    init();
-    load(renderer, ttf, FC_GetDefaultColor(font));
+    Uint32 unicode;
+    if(!getUnicode(codepoint, &unicode))
+    {
+        stats->seen_malformed.insert(codepoint);
+        return;
+    }
+
+    if(unicode/32 >= stats->seen.size())
+        stats->seen.resize((unicode/0x10000 + 1)*(0x10000/32), 0);
+    stats->seen[unicode/32] |= Uint32(1) << (unicode%32);
 }
-NFont::NFont(NFont_Target* renderer, TTF_Font* ttf, const NFont::Color& color)
+
+// Marks every glyph the cache holds as seen.  The font must be locked.
+static void markCachedGlyphsSeen(NFont_FontData* data)
 {
-    init();
-    load(renderer, ttf, color);
+    std::vector<Uint32> cached(FC_GetNumCodepoints(data->font));
+    if(!cached.empty())
+        FC_GetCodepoints(data->font, &cached[0]);
+    for(size_t i = 0; i < cached.size(); ++i)
+        markGlyphSeen(&data->stats, cached[i]);
 }
-NFont::NFont(NFont_Target* renderer, const char* filename_ttf, Uint32 pointSize)
+
+// Starts over from what the glyph cache holds after it was replaced, so those glyphs count as hits.  Other
+// generation changes, like a new baseline, leave the glyphs alone.  The font must be locked.
+static void updateSeenGlyphs(NFont_FontData* data)
 {
-    init();
-    load(renderer, filename_ttf, pointSize);
+    NFont_Stats* stats = &data->stats;
+    if(!stats->seen_stale)
+        return;
+
+    stats->seen.clear();
+    stats->seen_malformed.clear();
+    markCachedGlyphsSeen(data);
+    stats->num_levels = FC_GetNumCacheLevels(data->font);
+    stats->seen_stale = false;
 }
-NFont::NFont(NFont_Target* renderer, const char* filename_ttf, Uint32 pointSize, const NFont::Color& color, int style)
+
+// Counts the cache levels that were added since the last count
+static void countCacheLevels(NFont_Stats* stats, FC_Font* font)
 {
-    init();
-    load(renderer, filename_ttf, pointSize, color, style);
+    int numLevels = FC_GetNumCacheLevels(font);
+    if(numLevels > stats->num_levels)
+        stats->counts.new_cache_levels += numLevels - stats->num_levels;
+    stats->num_levels = numLevels;
 }
-NFont::NFont(NFont_Target* renderer, SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color, int style)
+
+static void countRasterizedGlyph(NFont_Stats* stats, FC_Font* font, const FC_GlyphData& glyph)
 {
-    init();
-    load(renderer, file_rwops_ttf, own_rwops, pointSize, color, style);
+    ++stats->counts.glyphs_rasterized;
+    ++stats->counts.texture_uploads;
+    stats->counts.texture_upload_bytes += Uint64(glyph.rect.w)*glyph.rect.h*4;
+    countCacheLevels(stats, font);
 }
-#endif
 
+// NFont::setTraceCallbacks()'s callbacks.  They are only set while no other thread is in NFont, so they are
+// read without a lock.
+static NFont::TraceCallback trace_begin = NULL;
+static NFont::TraceCallback trace_end = NULL;
+static void* trace_userdata = NULL;
 
-NFont::~NFont()
+// Reports a zone for the lifetime of the scope.  Without callbacks, it costs a few stores and a pointer test.
+class TraceScope
 {
-    FC_FreeFont(font);
-}
+public:
+    NFont::TraceZone zone;  // Its counts can be filled in before the zone ends
 
+    TraceScope(const char* name, Uint32 font_id, Uint64 bytes = 0)
+        : end_callback(trace_end), userdata(trace_userdata)
+    {
+        zone.name = name;
+        zone.font_id = font_id;
+        zone.glyphs = 0;
+        zone.bytes = bytes;
+        if(end_callback != NULL)
+            trace_begin(zone, userdata);
+    }
+    ~TraceScope()
+    {
+        if(end_callback != NULL)
+            end_callback(zone, userdata);
+    }
 
-NFont& NFont::operator=(const NFont& font)
+private:
+    NFont::TraceCallback end_callback;
+    void* userdata;
+};
+
+static inline Uint32 getFontID(const NFont_Stats* stats)
 {
-    // FIXME: Duplicate font data
-    return *this;
+    return (stats != NULL? stats->font_id : 0);
 }
 
-void NFont::init()
+// FC_GetGlyphData(), counting the lookup.  SDL_FontCache renders glyphs it does not have yet, so a codepoint
+// that was neither cached nor looked up before is one that it has to render.  stats may be NULL.
+static bool getGlyphData(NFont_Stats* stats, FC_Font* font, FC_GlyphData* glyph, Uint32 codepoint)
 {
-    font = FC_CreateFont();
+    if(stats == NULL)
+        return (FC_GetGlyphData(font, glyph, codepoint) != 0);
+
+    if(isGlyphSeen(stats, codepoint))
+    {
+        bool found = (FC_GetGlyphData(font, glyph, codepoint) != 0);
+        if(found)
+            ++stats->counts.cache_hits;
+        else
+            ++stats->counts.cache_misses;
+        return found;
+    }
 
-    if(buffer == NULL)
-        buffer = new char[NFONT_BUFFER_SIZE];
+    TraceScope trace("NFont rasterize", stats->font_id);
+    bool found = (FC_GetGlyphData(font, glyph, codepoint) != 0);
+    ++stats->counts.cache_misses;
+    if(found)
+    {
+        markGlyphSeen(stats, codepoint);
+        countRasterizedGlyph(stats, font, *glyph);
+        trace.zone.glyphs = 1;
+        trace.zone.bytes = Uint64(glyph->rect.w)*glyph->rect.h*4;
+    }
+    return found;
 }
 
+// Formats into this thread's scratch buffer, growing it when the text does not fit, and counts it in the
+// font's stats.
+static NFont::StringView formatText(NFont_FontData* data, const char* formatted_text, va_list lst)
+{
+    ScratchBuffer* scratch = getScratchBuffer();
+
+    va_list lst_copy;
+    va_copy(lst_copy, lst);
+    int length = vsnprintf(scratch->data, scratch->size, formatted_text, lst_copy);
+    va_end(lst_copy);
+
+    if(length < 0)
+        return NFont::StringView(scratch->data, strlen(scratch->data));
 
+    if(size_t(length) >= scratch->size)
+    {
+        size_t size = MAX(scratch->size*2, size_t(length) + 1);
+        delete[] scratch->data;
+        scratch->data = new char[size];
+        scratch->size = size;
+        vsnprintf(scratch->data, scratch->size, formatted_text, lst);
+    }
+
+    // Counted without locking, as measuring formatted text need not lock the font
+    if(data != NULL)
+    {
+        if(SDL_AtomicAdd(&data->stats.formatted_bytes, length) > (1 << 30))
+        {
+            FontLock lock(data->mutex);
+            collectFormatStats(&data->stats);
+        }
+        if(length >= NFONT_BUFFER_SIZE)
+            SDL_AtomicIncRef(&data->stats.long_formats);
+    }
+    return NFont::StringView(scratch->data, length);
+}
 
+static void enforceCacheBudget(NFont_FontData* data, const char* loading_string);
+static void stageNewGlyphs(NFont_FontData* data, const char* text, const char* end);
+static void syncGlyphMetrics(NFont_FontData* data);
 
+// Holds a font's shared mutex for the lifetime of the scope.  SDL_FontCache keeps one spacing, line spacing,
+// default color and filter per FC_Font, so the calling copy's are written in first and read back after.
+// Draws lock with 'drawing' set, as only they may evict the glyph cache.  Given the text, a draw's lock also
+// adds the glyphs the text needs before anything is drawn.
+class NFont::Lock
+{
+public:
+    Lock(const NFont* font, bool drawing = false)
+        : font(font), mutex(font->mutex)
+    {
+        SDL_LockMutex(mutex);
+        if(drawing)
+            enforceCacheBudget(font->shared, font->loading_string);
+        font->applyStyle();
+        updateSeenGlyphs(font->shared);
+        syncGlyphMetrics(font->shared);
+    }
+    Lock(const NFont* font, const StringView& text)
+        : font(font), mutex(font->mutex)
+    {
+        SDL_LockMutex(mutex);
+        enforceCacheBudget(font->shared, font->loading_string);
+        font->applyStyle();
+        updateSeenGlyphs(font->shared);
+        syncGlyphMetrics(font->shared);
+        stageNewGlyphs(font->shared, text.text, text.text + text.length);
+    }
+    ~Lock()
+    {
+        font->saveStyle();
+        SDL_UnlockMutex(mutex);
+    }
 
+private:
+    const NFont* font;
+    SDL_mutex* mutex;
+};
 
-void NFont::setLoadingString(const char* str)
+static bool lessKerningPair(const KerningPair& a, const KerningPair& b)
 {
-    FC_SetLoadingString(font, str);
+    return (a.first < b.first || (a.first == b.first && a.second < b.second));
 }
 
-#ifdef NFONT_USE_SDL_GPU
-bool NFont::load(TTF_Font* ttf)
-#else
+// SDL_FontCache only knows the line metrics of fonts it loads from a TTF, so bitmap fonts keep theirs
+// with the font's data.
+struct BitmapFontMetrics
+{
+    Uint16 height;
+    int ascent;
+    int descent;
+    int baseline;
+    Uint16 max_width;
+};
+
+// Sets a bitmap font's metrics, or forgets them if metrics is NULL.  The font must be locked.
+static void setBitmapMetrics(NFont_FontData* data, const BitmapFontMetrics* metrics)
+{
+    delete data->bitmap_metrics;
+    data->bitmap_metrics = (metrics != NULL? new BitmapFontMetrics(*metrics) : NULL);
+}
+
+static Uint16 getLineHeight(const NFont_FontData* data)
+{
+    const BitmapFontMetrics* m = data->bitmap_metrics;
+    return (m != NULL? m->height : FC_GetLineHeight(data->font));
+}
+
+static int getFontAscent(const NFont_FontData* data)
+{
+    const BitmapFontMetrics* m = data->bitmap_metrics;
+    return (m != NULL? m->ascent : FC_GetAscent(data->font, NULL));
+}
+
+static int getFontDescent(const NFont_FontData* data)
+{
+    const BitmapFontMetrics* m = data->bitmap_metrics;
+    return (m != NULL? m->descent : FC_GetDescent(data->font, NULL));
+}
+
+static int getFontBaseline(const NFont_FontData* data)
+{
+    const BitmapFontMetrics* m = data->bitmap_metrics;
+    return (m != NULL? m->baseline : FC_GetBaseline(data->font));
+}
+
+static Uint16 getFontMaxWidth(const NFont_FontData* data)
+{
+    const BitmapFontMetrics* m = data->bitmap_metrics;
+    return (m != NULL? m->max_width : FC_GetMaxWidth(data->font));
+}
+
+// The font's kerning pairs, valid while the font is locked and loaded
+static const KerningTable* getKerning(const NFont_FontData* data)
+{
+    return (data->kerning.empty()? NULL : &data->kerning);
+}
+
+static inline int getKerningAmount(const KerningTable* kerning, Uint32 previous, Uint32 codepoint)
+{
+    if(kerning == NULL || previous == 0)
+        return 0;
+
+    KerningPair pair = {previous, codepoint, 0};
+    KerningTable::const_iterator e = std::lower_bound(kerning->begin(), kerning->end(), pair, lessKerningPair);
+    return ((e != kerning->end() && e->first == previous && e->second == codepoint)? e->amount : 0);
+}
+
+// Reads one UTF-8 character in SDL_FontCache's packed codepoint form and moves c past it.
+static inline Uint32 readCodepoint(const char*& c, const char* end)
+{
+    Uint8 lead = (Uint8)*c;
+    int size = (lead < 0x80? 1 : (lead < 0xE0? 2 : (lead < 0xF0? 3 : 4)));
+    if(size > end - c)
+        size = int(end - c);
+
+    Uint32 result = 0;
+    for(int i = 0; i < size; ++i)
+        result = (result << 8) | (Uint8)c[i];
+    c += size;
+    return result;
+}
+
+static inline Uint16 getGlyphAdvance(FC_Font* font, Uint32 codepoint)
+{
+    FC_GlyphData glyph;
+    if(FC_GetGlyphData(font, &glyph, codepoint) || FC_GetGlyphData(font, &glyph, ' '))
+        return glyph.rect.w;
+    return 0;
+}
+
+// Width of the widest line in [text, end), as FC_GetWidth() measures it.
+static Uint16 measureWidth(NFont_FontData* data, const char* text, const char* end)
+{
+    FC_Font* font = data->font;
+    const KerningTable* kerning = getKerning(data);
+    Uint32 previous = 0;
+    int width = 0;
+    int bigWidth = 0;
+    for(const char* c = text; c < end;)
+    {
+        if(*c == '\n')
+        {
+            bigWidth = MAX(bigWidth, width);
+            width = 0;
+            previous = 0;
+            ++c;
+            continue;
+        }
+        Uint32 codepoint = readCodepoint(c, end);
+        width += getGlyphAdvance(font, codepoint) + getKerningAmount(kerning, previous, codepoint);
+        previous = codepoint;
+    }
+    return MIN(MAX(bigWidth, width), 0xFFFF);
+}
+
+static int countLines(const char* text, const char* end)
+{
+    int numLines = 1;
+    for(const char* c = text; c < end; ++c)
+    {
+        if(*c == '\n')
+            ++numLines;
+    }
+    return numLines;
+}
+
+// Saturates like the widths, so that long text does not wrap around
+static Uint16 getLinesHeight(NFont_FontData* data, int numLines)
+{
+    Sint64 height = Sint64(getLineHeight(data))*numLines + Sint64(FC_GetLineSpacing(data->font))*(numLines - 1);
+    return Uint16(MIN(MAX(height, 0), 0xFFFF));
+}
+
+// Advances for findLineBreak() from the glyph cache of a locked font
+struct FontAdvances
+{
+    FC_Font* font;
+    const KerningTable* kerning;
+
+    int operator()(Uint32 previous, Uint32 codepoint) const
+    {
+        return getGlyphAdvance(font, codepoint) + getKerningAmount(kerning, previous, codepoint);
+    }
+};
+
+// Finds the end of the line starting at 'begin' when wrapped to 'width' (no wrapping if width <= 0).
+// Lines break at spaces, always keeping at least one word, as SDL_FontCache does.
+// 'next' receives the start of the following line.  Returns NULL if 'advances' has no advance (-1) for a glyph.
+template<class Advances>
+static const char* findLineBreak(const Advances& advances, const char* begin, const char* end, int width, const char** next)
+{
+    Uint32 previous = 0;
+    int lineWidth = 0;
+    const char* wordStart = NULL;
+    const char* c = begin;
+    while(c < end && *c != '\n')
+    {
+        Uint32 codepoint = readCodepoint(c, end);
+        int advance = advances(previous, codepoint);
+        if(advance < 0)
+            return NULL;
+        lineWidth += advance;
+        previous = codepoint;
+        if(codepoint == ' ')
+        {
+            wordStart = c;
+            continue;
+        }
+
+        if(width > 0 && lineWidth > width && wordStart != NULL)
+        {
+            *next = wordStart;
+            return wordStart;
+        }
+    }
+
+    *next = (c < end? c + 1 : c);
+    return c;
+}
+
+static const char* findLineBreak(NFont_FontData* data, const char* begin, const char* end, int width, const char** next)
+{
+    FontAdvances advances = {data->font, getKerning(data)};
+    return findLineBreak(advances, begin, end, width, next);
+}
+
+// Returns -1 if 'advances' has no advance for a glyph
+template<class Advances>
+static int countWrappedLines(const Advances& advances, const char* text, const char* end, int width)
+{
+    int numLines = 0;
+    const char* c = text;
+    while(1)
+    {
+        const char* next;
+        const char* lineEnd = findLineBreak(advances, c, end, width, &next);
+        if(lineEnd == NULL)
+            return -1;
+        ++numLines;
+        if(lineEnd == end)
+            break;
+        c = next;
+    }
+    return numLines;
+}
+
+// Writes the wrapped lines joined by '\n', truncated to fit.  Returns the number of bytes written.
+static int writeWrappedText(NFont_FontData* data, char* result, int max_result_size, const char* text, const char* end, int width)
+{
+    NFont_Stats* stats = &data->stats;
+    if(result == NULL || max_result_size <= 0)
+        return 0;
+
+    TraceScope trace("NFont wrap", getFontID(stats), Uint64(end - text));
+    int size = 0;
+    bool truncated = false;
+    const char* c = text;
+    while(1)
+    {
+        const char* next;
+        const char* lineEnd = findLineBreak(data, c, end, width, &next);
+        if(c != text)
+        {
+            if(size < max_result_size - 1)
+                result[size++] = '\n';
+            else
+                truncated = true;
+        }
+
+        int lineSize = MIN(int(lineEnd - c), max_result_size - 1 - size);
+        if(lineSize < lineEnd - c)
+            truncated = true;
+        memcpy(result + size, c, lineSize);
+        size += lineSize;
+
+        if(lineEnd == end)
+            break;
+        c = next;
+    }
+    result[size] = '\0';
+    if(truncated)
+        ++stats->counts.truncations;
+    return size;
+}
+
+static NFont::Rectf alignBounds(float x, float y, NFont::AlignEnum align, float w, float h)
+{
+    if(align == NFont::CENTER)
+        x -= w/2;
+    else if(align == NFont::RIGHT)
+        x -= w;
+    return NFont::Rectf(x, y, w, h);
+}
+
+static inline Uint32 makeGlyphMetrics(GlyphMetricsState state, Uint16 advance, Uint16 height)
+{
+    return (Uint32(state) << 30) | (Uint32(MIN(height, 0x3FFF)) << 16) | advance;
+}
+
+static inline Uint16 getGlyphMetricsAdvance(Uint32 entry)
+{
+    return Uint16(entry & 0xFFFF);
+}
+
+static inline Uint16 getGlyphMetricsHeight(Uint32 entry)
+{
+    return Uint16((entry >> 16) & 0x3FFF);
+}
+
+static inline GlyphMetricsState getGlyphMetricsState(Uint32 entry)
+{
+    return GlyphMetricsState(entry >> 30);
+}
+
+static void freeGlyphMetrics(NFont_GlyphMetrics* metrics)
+{
+    for(int p = 0; p < 17; ++p)
+    {
+        if(metrics->planes[p] == NULL)
+            continue;
+        for(int i = 0; i < 256; ++i)
+            delete metrics->planes[p][i];
+        delete[] metrics->planes[p];
+        metrics->planes[p] = NULL;
+    }
+}
+
+// Empties the glyph metrics if the font changed since they were filled.  The font must be locked.
+static void syncGlyphMetrics(NFont_FontData* data)
+{
+    NFont_GlyphMetrics* metrics = &data->metrics;
+    if(Uint32(SDL_AtomicGet(&metrics->generation)) == data->generation)
+        return;
+
+    // Readers that started before this see the generation change when they finish
+    SDL_AtomicSet(&metrics->generation, 0);
+    SDL_MemoryBarrierRelease();
+    memset(metrics->direct.entries, 0, sizeof(metrics->direct.entries));
+    for(int p = 0; p < 17; ++p)
+    {
+        if(metrics->planes[p] == NULL)
+            continue;
+        for(int i = 0; i < 256; ++i)
+        {
+            if(metrics->planes[p][i] != NULL)
+                memset(metrics->planes[p][i]->entries, 0, sizeof(metrics->planes[p][i]->entries));
+        }
+    }
+    metrics->line.height = getLineHeight(data);
+    metrics->line.ascent = getFontAscent(data);
+    metrics->line.descent = getFontDescent(data);
+    metrics->line.baseline = getFontBaseline(data);
+    metrics->line.max_width = getFontMaxWidth(data);
+    metrics->kerned = (getKerning(data) != NULL);
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&metrics->generation, int(data->generation));
+}
+
+// Allocates the page of a Unicode value if need be.  The font must be locked.
+static GlyphMetricsPage* getGlyphMetricsPage(NFont_GlyphMetrics* metrics, Uint32 unicode)
+{
+    if(unicode < 0x100)
+        return &metrics->direct;
+
+    // Published whole, as readers do not lock
+    GlyphMetricsPage**& plane = metrics->planes[unicode >> 16];
+    if(plane == NULL)
+    {
+        GlyphMetricsPage** pages = new GlyphMetricsPage*[256];
+        memset(pages, 0, 256*sizeof(GlyphMetricsPage*));
+        SDL_AtomicSetPtr((void**)&plane, pages);
+    }
+    GlyphMetricsPage*& page = plane[(unicode >> 8) & 0xFF];
+    if(page == NULL)
+    {
+        GlyphMetricsPage* newPage = new GlyphMetricsPage;
+        memset(newPage->entries, 0, sizeof(newPage->entries));
+        SDL_AtomicSetPtr((void**)&page, newPage);
+    }
+    return page;
+}
+
+// Measures a glyph, or finds it in the glyph metrics.  The font must be locked.
+static Uint32 lookupGlyphMetrics(NFont_FontData* data, Uint32 codepoint)
+{
+    Uint32 unicode;
+    GlyphMetricsPage* page = NULL;
+    if(getUnicode(codepoint, &unicode))
+    {
+        page = getGlyphMetricsPage(&data->metrics, unicode);
+        if(page->entries[unicode & 0xFF] != 0)
+            return page->entries[unicode & 0xFF];
+    }
+
+    Uint32 entry;
+    FC_GlyphData glyph;
+    if(getGlyphData(&data->stats, data->font, &glyph, codepoint))
+        entry = makeGlyphMetrics(GLYPH_PRESENT, glyph.rect.w, glyph.rect.h);
+    else
+        entry = makeGlyphMetrics(GLYPH_MISSING, getGlyphAdvance(data->font, ' '), 0);
+    if(page != NULL)
+        page->entries[unicode & 0xFF] = entry;
+    return entry;
+}
+
+// Reads a glyph's metrics without locking the font.  Returns 0 (GLYPH_UNKNOWN) if it was not measured yet.
+static inline Uint32 peekGlyphMetrics(const NFont_GlyphMetrics* metrics, Uint32 codepoint)
+{
+    Uint32 unicode;
+    if(!getUnicode(codepoint, &unicode))
+        return 0;
+    if(unicode < 0x100)
+        return metrics->direct.entries[unicode];
+
+    GlyphMetricsPage** plane = (GlyphMetricsPage**)SDL_AtomicGetPtr((void**)&metrics->planes[unicode >> 16]);
+    if(plane == NULL)
+        return 0;
+    GlyphMetricsPage* page = (GlyphMetricsPage*)SDL_AtomicGetPtr((void**)&plane[(unicode >> 8) & 0xFF]);
+    return (page != NULL? page->entries[unicode & 0xFF] : 0);
+}
+
+// Starts reading the glyph metrics without locking the font.  Returns 0 if they are being reset.
+static inline Uint32 beginPeek(const NFont_GlyphMetrics* metrics)
+{
+    return Uint32(SDL_AtomicGet((SDL_atomic_t*)&metrics->generation));
+}
+
+// Whether what was read since beginPeek() is still good
+static inline bool endPeek(const NFont_GlyphMetrics* metrics, Uint32 generation)
+{
+    SDL_MemoryBarrierAcquire();
+    return (Uint32(SDL_AtomicGet((SDL_atomic_t*)&metrics->generation)) == generation);
+}
+
+// Same result as measureWidth(), read from the glyph metrics.  The font must be locked.
+static Uint16 measureWidth(NFont_GlyphMetrics* metrics, NFont_FontData* data, const char* text, const char* end)
+{
+    syncGlyphMetrics(data);
+    // The table holds advances alone
+    if(metrics->kerned)
+        return measureWidth(data, text, end);
+
+    const GlyphMetricsPage& direct = metrics->direct;
+    int width = 0;
+    int bigWidth = 0;
+    for(const char* c = text; c < end;)
+    {
+        Uint8 b = (Uint8)*c;
+        if(b == '\n')
+        {
+            bigWidth = MAX(bigWidth, width);
+            width = 0;
+            ++c;
+            continue;
+        }
+        if(b < 0x80 && direct.entries[b] != 0)
+        {
+            width += getGlyphMetricsAdvance(direct.entries[b]);
+            ++c;
+            continue;
+        }
+
+        width += getGlyphMetricsAdvance(lookupGlyphMetrics(data, readCodepoint(c, end)));
+    }
+    return MIN(MAX(bigWidth, width), 0xFFFF);
+}
+
+// Same result as measureWidth() without locking the font.  Returns false if a glyph was not measured yet, the
+// font has kerning or it changed meanwhile, and the text must be measured with the font locked.
+static bool peekWidth(const NFont_GlyphMetrics* metrics, const char* text, const char* end, Uint16* result)
+{
+    Uint32 generation = beginPeek(metrics);
+    if(generation == 0 || metrics->kerned)
+        return false;
+
+    const GlyphMetricsPage& direct = metrics->direct;
+    int width = 0;
+    int bigWidth = 0;
+    for(const char* c = text; c < end;)
+    {
+        Uint8 b = (Uint8)*c;
+        if(b == '\n')
+        {
+            bigWidth = MAX(bigWidth, width);
+            width = 0;
+            ++c;
+            continue;
+        }
+
+        Uint32 entry;
+        if(b < 0x80)
+        {
+            entry = direct.entries[b];
+            ++c;
+        }
+        else
+            entry = peekGlyphMetrics(metrics, readCodepoint(c, end));
+        if(entry == 0)
+            return false;
+        width += getGlyphMetricsAdvance(entry);
+    }
+
+    if(!endPeek(metrics, generation))
+        return false;
+    *result = MIN(MAX(bigWidth, width), 0xFFFF);
+    return true;
+}
+
+// The font's own metrics without locking it.  False while the glyph metrics are out of date, until the font
+// is locked again.
+static bool peekLineMetrics(const NFont_GlyphMetrics* metrics, FontLineMetrics* result)
+{
+    Uint32 generation = beginPeek(metrics);
+    if(generation == 0)
+        return false;
+    *result = metrics->line;
+    return endPeek(metrics, generation);
+}
+
+// Same result as getLinesHeight() without locking the font, for a copy with the given line spacing
+static bool peekLinesHeight(const NFont_GlyphMetrics* metrics, int numLines, int line_spacing, Uint16* result)
+{
+    Uint32 generation = beginPeek(metrics);
+    if(generation == 0)
+        return false;
+    Uint16 lineHeight = metrics->line.height;
+    if(!endPeek(metrics, generation))
+        return false;
+    Sint64 height = Sint64(lineHeight)*numLines + Sint64(line_spacing)*(numLines - 1);
+    *result = Uint16(MIN(MAX(height, 0), 0xFFFF));
+    return true;
+}
+
+// Advances for findLineBreak() from the glyph metrics, without locking the font.  -1 if a glyph was not measured.
+struct PeekedAdvances
+{
+    const NFont_GlyphMetrics* metrics;
+
+    int operator()(Uint32, Uint32 codepoint) const
+    {
+        Uint32 entry = peekGlyphMetrics(metrics, codepoint);
+        return (entry != 0? getGlyphMetricsAdvance(entry) : -1);
+    }
+};
+
+// Advances for findLineBreak() from the glyph metrics of a locked font, which they fill in for PeekedAdvances
+struct MeasuredAdvances
+{
+    NFont_FontData* data;
+    const KerningTable* kerning;
+
+    int operator()(Uint32 previous, Uint32 codepoint) const
+    {
+        return getGlyphMetricsAdvance(lookupGlyphMetrics(data, codepoint)) + getKerningAmount(kerning, previous, codepoint);
+    }
+};
+
+// Counts the lines of [text, end) wrapped to 'width'.  The font must be locked.
+static int measureWrappedLines(NFont_FontData* data, const char* text, const char* end, int width)
+{
+    TraceScope trace("NFont wrap", data->stats.font_id, Uint64(end - text));
+    syncGlyphMetrics(data);
+    MeasuredAdvances advances = {data, getKerning(data)};
+    return countWrappedLines(advances, text, end, width);
+}
+
+// Same result as measureWrappedLines() without locking the font
+static bool peekWrappedLines(const NFont_GlyphMetrics* metrics, const char* text, const char* end, int width, int* numLines)
+{
+    Uint32 generation = beginPeek(metrics);
+    if(generation == 0 || metrics->kerned)
+        return false;
+
+    PeekedAdvances advances = {metrics};
+    int count = countWrappedLines(advances, text, end, width);
+    if(count < 0 || !endPeek(metrics, generation))
+        return false;
+    *numLines = count;
+    return true;
+}
+
+// Measures the ascent of a string as SDL_FontCache does: the tallest glyph it uses.  The font must be locked.
+static int measureAscent(NFont_FontData* data, const char* text, const char* end)
+{
+    syncGlyphMetrics(data);
+    int max = 0;
+    for(const char* c = text; c < end;)
+    {
+        int height = getGlyphMetricsHeight(lookupGlyphMetrics(data, readCodepoint(c, end)));
+        if(height > max)
+            max = height;
+    }
+    return max;
+}
+
+static int measureDescent(NFont_FontData* data, const char* text, const char* end)
+{
+    syncGlyphMetrics(data);
+    for(const char* c = text; c < end;)
+    {
+        if(getGlyphMetricsState(lookupGlyphMetrics(data, readCodepoint(c, end))) == GLYPH_PRESENT)
+            return getFontDescent(data);
+    }
+    return 0;
+}
+
+// The opt-in cache of recent getWidth(), getBounds() and getColumnHeight() results
+enum MeasureKind
+{
+    MEASURE_WIDTH,
+    MEASURE_BOUNDS,
+    MEASURE_COLUMN_HEIGHT
+};
+
+struct MeasureKey
+{
+    Uint32 hash;
+    int kind;
+    Uint16 width;
+    int alignment;
+    float scale_x, scale_y;
+    const char* text;
+    size_t length;
+};
+
+struct MeasureEntry
+{
+    Uint32 hash;
+    int kind;
+    Uint16 width;
+    int alignment;
+    float scale_x, scale_y;
+    std::string text;
+    NFont::Rectf result;  // Bounds are stored for the origin
+};
+
+typedef std::list<MeasureEntry> MeasureList;
+typedef std::multimap<Uint32, MeasureList::iterator> MeasureIndex;
+
+struct NFont_MeasureCache
+{
+    Uint32 generation;
+    int max_entries;
+    Uint32 max_bytes;
+    Uint32 bytes;
+    MeasureList entries;  // Most recently used first
+    MeasureIndex index;
+    Uint32 hits;
+    Uint32 misses;
+};
+
+static inline Uint32 hashBytes(Uint32 hash, const void* data, size_t size)
+{
+    // FNV-1a
+    const Uint8* c = (const Uint8*)data;
+    for(size_t i = 0; i < size; ++i)
+        hash = (hash ^ c[i])*16777619u;
+    return hash;
+}
+
+static const MeasureKey& makeMeasureKey(MeasureKey* key, int kind, const NFont::StringView& text, Uint16 width, const NFont::Effect& effect)
+{
+    key->kind = kind;
+    key->width = width;
+    key->alignment = effect.alignment;
+    key->scale_x = effect.scale.x;
+    key->scale_y = effect.scale.y;
+    key->text = text.text;
+    key->length = text.length;
+
+    Uint32 hash = 2166136261u;
+    hash = hashBytes(hash, &key->kind, sizeof(key->kind));
+    hash = hashBytes(hash, &key->width, sizeof(key->width));
+    hash = hashBytes(hash, &key->alignment, sizeof(key->alignment));
+    hash = hashBytes(hash, &key->scale_x, sizeof(key->scale_x));
+    hash = hashBytes(hash, &key->scale_y, sizeof(key->scale_y));
+    key->hash = hashBytes(hash, text.text, text.length);
+    return *key;
+}
+
+static inline Uint32 getMeasureEntryBytes(const MeasureEntry& entry)
+{
+    return Uint32(sizeof(MeasureEntry) + sizeof(MeasureIndex::value_type) + entry.text.size());
+}
+
+static void clearMeasureCache(NFont_MeasureCache* cache)
+{
+    cache->entries.clear();
+    cache->index.clear();
+    cache->bytes = 0;
+}
+
+static void eraseMeasureEntry(NFont_MeasureCache* cache, MeasureList::iterator entry)
+{
+    std::pair<MeasureIndex::iterator, MeasureIndex::iterator> range = cache->index.equal_range(entry->hash);
+    for(MeasureIndex::iterator e = range.first; e != range.second; ++e)
+    {
+        if(e->second == entry)
+        {
+            cache->index.erase(e);
+            break;
+        }
+    }
+    cache->bytes -= getMeasureEntryBytes(*entry);
+    cache->entries.erase(entry);
+}
+
+// Looks up a result, dropping everything first if the font changed since it was cached.
+static bool findMeasure(NFont_MeasureCache* cache, Uint32 generation, const MeasureKey& key, NFont::Rectf* result)
+{
+    if(cache == NULL)
+        return false;
+
+    if(cache->generation != generation)
+    {
+        clearMeasureCache(cache);
+        cache->generation = generation;
+    }
+
+    std::pair<MeasureIndex::iterator, MeasureIndex::iterator> range = cache->index.equal_range(key.hash);
+    for(MeasureIndex::iterator e = range.first; e != range.second; ++e)
+    {
+        const MeasureEntry& entry = *e->second;
+        if(entry.kind == key.kind && entry.width == key.width && entry.alignment == key.alignment
+           && entry.scale_x == key.scale_x && entry.scale_y == key.scale_y
+           && entry.text.size() == key.length && memcmp(entry.text.data(), key.text, key.length) == 0)
+        {
+            cache->entries.splice(cache->entries.begin(), cache->entries, e->second);
+            *result = entry.result;
+            ++cache->hits;
+            return true;
+        }
+    }
+
+    ++cache->misses;
+    return false;
+}
+
+static void storeMeasure(NFont_MeasureCache* cache, const MeasureKey& key, const NFont::Rectf& result)
+{
+    if(cache == NULL)
+        return;
+
+    MeasureEntry entry;
+    entry.hash = key.hash;
+    entry.kind = key.kind;
+    entry.width = key.width;
+    entry.alignment = key.alignment;
+    entry.scale_x = key.scale_x;
+    entry.scale_y = key.scale_y;
+    entry.result = result;
+    if(getMeasureEntryBytes(entry) + key.length > cache->max_bytes)
+        return;
+    entry.text.assign(key.text, key.length);
+
+    cache->entries.push_front(entry);
+    cache->index.insert(MeasureIndex::value_type(key.hash, cache->entries.begin()));
+    cache->bytes += getMeasureEntryBytes(entry);
+
+    while(int(cache->index.size()) > cache->max_entries || cache->bytes > cache->max_bytes)
+        eraseMeasureEntry(cache, --cache->entries.end());
+}
+
+// Caret rectangle after 'position_index' characters (newlines included), relative to the text's upper-left corner.
+static NFont::Rectf measureCharacterOffset(NFont_FontData* data, Uint16 position_index, int column_width, const char* text, const char* end)
+{
+    FC_Font* font = data->font;
+    NFont::Rectf result(0, 0, 1, getLineHeight(data));
+    if(column_width == 0 || position_index == 0)
+        return result;
+
+    const KerningTable* kerning = getKerning(data);
+    int spacing = FC_GetSpacing(font);
+    int lineNum = 0;
+    const char* c = text;
+    while(1)
+    {
+        const char* next;
+        const char* lineEnd = findLineBreak(data, c, end, column_width, &next);
+
+        float x = 0;
+        Uint32 previous = 0;
+        while(c < lineEnd && position_index > 0)
+        {
+            Uint32 codepoint = readCodepoint(c, lineEnd);
+            x += getGlyphAdvance(font, codepoint) + getKerningAmount(kerning, previous, codepoint) + spacing;
+            previous = codepoint;
+            --position_index;
+        }
+
+        if(position_index == 0 || lineEnd == end)
+        {
+            result.x = x;
+            result.y = lineNum*(getLineHeight(data) + FC_GetLineSpacing(font));
+            return result;
+        }
+
+        // Step over the newline itself
+        if(next != lineEnd)
+            --position_index;
+        c = next;
+        ++lineNum;
+    }
+}
+
+static Uint16 measurePositionFromOffset(NFont_FontData* data, float x, float y, int column_width, NFont::AlignEnum align, const char* text, const char* end)
+{
+    FC_Font* font = data->font;
+    if(column_width == 0)
+        return 0;
+
+    const KerningTable* kerning = getKerning(data);
+    int spacing = FC_GetSpacing(font);
+    int lineAdvance = getLineHeight(data) + FC_GetLineSpacing(font);
+    int targetLine = (y < 0? 0 : int(y)/MAX(1, lineAdvance));
+
+    Uint16 position = 0;
+    int lineNum = 0;
+    const char* c = text;
+    while(1)
+    {
+        const char* next;
+        const char* lineEnd = findLineBreak(data, c, end, column_width, &next);
+
+        if(lineNum == targetLine || lineEnd == end)
+        {
+            float lineWidth = measureWidth(data, c, lineEnd);
+            float lineX = 0;
+            if(align == NFont::CENTER)
+                lineX = (column_width > 0? (column_width - lineWidth)/2 : -lineWidth/2);
+            else if(align == NFont::RIGHT)
+                lineX = (column_width > 0? column_width - lineWidth : -lineWidth);
+
+            Uint32 previous = 0;
+            while(c < lineEnd)
+            {
+                Uint32 codepoint = readCodepoint(c, lineEnd);
+                float advance = getGlyphAdvance(font, codepoint) + getKerningAmount(kerning, previous, codepoint) + spacing;
+                previous = codepoint;
+                if(x < lineX + advance/2)
+                    break;
+                lineX += advance;
+                ++position;
+            }
+            return position;
+        }
+
+        while(c < next)
+        {
+            readCodepoint(c, next);
+            ++position;
+        }
+        ++lineNum;
+    }
+}
+
+// Glyph quads recorded by an NFont::Batch
+struct BatchQuad
+{
+    NFont_Image* image;
+    int run;  // Index into NFont_BatchData::runs
+    float x, y, w, h;
+    float src_x, src_y, src_w, src_h;
+    SDL_Color color;
+};
+
+// Quads that submit together from one atlas texture.  Runs submit in the order they were started.
+struct BatchRun
+{
+    NFont_Image* image;
+    float x1, y1, x2, y2;  // Bounds of the run's quads
+};
+
+struct NFont_BatchData
+{
+    NFont_Target* dest;
+    std::vector<BatchQuad> quads;
+    std::vector<BatchRun> runs;
+    bool use_clip;
+    NFont::Rectf clip;
+
+    #ifdef NFONT_USE_SDL_GPU
+    std::vector<float> values;
+    std::vector<unsigned short> indices;
+    #else
+    std::vector<SDL_Vertex> vertices;
+    std::vector<int> indices;
+    #endif
+};
+
+#ifdef NFONT_USE_SDL_GPU
+// Cache levels that NFont packs from white glyphs are alpha-only images, a quarter of the memory of RGBA.
+// SDL_gpu's default shader samples those as black, so they are drawn with this one, which takes the color
+// from the vertices and the coverage from the texture.  Linked once per renderer, on the rendering thread.
+struct AlphaShader
+{
+    GPU_Renderer* renderer;  // That it was made for
+    Uint32 program;
+    GPU_ShaderBlock block;
+    bool failed;  // No shaders or it did not link, so the levels stay RGBA
+};
+
+static AlphaShader alpha_shader;
+
+// In the shader language of SDL_gpu's own shaders, so it links with its default vertex shader
+static const char* getAlphaShaderSource(const GPU_Renderer* renderer)
+{
+    if(renderer->shader_language == GPU_LANGUAGE_GLSLES)
+    {
+        if(renderer->id.major_version >= 3)
+            return "#version 300 es\nprecision mediump float;\nin vec4 color;\nin vec2 texCoord;\nuniform sampler2D tex;\nout vec4 fragColor;\n"
+                   "void main(void)\n{\n    fragColor = vec4(color.rgb, color.a*texture(tex, texCoord).a);\n}\n";
+        return "#version 100\nprecision mediump float;\nvarying vec4 color;\nvarying vec2 texCoord;\nuniform sampler2D tex;\n"
+               "void main(void)\n{\n    gl_FragColor = vec4(color.rgb, color.a*texture2D(tex, texCoord).a);\n}\n";
+    }
+    if(renderer->shader_language == GPU_LANGUAGE_GLSL)
+    {
+        if(renderer->id.major_version >= 3)
+            return "#version 130\nin vec4 color;\nin vec2 texCoord;\nuniform sampler2D tex;\nout vec4 fragColor;\n"
+                   "void main(void)\n{\n    fragColor = vec4(color.rgb, color.a*texture(tex, texCoord).a);\n}\n";
+        return "#version 110\nvarying vec4 color;\nvarying vec2 texCoord;\nuniform sampler2D tex;\n"
+               "void main(void)\n{\n    gl_FragColor = vec4(color.rgb, color.a*texture2D(tex, texCoord).a);\n}\n";
+    }
+    return NULL;
+}
+
+// Whether alpha-only levels can be drawn with the current renderer
+static bool loadAlphaShader()
+{
+    GPU_Renderer* renderer = GPU_GetCurrentRenderer();
+    if(renderer == NULL)
+        return false;
+    if(alpha_shader.renderer == renderer)
+        return !alpha_shader.failed;
+
+    alpha_shader.renderer = renderer;
+    alpha_shader.program = 0;
+    alpha_shader.failed = true;
+    GPU_Target* context = GPU_GetContextTarget();
+    const char* source = getAlphaShaderSource(renderer);
+    if(!(renderer->enabled_features & GPU_FEATURE_BASIC_SHADERS) || context == NULL || context->context == NULL || source == NULL)
+        return false;
+
+    Uint32 fragment = GPU_CompileShader(GPU_FRAGMENT_SHADER, source);
+    if(fragment == 0)
+        return false;
+    alpha_shader.program = GPU_LinkShaders(context->context->default_textured_vertex_shader_id, fragment);
+    GPU_FreeShader(fragment);
+    if(alpha_shader.program == 0)
+        return false;
+
+    alpha_shader.block = GPU_LoadShaderBlock(alpha_shader.program, "gpu_Vertex", "gpu_TexCoord", "gpu_Color", "gpu_ModelViewProjectionMatrix");
+    alpha_shader.failed = false;
+    return true;
+}
+
+// Activates the alpha shader while it lives, for drawing from an alpha-only level, and then the program that
+// was active before
+class AlphaBlit
+{
+public:
+    explicit AlphaBlit(NFont_Image* image)
+        : previous(0), active(false)
+    {
+        if(image == NULL || image->format != GPU_FORMAT_ALPHA || !loadAlphaShader())
+            return;
+
+        previous = GPU_GetCurrentShaderProgram();
+        block = GPU_GetContextTarget()->context->current_shader_block;
+        GPU_ActivateShaderProgram(alpha_shader.program, &alpha_shader.block);
+        active = true;
+    }
+
+    ~AlphaBlit()
+    {
+        if(active)
+            GPU_ActivateShaderProgram(previous, &block);
+    }
+
+private:
+    Uint32 previous;
+    GPU_ShaderBlock block;
+    bool active;
+};
+
+// Uploads coverage as an alpha-only cache level, if the alpha shader can draw it.  Set up like SDL_FontCache
+// sets up its own levels.
+static bool uploadAlphaLevel(FC_Font* font, Uint32 font_id, int level, const Uint8* coverage, int w, int h)
+{
+    if(!loadAlphaShader())
+        return false;
+
+    Uint64 bytes = Uint64(w)*h;
+    TraceScope trace("NFont cache level", font_id, bytes);
+    TraceScope uploadTrace("NFont texture upload", font_id, bytes);
+    GPU_Image* image = GPU_CreateImage(Uint16(w), Uint16(h), GPU_FORMAT_ALPHA);
+    if(image == NULL)
+        return false;
+
+    GPU_SetAnchor(image, 0.5f, 0.5f);
+    GPU_SetImageFilter(image, (FC_GetFilterMode(font) == FC_FILTER_LINEAR? GPU_FILTER_LINEAR : GPU_FILTER_NEAREST));
+    GPU_UpdateImageBytes(image, NULL, coverage, w);
+    if(!FC_SetGlyphCacheLevel(font, level, image))
+    {
+        GPU_FreeImage(image);
+        return false;
+    }
+    return true;
+}
+#endif
+
+// The batch that draws are currently recorded into.  Rendering belongs to one thread, so this is not locked.
+static NFont_BatchData* active_batch = NULL;
+
+static bool compareBatchQuads(const BatchQuad& A, const BatchQuad& B)
+{
+    return A.run < B.run;
+}
+
+// Finds the run for a new quad.  Joining an earlier run draws the quad before every later run, so it may only
+// skip back over runs that it does not overlap.  Overlapping glyphs keep their draw order.
+static int getBatchRun(NFont_BatchData* batch, NFont_Image* image, float x1, float y1, float x2, float y2)
+{
+    int numRuns = int(batch->runs.size());
+    for(int i = numRuns - 1; i >= 0; --i)
+    {
+        BatchRun& r = batch->runs[i];
+        if(r.image == image)
+        {
+            r.x1 = MIN(r.x1, x1);
+            r.y1 = MIN(r.y1, y1);
+            r.x2 = MAX(r.x2, x2);
+            r.y2 = MAX(r.y2, y2);
+            return i;
+        }
+        if(x1 < r.x2 && r.x1 < x2 && y1 < r.y2 && r.y1 < y2)
+            break;
+    }
+
+    BatchRun r = {image, x1, y1, x2, y2};
+    batch->runs.push_back(r);
+    return numRuns;
+}
+
+static void addBatchQuad(NFont_BatchData* batch, NFont_Image* image, const SDL_Rect& srcrect, float x, float y, float w, float h, const SDL_Color& color)
+{
+    BatchQuad q;
+    q.x = x;
+    q.y = y;
+    q.w = w;
+    q.h = h;
+    q.src_x = srcrect.x;
+    q.src_y = srcrect.y;
+    q.src_w = srcrect.w;
+    q.src_h = srcrect.h;
+    q.color = color;
+
+    // The target's clip rect is only known at submission, so drawBox() clipping is done here.
+    if(batch->use_clip)
+    {
+        float x1 = MAX(x, batch->clip.x);
+        float y1 = MAX(y, batch->clip.y);
+        float x2 = MIN(x + w, batch->clip.x + batch->clip.w);
+        float y2 = MIN(y + h, batch->clip.y + batch->clip.h);
+        if(x2 <= x1 || y2 <= y1 || w == 0 || h == 0)
+            return;
+
+        q.src_x += (x1 - x)*q.src_w/w;
+        q.src_y += (y1 - y)*q.src_h/h;
+        q.src_w *= (x2 - x1)/w;
+        q.src_h *= (y2 - y1)/h;
+        q.x = x1;
+        q.y = y1;
+        q.w = x2 - x1;
+        q.h = y2 - y1;
+    }
+
+    q.image = image;
+    q.run = getBatchRun(batch, image, q.x, q.y, q.x + q.w, q.y + q.h);
+    batch->quads.push_back(q);
+}
+
+// Submits one run of quads that share an atlas texture
+static void submitBatchRun(NFont_BatchData* batch, const BatchQuad* quads, int count)
+{
+    NFont_Image* image = quads[0].image;
+
+    #ifdef NFONT_USE_SDL_GPU
+    // Vertex colors replace the image color, and indices are 16-bit.
+    AlphaBlit alpha(image);
+    GPU_UnsetColor(image);
+    const int maxQuads = 0xFFFF/4;
+    for(int start = 0; start < count; start += maxQuads)
+    {
+        int n = MIN(maxQuads, count - start);
+        batch->values.resize(n*4*8);
+        batch->indices.resize(n*6);
+        float* v = &batch->values[0];
+        unsigned short* idx = &batch->indices[0];
+        for(int i = 0; i < n; ++i)
+        {
+            const BatchQuad& q = quads[start + i];
+            float s1 = q.src_x/image->texture_w, t1 = q.src_y/image->texture_h;
+            float s2 = (q.src_x + q.src_w)/image->texture_w, t2 = (q.src_y + q.src_h)/image->texture_h;
+            float r = q.color.r/255.0f, g = q.color.g/255.0f, b = q.color.b/255.0f, a = q.color.a/255.0f;
+            float corners[4][4] = {{q.x, q.y, s1, t1}, {q.x + q.w, q.y, s2, t1}, {q.x + q.w, q.y + q.h, s2, t2}, {q.x, q.y + q.h, s1, t2}};
+            for(int c = 0; c < 4; ++c)
+            {
+                *v++ = corners[c][0];
+                *v++ = corners[c][1];
+                *v++ = corners[c][2];
+                *v++ = corners[c][3];
+                *v++ = r;
+                *v++ = g;
+                *v++ = b;
+                *v++ = a;
+            }
+            unsigned short base = i*4;
+            *idx++ = base;
+            *idx++ = base + 1;
+            *idx++ = base + 2;
+            *idx++ = base;
+            *idx++ = base + 2;
+            *idx++ = base + 3;
+        }
+        GPU_TriangleBatch(image, batch->dest, n*4, &batch->values[0], n*6, &batch->indices[0], GPU_BATCH_XY_ST_RGBA);
+    }
+    #elif SDL_VERSION_ATLEAST(2,0,18)
+    // Vertex colors carry each draw's color, so the texture itself must not tint.
+    SDL_SetTextureColorMod(image, 255, 255, 255);
+    SDL_SetTextureAlphaMod(image, 255);
+    int texture_w, texture_h;
+    SDL_QueryTexture(image, NULL, NULL, &texture_w, &texture_h);
+
+    batch->vertices.resize(count*4);
+    batch->indices.resize(count*6);
+    SDL_Vertex* v = &batch->vertices[0];
+    int* idx = &batch->indices[0];
+    for(int i = 0; i < count; ++i)
+    {
+        const BatchQuad& q = quads[i];
+        float s1 = q.src_x/texture_w, t1 = q.src_y/texture_h;
+        float s2 = (q.src_x + q.src_w)/texture_w, t2 = (q.src_y + q.src_h)/texture_h;
+        SDL_Vertex corners[4] = {
+            {{q.x, q.y}, q.color, {s1, t1}},
+            {{q.x + q.w, q.y}, q.color, {s2, t1}},
+            {{q.x + q.w, q.y + q.h}, q.color, {s2, t2}},
+            {{q.x, q.y + q.h}, q.color, {s1, t2}}
+        };
+        memcpy(v, corners, sizeof(corners));
+        v += 4;
+
+        int base = i*4;
+        *idx++ = base;
+        *idx++ = base + 1;
+        *idx++ = base + 2;
+        *idx++ = base;
+        *idx++ = base + 2;
+        *idx++ = base + 3;
+    }
+    SDL_RenderGeometry(batch->dest, image, &batch->vertices[0], count*4, &batch->indices[0], count*6);
+    #else
+    // No geometry API before SDL 2.0.18, so fall back to one copy per glyph.
+    for(int i = 0; i < count; ++i)
+    {
+        const BatchQuad& q = quads[i];
+        if(i == 0 || memcmp(&q.color, &quads[i-1].color, sizeof(SDL_Color)) != 0)
+        {
+            SDL_SetTextureColorMod(image, q.color.r, q.color.g, q.color.b);
+            SDL_SetTextureAlphaMod(image, q.color.a);
+        }
+        SDL_Rect sr = {int(q.src_x), int(q.src_y), int(q.src_w), int(q.src_h)};
+        SDL_Rect dr = {int(q.x), int(q.y), int(q.w), int(q.h)};
+        SDL_RenderCopy(batch->dest, image, &sr, &dr);
+    }
+    #endif
+}
+
+static void submitBatch(NFont_BatchData* batch)
+{
+    if(batch->quads.empty())
+        return;
+
+    // Batches can mix fonts, so the zone has no font ID
+    TraceScope trace("NFont submit", 0);
+    trace.zone.glyphs = Uint32(batch->quads.size());
+    // Only quads that do not overlap what they skip over move, and they keep their order within a run.
+    if(batch->runs.size() > 1)
+        std::stable_sort(batch->quads.begin(), batch->quads.end(), compareBatchQuads);
+
+    const BatchQuad* quads = &batch->quads[0];
+    int numQuads = int(batch->quads.size());
+    int start = 0;
+    for(int i = 1; i <= numQuads; ++i)
+    {
+        if(i == numQuads || quads[i].run != quads[start].run)
+        {
+            submitBatchRun(batch, quads + start, i - start);
+            start = i;
+        }
+    }
+
+    batch->quads.clear();
+    batch->runs.clear();
+}
+
+static inline void setImageColor(NFont_Image* image, const SDL_Color& color)
+{
+    #ifdef NFONT_USE_SDL_GPU
+    GPU_SetColor(image, color);
+    #else
+    SDL_SetTextureColorMod(image, color.r, color.g, color.b);
+    SDL_SetTextureAlphaMod(image, color.a);
+    #endif
+}
+
+static void setCacheColor(FC_Font* font, const SDL_Color& color)
+{
+    int numLevels = FC_GetNumCacheLevels(font);
+    for(int i = 0; i < numLevels; ++i)
+        setImageColor(FC_GetGlyphCacheLevel(font, i), color);
+}
+
+static NFont::Rectf renderGlyph(NFont_Image* src, const SDL_Rect& srcrect, NFont_Target* dest, float x, float y, float scale_x, float scale_y, const SDL_Color& color)
+{
+    float w = srcrect.w*scale_x;
+    float h = srcrect.h*scale_y;
+
+    if(active_batch != NULL && active_batch->dest == dest)
+    {
+        addBatchQuad(active_batch, src, srcrect, x, y, w, h, color);
+        return NFont::Rectf(x, y, w, h);
+    }
+
+    #ifdef NFONT_USE_SDL_GPU
+    AlphaBlit alpha(src);
+    GPU_Rect r = GPU_MakeRect(srcrect.x, srcrect.y, srcrect.w, srcrect.h);
+    GPU_BlitScale(src, &r, dest, x + w/2.0f, y + h/2.0f, scale_x, scale_y);
+    #else
+    SDL_Rect dr = {int(x), int(y), int(w), int(h)};
+    SDL_RenderCopy(dest, src, &srcrect, &dr);
+    #endif
+
+    return NFont::Rectf(x, y, w, h);
+}
+
+// Draws one line (no newlines) with its left edge at x.  Returns the dirty rect.
+static NFont::Rectf renderLine(NFont_FontData* data, NFont_Target* dest, float x, float y, float scale_x, float scale_y, const SDL_Color& color, const char* text, const char* end)
+{
+    FC_Font* font = data->font;
+    NFont_Stats* stats = &data->stats;
+    NFont::Rectf dirty(x, y, 0, 0);
+    const KerningTable* kerning = getKerning(data);
+    Uint32 previous = 0;
+    float spacing = FC_GetSpacing(font)*scale_x;
+    int numLevels = FC_GetNumCacheLevels(font);
+
+    for(const char* c = text; c < end;)
+    {
+        FC_GlyphData glyph;
+        Uint32 codepoint = readCodepoint(c, end);
+        x += getKerningAmount(kerning, previous, codepoint)*scale_x;
+        previous = codepoint;
+        if(!getGlyphData(stats, font, &glyph, codepoint))
+        {
+            codepoint = ' ';
+            if(!FC_GetGlyphData(font, &glyph, codepoint))
+                continue;
+        }
+
+        if(codepoint != ' ')
+        {
+            ++stats->counts.glyphs_submitted;
+            NFont_Image* image = FC_GetGlyphCacheLevel(font, glyph.cache_level);
+            if(glyph.cache_level >= numLevels)
+            {
+                // This glyph started a new cache level, so color it like the others
+                setImageColor(image, color);
+                numLevels = glyph.cache_level + 1;
+            }
+
+            touchCacheLevel(data, glyph.cache_level);
+            NFont::Rectf r = renderGlyph(image, glyph.rect, dest, x, y, scale_x, scale_y, color);
+            dirty = ((dirty.w == 0 || dirty.h == 0)? r : rectUnion(dirty, r));
+        }
+        x += glyph.rect.w*scale_x + spacing;
+    }
+    return dirty;
+}
+
+static NFont::Rectf renderAlignedLine(NFont_FontData* data, NFont_Target* dest, float x, float y, NFont::AlignEnum align, float scale_x, float scale_y, const SDL_Color& color, const char* text, const char* end)
+{
+    if(align == NFont::CENTER)
+        x -= measureWidth(data, text, end)*scale_x/2.0f;
+    else if(align == NFont::RIGHT)
+        x -= measureWidth(data, text, end)*scale_x;
+    return renderLine(data, dest, x, y, scale_x, scale_y, color, text, end);
+}
+
+static NFont::Rectf drawText(NFont_FontData* data, NFont_Target* dest, float x, float y, const NFont::Effect& effect, const char* text, const char* end)
+{
+    FC_Font* font = data->font;
+    NFont_Stats* stats = &data->stats;
+    NFont::Rectf result(x, y, 0, 0);
+    if(text == NULL || FC_GetNumCacheLevels(font) == 0)
+        return result;
+
+    TraceScope trace("NFont draw", stats->font_id, end - text);
+    Uint64 submitted = stats->counts.glyphs_submitted;
+    ++stats->counts.draw_calls;
+    SDL_Color color = (effect.use_color? effect.color.to_SDL_Color() : FC_GetDefaultColor(font));
+    setCacheColor(font, color);
+
+    float lineAdvance = (getLineHeight(data) + FC_GetLineSpacing(font))*effect.scale.y;
+    const char* line = text;
+    while(1)
+    {
+        const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+        if(lineEnd == NULL)
+            lineEnd = end;
+
+        NFont::Rectf r = renderAlignedLine(data, dest, x, y, effect.alignment, effect.scale.x, effect.scale.y, color, line, lineEnd);
+        if(r.w > 0 && r.h > 0)
+            result = ((result.w == 0 || result.h == 0)? r : rectUnion(result, r));
+
+        if(lineEnd == end)
+            break;
+        line = lineEnd + 1;
+        y += lineAdvance;
+    }
+    trace.zone.glyphs = Uint32(stats->counts.glyphs_submitted - submitted);
+    return result;
+}
+
+static NFont::Rectf drawColumnText(NFont_FontData* data, NFont_Target* dest, float x, float y, Uint16 width, const NFont::Effect& effect, const char* text, const char* end)
+{
+    FC_Font* font = data->font;
+    NFont_Stats* stats = &data->stats;
+    if(text == NULL || FC_GetNumCacheLevels(font) == 0)
+        return NFont::Rectf(x, y, 0, 0);
+
+    TraceScope trace("NFont draw", stats->font_id, end - text);
+    Uint64 submitted = stats->counts.glyphs_submitted;
+    ++stats->counts.draw_calls;
+    SDL_Color color = (effect.use_color? effect.color.to_SDL_Color() : FC_GetDefaultColor(font));
+    setCacheColor(font, color);
+
+    // Wrap in unscaled units so the scaled text fills the column
+    int wrapWidth = (effect.scale.x > 0? int(width/effect.scale.x) : width);
+    float lineAdvance = (getLineHeight(data) + FC_GetLineSpacing(font))*effect.scale.y;
+    float lineX = x;
+    if(effect.alignment == NFont::CENTER)
+        lineX += width/2.0f;
+    else if(effect.alignment == NFont::RIGHT)
+        lineX += width;
+
+    int numLines = 0;
+    float lineY = y;
+    const char* c = text;
+    while(1)
+    {
+        const char* next;
+        const char* lineEnd = findLineBreak(data, c, end, wrapWidth, &next);
+        renderAlignedLine(data, dest, lineX, lineY, effect.alignment, effect.scale.x, effect.scale.y, color, c, lineEnd);
+        ++numLines;
+
+        if(lineEnd == end)
+            break;
+        c = next;
+        lineY += lineAdvance;
+    }
+
+    trace.zone.glyphs = Uint32(stats->counts.glyphs_submitted - submitted);
+    return NFont::Rectf(x, y, width, getLinesHeight(data, numLines)*effect.scale.y);
+}
+
+// Glyphs and caret stops stored by an NFont::TextLayout
+struct LayoutGlyph
+{
+    int cache_level;
+    SDL_Rect src;
+    float x, y;
+};
+
+struct LayoutLine
+{
+    int first_char;
+    int end_char;  // One past the last character, not counting the newline
+    int first_stop;  // Index of the line's first caret stop
+    float y;
+};
+
+struct NFont_LayoutData
+{
+    NFont* font;
+    std::string text;
+    Uint16 width;
+    NFont::Effect effect;
+
+    Uint32 generation;
+    bool valid;
+    std::vector<LayoutGlyph> glyphs;
+    std::vector<LayoutLine> lines;
+    std::vector<float> stops;  // Caret x positions, one more per line than it has characters
+    NFont::Rectf bounds;
+    float line_height;
+
+    NFont_BatchData batch;  // Used when the layout is drawn outside of a batch
+};
+
+static bool compareLineEnds(const LayoutLine& A, int position)
+{
+    return A.end_char < position;
+}
+
+static void buildLayout(NFont_LayoutData* layout, NFont_FontData* data)
+{
+    FC_Font* font = data->font;
+    NFont_Stats* stats = &data->stats;
+    layout->glyphs.clear();
+    layout->lines.clear();
+    layout->stops.clear();
+
+    const NFont::Effect& effect = layout->effect;
+    const char* text = layout->text.c_str();
+    const char* end = text + layout->text.size();
+    TraceScope trace("NFont wrap", getFontID(stats), Uint64(end - text));
+
+    int wrapWidth = 0;
+    if(layout->width > 0)
+        wrapWidth = (effect.scale.x > 0? int(layout->width/effect.scale.x) : layout->width);
+    const KerningTable* kerning = getKerning(data);
+    float spacing = FC_GetSpacing(font)*effect.scale.x;
+    float lineAdvance = (getLineHeight(data) + FC_GetLineSpacing(font))*effect.scale.y;
+    float anchor = 0;
+    if(effect.alignment == NFont::CENTER)
+        anchor = layout->width/2.0f;
+    else if(effect.alignment == NFont::RIGHT)
+        anchor = layout->width;
+
+    float left = anchor;
+    float right = anchor;
+    float y = 0;
+    int position = 0;
+    const char* c = text;
+    while(1)
+    {
+        const char* next;
+        const char* lineEnd = findLineBreak(data, c, end, wrapWidth, &next);
+
+        float x = anchor;
+        if(effect.alignment == NFont::CENTER)
+            x -= measureWidth(data, c, lineEnd)*effect.scale.x/2.0f;
+        else if(effect.alignment == NFont::RIGHT)
+            x -= measureWidth(data, c, lineEnd)*effect.scale.x;
+        left = MIN(left, x);
+
+        LayoutLine line;
+        line.first_char = position;
+        line.first_stop = int(layout->stops.size());
+        line.y = y;
+        layout->stops.push_back(x);
+
+        Uint32 previous = 0;
+        while(c < lineEnd)
+        {
+            FC_GlyphData glyph;
+            Uint32 codepoint = readCodepoint(c, lineEnd);
+            x += getKerningAmount(kerning, previous, codepoint)*effect.scale.x;
+            previous = codepoint;
+            ++position;
+            if(!getGlyphData(stats, font, &glyph, codepoint))
+            {
+                codepoint = ' ';
+                if(!FC_GetGlyphData(font, &glyph, codepoint))
+                {
+                    layout->stops.push_back(x);
+                    continue;
+                }
+            }
+
+            if(codepoint != ' ')
+            {
+                LayoutGlyph g = {glyph.cache_level, glyph.rect, x, y};
+                layout->glyphs.push_back(g);
+            }
+            x += glyph.rect.w*effect.scale.x + spacing;
+            layout->stops.push_back(x);
+        }
+        right = MAX(right, x);
+
+        line.end_char = position;
+        layout->lines.push_back(line);
+
+        if(lineEnd == end)
+            break;
+        // Step over the newline itself
+        if(next != lineEnd)
+            ++position;
+        c = next;
+        y += lineAdvance;
+    }
+
+    float height = getLinesHeight(data, int(layout->lines.size()))*effect.scale.y;
+    if(layout->width > 0)
+        layout->bounds = NFont::Rectf(0, 0, layout->width, height);
+    else
+        layout->bounds = NFont::Rectf(left, 0, right - left, height);
+    layout->line_height = getLineHeight(data)*effect.scale.y;
+}
+
+// Lays the text out again if it was never built or its font has changed since.  The font must be locked.
+static bool updateLayout(NFont_LayoutData* layout, NFont_FontData* data, Uint32 generation)
+{
+    FC_Font* font = data->font;
+    if(FC_GetNumCacheLevels(font) == 0)
+        return false;
+
+    if(!layout->valid || layout->generation != generation)
+    {
+        buildLayout(layout, data);
+        layout->generation = generation;
+        layout->valid = true;
+    }
+    return true;
+}
+
+// A wrapped line of an NFont::EditBuffer
+struct EditLine
+{
+    Uint32 first_byte;
+    Uint32 end_byte;  // Not counting the newline
+    Uint32 first_char;
+    Uint32 end_char;
+    std::vector<int> stops;  // Caret x positions, one more than the line has characters
+};
+
+struct NFont_EditData
+{
+    NFont* font;
+    Uint16 width;
+    std::string text;
+    Uint32 length;  // In characters
+    std::vector<EditLine*> lines;
+    Uint32 generation;
+    bool valid;
+};
+
+// Wraps the line that starts at 'begin' and measures its caret stops.  'next' receives the start of the following line.
+static EditLine* wrapEditLine(NFont_FontData* data, const char* text, const char* begin, const char* end, int width, Uint32 first_char, const char** next)
+{
+    FC_Font* font = data->font;
+    const char* lineEnd = findLineBreak(data, begin, end, width, next);
+    int spacing = FC_GetSpacing(font);
+
+    EditLine* line = new EditLine;
+    line->first_byte = Uint32(begin - text);
+    line->end_byte = Uint32(lineEnd - text);
+    line->first_char = first_char;
+
+    const KerningTable* kerning = getKerning(data);
+    Uint32 previous = 0;
+    int x = 0;
+    line->stops.push_back(x);
+    for(const char* c = begin; c < lineEnd;)
+    {
+        Uint32 codepoint = readCodepoint(c, lineEnd);
+        x += getGlyphAdvance(font, codepoint) + getKerningAmount(kerning, previous, codepoint) + spacing;
+        previous = codepoint;
+        line->stops.push_back(x);
+    }
+    line->end_char = first_char + Uint32(line->stops.size() - 1);
+    return line;
+}
+
+static void clearEditLines(std::vector<EditLine*>& lines, size_t first, size_t last)
+{
+    for(size_t i = first; i < last; ++i)
+        delete lines[i];
+}
+
+// Wraps from line 'first' onward until the new line starts line up with the old ones past 'edit_end',
+// which is in old byte offsets.  The text must already hold the edit, which moved later bytes by 'byte_delta'.
+static void rewrapEditLines(NFont_EditData* edit, NFont_FontData* data, size_t first, Uint32 edit_end, Sint64 byte_delta, Sint64 char_delta)
+{
+    std::vector<EditLine*>& lines = edit->lines;
+    const char* text = edit->text.c_str();
+    const char* end = text + edit->text.size();
+
+    const char* c = text + (first < lines.size()? lines[first]->first_byte : 0);
+    Uint32 position = (first < lines.size()? lines[first]->first_char : 0);
+
+    // Old lines past the edit that are not resynchronized yet
+    size_t old = first;
+    while(old < lines.size() && lines[old]->first_byte < edit_end)
+        ++old;
+
+    std::vector<EditLine*> wrapped;
+    while(1)
+    {
+        const char* next;
+        EditLine* line = wrapEditLine(data, text, c, end, edit->width, position, &next);
+        wrapped.push_back(line);
+        if(line->end_byte == edit->text.size())
+        {
+            old = lines.size();
+            break;
+        }
+
+        position = line->end_char + (next != text + line->end_byte? 1 : 0);
+        c = next;
+
+        Sint64 start = next - text;
+        while(old < lines.size() && lines[old]->first_byte + byte_delta < start)
+            ++old;
+        if(old < lines.size() && lines[old]->first_byte + byte_delta == start)
+            break;
+    }
+
+    // Everything from 'old' on wraps as before, only moved
+    for(size_t i = old; i < lines.size(); ++i)
+    {
+        lines[i]->first_byte = Uint32(lines[i]->first_byte + byte_delta);
+        lines[i]->end_byte = Uint32(lines[i]->end_byte + byte_delta);
+        lines[i]->first_char = Uint32(lines[i]->first_char + char_delta);
+        lines[i]->end_char = Uint32(lines[i]->end_char + char_delta);
+    }
+
+    first = MIN(first, lines.size());
+    clearEditLines(lines, first, old);
+    lines.erase(lines.begin() + first, lines.begin() + old);
+    lines.insert(lines.begin() + first, wrapped.begin(), wrapped.end());
+}
+
+static bool compareEditLineChars(Uint32 position, const EditLine* line)
+{
+    return position < line->first_char;
+}
+
+static bool compareEditLineEnds(const EditLine* line, Uint32 position)
+{
+    return line->end_char < position;
+}
+
+// Index of the line that holds the character at 'position'
+static size_t findEditLine(const std::vector<EditLine*>& lines, Uint32 position)
+{
+    std::vector<EditLine*>::const_iterator e = std::upper_bound(lines.begin(), lines.end(), position, compareEditLineChars);
+    return (e == lines.begin()? 0 : size_t(e - lines.begin()) - 1);
+}
+
+static Uint32 getEditByteOffset(const NFont_EditData* edit, Uint32 position)
+{
+    const EditLine* line = edit->lines[findEditLine(edit->lines, position)];
+    const char* text = edit->text.c_str();
+    const char* end = text + line->end_byte;
+    const char* c = text + line->first_byte;
+    for(Uint32 i = line->first_char; i < position && c < end; ++i)
+        readCodepoint(c, end);
+    return Uint32(c - text);
+}
+
+static Uint32 countCodepoints(const char* text, const char* end)
+{
+    Uint32 count = 0;
+    for(const char* c = text; c < end; ++count)
+        readCodepoint(c, end);
+    return count;
+}
+
+// Largest cache level that preloadGlyphs() and NFont::compactAtlas() pack glyphs into
+#define NFONT_PRELOAD_PAGE_SIZE 1024
+#define NFONT_PRELOAD_PADDING 1
+
+// FreeType faces share one library, so TTF_Fonts are opened and closed one at a time.
+static SDL_mutex* ttf_mutex = NULL;
+static SDL_SpinLock ttf_mutex_lock = 0;
+
+static SDL_mutex* getTTFMutex()
+{
+    SDL_AtomicLock(&ttf_mutex_lock);
+    if(ttf_mutex == NULL)
+        ttf_mutex = SDL_CreateMutex();
+    SDL_AtomicUnlock(&ttf_mutex_lock);
+    return ttf_mutex;
+}
+
+// Opens a TTF from a file or, if filename_ttf is NULL, from an SDL_RWops, and sets it up as SDL_FontCache would.
+static TTF_Font* openTTF(const char* filename_ttf, SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, int style)
+{
+    FontLock lock(getTTFMutex());
+    TTF_Font* ttf = (filename_ttf != NULL? TTF_OpenFont(filename_ttf, pointSize) : TTF_OpenFontRW(file_rwops_ttf, own_rwops, pointSize));
+    if(ttf != NULL)
+    {
+        TTF_SetFontStyle(ttf, style & ~TTF_STYLE_OUTLINE);
+        if(style & TTF_STYLE_OUTLINE)
+            TTF_SetFontOutline(ttf, 1);
+    }
+    return ttf;
+}
+
+static void closeTTF(TTF_Font* ttf)
+{
+    if(ttf == NULL)
+        return;
+
+    FontLock lock(getTTFMutex());
+    TTF_CloseFont(ttf);
+}
+
+// Remembers the renderer a font is loaded with.  Without one, the font gets a software renderer of its own,
+// so it can be measured and drawn into surfaces with no window.  Returns false if that cannot be made.
+static bool useRenderer(NFont_FontData* data, NFont_Target** renderer)
+{
+    #ifndef NFONT_USE_SDL_GPU
+    if(*renderer == NULL)
+    {
+        data->own_renderer_target = createSurface32(1, 1);
+        if(data->own_renderer_target != NULL)
+            data->own_renderer = SDL_CreateSoftwareRenderer(data->own_renderer_target);
+        if(data->own_renderer == NULL)
+            return false;
+        *renderer = data->own_renderer;
+    }
+    #endif
+    data->renderer = *renderer;
+    return true;
+}
+
+// A rendered glyph held on the CPU until it is packed into a cache level or drawn into a surface.  SDL_ttf
+// and SDL_FontCache render glyphs white, so those keep only their coverage, a quarter of the RGBA they came
+// in.  That is most of the memory a preload of thousands of CJK glyphs holds at once.  Glyphs of bitmap fonts
+// with colors of their own keep RGBA bytes.
+struct StagedGlyph
+{
+    int w, h;
+    Uint8 bytes_per_pixel;  // 1 for coverage, 4 for RGBA
+    std::vector<Uint8> pixels;  // Empty if the glyph was not rendered
+
+    StagedGlyph()
+        : w(0), h(0), bytes_per_pixel(1)
+    {}
+};
+
+// Copies a rect of a 32-bit surface, as coverage if it is white wherever it shows
+static void stageGlyph(SDL_Surface* surface, const SDL_Rect& rect, StagedGlyph* result)
+{
+    result->pixels.clear();
+    const SDL_PixelFormat* format = surface->format;
+    if(format->BytesPerPixel != 4 || format->Amask == 0 || rect.w <= 0 || rect.h <= 0)
+        return;
+
+    const Uint32 white = format->Rmask | format->Gmask | format->Bmask;
+    bool isWhite = true;
+    for(int y = 0; y < rect.h && isWhite; ++y)
+    {
+        const Uint32* row = (const Uint32*)((const Uint8*)surface->pixels + (rect.y + y)*surface->pitch) + rect.x;
+        for(int x = 0; x < rect.w; ++x)
+        {
+            if((row[x] & format->Amask) != 0 && (row[x] & white) != white)
+            {
+                isWhite = false;
+                break;
+            }
+        }
+    }
+
+    result->w = rect.w;
+    result->h = rect.h;
+    result->bytes_per_pixel = Uint8(isWhite? 1 : 4);
+    result->pixels.resize(size_t(rect.w)*rect.h*result->bytes_per_pixel);
+    Uint8* dest = &result->pixels[0];
+    for(int y = 0; y < rect.h; ++y)
+    {
+        const Uint32* row = (const Uint32*)((const Uint8*)surface->pixels + (rect.y + y)*surface->pitch) + rect.x;
+        for(int x = 0; x < rect.w; ++x)
+        {
+            if(isWhite)
+                *dest++ = Uint8((row[x] & format->Amask) >> format->Ashift);
+            else
+            {
+                SDL_GetRGBA(row[x], format, dest, dest + 1, dest + 2, dest + 3);
+                dest += 4;
+            }
+        }
+    }
+}
+
+// Copies a glyph that was rendered on its own and frees it
+static void takeGlyph(SDL_Surface* surface, StagedGlyph* result)
+{
+    if(surface == NULL)
+        return;
+    SDL_Rect rect = {0, 0, surface->w, surface->h};
+    stageGlyph(surface, rect, result);
+    SDL_FreeSurface(surface);
+}
+
+// Work shared by the threads of one preloadGlyphs() call
+struct PreloadJob
+{
+    Uint32 font_id;
+    const char* filename;
+    Uint32 pointSize;
+    int style;
+    const std::vector<Uint32>* unicode;
+    const std::vector<Uint32>* codepoints;
+    std::vector<StagedGlyph>* glyphs;
+    SDL_atomic_t next;
+};
+
+static void unpackCodepoint(char* result, Uint32 codepoint)
+{
+    int size = 0;
+    for(int shift = 24; shift >= 0; shift -= 8)
+    {
+        char c = char((codepoint >> shift) & 0xFF);
+        if(c != 0 || size > 0 || shift == 0)
+            result[size++] = c;
+    }
+    result[size] = '\0';
+}
+
+// Renders glyphs with a TTF_Font of its own until the job runs out
+static int preloadWorker(void* data)
+{
+    PreloadJob* job = (PreloadJob*)data;
+    TraceScope trace("NFont rasterize", job->font_id);
+    TTF_Font* ttf = openTTF(job->filename, NULL, 0, job->pointSize, job->style);
+    if(ttf == NULL)
+        return 0;
+
+    SDL_Color white = {255, 255, 255, 255};
+    int count = int(job->codepoints->size());
+    int i;
+    while((i = SDL_AtomicAdd(&job->next, 1)) < count)
+    {
+        Uint32 unicode = (*job->unicode)[i];
+        if(unicode <= 0xFFFF && !TTF_GlyphIsProvided(ttf, Uint16(unicode)))
+            continue;
+
+        char buff[5];
+        unpackCodepoint(buff, (*job->codepoints)[i]);
+        SDL_Surface* surface = TTF_RenderUTF8_Blended(ttf, buff, white);
+        if(surface != NULL)
+        {
+            ++trace.zone.glyphs;
+            trace.zone.bytes += Uint64(surface->w)*surface->h*4;
+        }
+        takeGlyph(surface, &(*job->glyphs)[i]);
+    }
+
+    closeTTF(ttf);
+    return 0;
+}
+
+// Uploads a cache level.  SDL_FontCache only knows the renderer of fonts it loaded from a TTF, so fonts
+// built from images pass theirs here.  font_id is for the trace zones.
+static bool uploadCacheLevel(FC_Font* font, Uint32 font_id, NFont_Target* renderer, int level, SDL_Surface* surface)
+{
+    Uint64 bytes = Uint64(surface->w)*surface->h*4;
+    TraceScope trace("NFont cache level", font_id, bytes);
+    #ifdef NFONT_USE_SDL_GPU
+    (void)renderer;
+    TraceScope uploadTrace("NFont texture upload", font_id, bytes);
+    return FC_UploadGlyphCache(font, level, surface);
+    #else
+    if(renderer == NULL)
+    {
+        TraceScope uploadTrace("NFont texture upload", font_id, bytes);
+        return FC_UploadGlyphCache(font, level, surface);
+    }
+
+    // Render targets can be read back, for drawing into surfaces and for saveGlyphCache()
+    SDL_Texture* texture = NULL;
+    {
+        TraceScope uploadTrace("NFont texture upload", font_id, bytes);
+        SDL_RendererInfo info;
+        if(SDL_GetRendererInfo(renderer, &info) == 0 && (info.flags & SDL_RENDERER_TARGETTEXTURE))
+        {
+            texture = SDL_CreateTexture(renderer, surface->format->format, SDL_TEXTUREACCESS_TARGET, surface->w, surface->h);
+            if(texture != NULL && SDL_UpdateTexture(texture, NULL, surface->pixels, surface->pitch) < 0)
+            {
+                SDL_DestroyTexture(texture);
+                texture = NULL;
+            }
+            if(texture != NULL)
+                SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+        }
+        if(texture == NULL)
+            texture = SDL_CreateTextureFromSurface(renderer, surface);
+    }
+    if(texture == NULL)
+        return false;
+    if(!FC_SetGlyphCacheLevel(font, renderer, level, texture))
+    {
+        SDL_DestroyTexture(texture);
+        return false;
+    }
+    return true;
+    #endif
+}
+
+// Skyline bottom-left packing: the used part of a page is kept as its top edge, a run of segments, and each
+// rect goes where it sits highest, then furthest left.  Unlike shelves, a short glyph can use the
+// space beside a tall one.
+struct SkylineSegment
+{
+    int x, y, w;
+};
+
+struct SkylinePacker
+{
+    int width, height;
+    std::vector<SkylineSegment> skyline;
+};
+
+static void resetSkyline(SkylinePacker* packer, int width, int height)
+{
+    packer->width = width;
+    packer->height = height;
+    SkylineSegment bottom = {0, 0, width};
+    packer->skyline.assign(1, bottom);
+}
+
+// Finds where a w by h rect would rest with its left edge on segment 'index'.  Returns false if it does not fit.
+static bool fitSkyline(const SkylinePacker* packer, size_t index, int w, int h, int* y)
+{
+    const std::vector<SkylineSegment>& skyline = packer->skyline;
+    int x = skyline[index].x;
+    if(x + w > packer->width)
+        return false;
+
+    int top = 0;
+    for(size_t i = index; i < skyline.size() && skyline[i].x < x + w; ++i)
+        top = MAX(top, skyline[i].y);
+    if(top + h > packer->height)
+        return false;
+    *y = top;
+    return true;
+}
+
+static bool packSkyline(SkylinePacker* packer, int w, int h, int* x, int* y)
+{
+    std::vector<SkylineSegment>& skyline = packer->skyline;
+    size_t best = skyline.size();
+    int bestY = 0;
+    for(size_t i = 0; i < skyline.size(); ++i)
+    {
+        int top;
+        if(fitSkyline(packer, i, w, h, &top) && (best == skyline.size() || top < bestY))
+        {
+            best = i;
+            bestY = top;
+        }
+    }
+    if(best == skyline.size())
+        return false;
+
+    // The rect's top replaces the segments under it
+    SkylineSegment segment = {skyline[best].x, bestY + h, w};
+    skyline.insert(skyline.begin() + best, segment);
+    int right = segment.x + segment.w;
+    size_t i = best + 1;
+    while(i < skyline.size() && skyline[i].x < right)
+    {
+        int overlap = right - skyline[i].x;
+        if(overlap < skyline[i].w)
+        {
+            skyline[i].x += overlap;
+            skyline[i].w -= overlap;
+            break;
+        }
+        skyline.erase(skyline.begin() + i);
+    }
+    for(i = 0; i + 1 < skyline.size(); )
+    {
+        if(skyline[i].y == skyline[i + 1].y)
+        {
+            skyline[i].w += skyline[i + 1].w;
+            skyline.erase(skyline.begin() + i + 1);
+        }
+        else
+            ++i;
+    }
+
+    *x = segment.x;
+    *y = bestY;
+    return true;
+}
+
+// Orders glyphs tallest first, which packs them tighter
+struct CompareGlyphHeights
+{
+    const std::vector<StagedGlyph>* glyphs;
+
+    bool operator()(size_t A, size_t B) const
+    {
+        const StagedGlyph& a = (*glyphs)[A];
+        const StagedGlyph& b = (*glyphs)[B];
+        return (a.h != b.h? a.h > b.h : a.w > b.w);
+    }
+};
+
+// Copies a page of packed glyphs into pixels just big enough to hold them, uploads them as a new cache level
+// and points the glyphs at it.  With SDL_gpu, a page of white glyphs goes up as an alpha-only level.  Other
+// pages, and every page with SDL_Renderer, which has no alpha-only texture format it can tint, are expanded
+// into RGBA.  The glyphs' pixels are freed once the level holds them.  Empties the vectors.  stats may be NULL.
+static int uploadPackedPage(FC_Font* font, NFont_Stats* stats, NFont_Target* renderer, std::vector<StagedGlyph*>& sources, std::vector<Uint32>& codepoints, std::vector<FC_GlyphData>& glyphs)
+{
+    int w = 1;
+    int h = 1;
+    for(size_t i = 0; i < glyphs.size(); ++i)
+    {
+        w = MAX(w, int(glyphs[i].rect.x + glyphs[i].rect.w));
+        h = MAX(h, int(glyphs[i].rect.y + glyphs[i].rect.h));
+    }
+
+    int level = FC_GetNumCacheLevels(font);
+    int bytesPerPixel = 0;  // Of the level, or 0 if it was not uploaded
+    #ifdef NFONT_USE_SDL_GPU
+    bool coverage = true;
+    for(size_t i = 0; i < sources.size() && coverage; ++i)
+        coverage = (sources[i]->bytes_per_pixel == 1);
+    if(coverage && loadAlphaShader())
+    {
+        std::vector<Uint8> page(size_t(w)*h, 0);
+        for(size_t i = 0; i < sources.size(); ++i)
+        {
+            const StagedGlyph& source = *sources[i];
+            for(int y = 0; y < source.h; ++y)
+                memcpy(&page[size_t(int(glyphs[i].rect.y) + y)*w + int(glyphs[i].rect.x)], &source.pixels[size_t(y)*source.w], source.w);
+        }
+        if(uploadAlphaLevel(font, getFontID(stats), level, &page[0], w, h))
+            bytesPerPixel = 1;
+    }
+    #endif
+
+    SDL_Surface* page = (bytesPerPixel == 0? createSurface32(w, h) : NULL);
+    if(page != NULL)
+    {
+        SDL_FillRect(page, NULL, 0);
+        // createSurface32() keeps the bytes in RGBA order on either endianness
+        for(size_t i = 0; i < sources.size(); ++i)
+        {
+            const StagedGlyph& source = *sources[i];
+            for(int y = 0; y < source.h; ++y)
+            {
+                Uint8* row = (Uint8*)page->pixels + (int(glyphs[i].rect.y) + y)*page->pitch + int(glyphs[i].rect.x)*4;
+                const Uint8* src = &source.pixels[size_t(y)*source.w*source.bytes_per_pixel];
+                if(source.bytes_per_pixel == 4)
+                {
+                    memcpy(row, src, source.w*4);
+                    continue;
+                }
+                for(int x = 0; x < source.w; ++x, row += 4)
+                {
+                    row[0] = row[1] = row[2] = 255;
+                    row[3] = src[x];
+                }
+            }
+        }
+
+        if(uploadCacheLevel(font, getFontID(stats), renderer, level, page))
+            bytesPerPixel = 4;
+        SDL_FreeSurface(page);
+    }
+
+    int numLoaded = 0;
+    if(bytesPerPixel != 0)
+    {
+        if(stats != NULL)
+        {
+            ++stats->counts.texture_uploads;
+            stats->counts.texture_upload_bytes += Uint64(w)*h*bytesPerPixel;
+            countCacheLevels(stats, font);
+        }
+        for(size_t i = 0; i < glyphs.size(); ++i)
+        {
+            glyphs[i].cache_level = level;
+            std::vector<Uint8>().swap(sources[i]->pixels);
+            if(FC_SetGlyphData(font, codepoints[i], glyphs[i]) == NULL)
+                continue;
+            ++numLoaded;
+            if(stats != NULL)
+                markGlyphSeen(stats, codepoints[i]);
+        }
+    }
+
+    sources.clear();
+    codepoints.clear();
+    glyphs.clear();
+    return numLoaded;
+}
+
+// Packs the rendered glyphs into new cache levels, freeing their pixels a page at a time as they go up.  Returns
+// the number of glyphs added.
+static int uploadPreloadedGlyphs(FC_Font* font, NFont_Stats* stats, NFont_Target* renderer, const std::vector<Uint32>& codepoints, std::vector<StagedGlyph>& glyphs)
+{
+    const int size = NFONT_PRELOAD_PAGE_SIZE;
+    const int padding = NFONT_PRELOAD_PADDING;
+
+    std::vector<size_t> order;
+    for(size_t i = 0; i < glyphs.size(); ++i)
+    {
+        const StagedGlyph& g = glyphs[i];
+        if(!g.pixels.empty() && g.w + padding <= size && g.h + padding <= size)
+            order.push_back(i);
+    }
+    CompareGlyphHeights compare = {&glyphs};
+    std::stable_sort(order.begin(), order.end(), compare);
+
+    int numLoaded = 0;
+    SkylinePacker packer;
+    resetSkyline(&packer, size, size);
+    std::vector<StagedGlyph*> pageSources;
+    std::vector<Uint32> pageCodepoints;
+    std::vector<FC_GlyphData> pageGlyphs;
+    for(size_t i = 0; i < order.size(); ++i)
+    {
+        StagedGlyph& g = glyphs[order[i]];
+        int x, y;
+        if(!packSkyline(&packer, g.w + padding, g.h + padding, &x, &y))
+        {
+            numLoaded += uploadPackedPage(font, stats, renderer, pageSources, pageCodepoints, pageGlyphs);
+            resetSkyline(&packer, size, size);
+            packSkyline(&packer, g.w + padding, g.h + padding, &x, &y);
+        }
+
+        pageSources.push_back(&g);
+        pageCodepoints.push_back(codepoints[order[i]]);
+        pageGlyphs.push_back(FC_MakeGlyphData(0, x, y, g.w, g.h));
+    }
+
+    if(!pageGlyphs.empty())
+        numLoaded += uploadPackedPage(font, stats, renderer, pageSources, pageCodepoints, pageGlyphs);
+    return numLoaded;
+}
+
+static void getCachedCodepoints(FC_Font* font, std::vector<Uint32>& result)
+{
+    result.resize(FC_GetNumCodepoints(font));
+    if(!result.empty())
+        FC_GetCodepoints(font, &result[0]);
+    std::sort(result.begin(), result.end());
+}
+
+// Whether the font has a TTF to render glyphs from outside of SDL_FontCache
+static bool canReloadGlyphCache(const NFont_FontData* data)
+{
+    return (data->sdf == NULL && data->async_load == NULL && (data->owned_ttf != NULL || data->source_filename != NULL));
+}
+
+// A cache level that draws render their new glyphs into.  SDL_FontCache renders a glyph the first time it is
+// looked up and copies it into the cache texture then, one small upload per glyph, in the middle of a draw.
+// Instead, a draw renders all the new glyphs of its text first, packs them into the stage's level and sends
+// the part that changed in one texture update.  Only the packer outlives the draw: the glyphs are copied
+// into a surface just big enough for the update, in the texture's own pixel format so it needs no
+// conversion, or into coverage bytes for SDL_gpu's alpha-only levels, and that is freed once it is sent.
+struct GlyphStage
+{
+    TTF_Font* ttf;  // Opened from the source file for fonts with no owned_ttf
+    bool ttf_failed;  // So a missing file is not opened again by every draw
+    int size;  // Of the level's texture, or 0 until a glyph is staged
+    int level;  // The cache level, or -1 until it is uploaded
+    NFont_Image* image;  // The level's texture, to notice it going away
+    Uint32 format;  // The texture's pixel format
+    bool alpha;  // The level is alpha-only (SDL_gpu), so the glyphs go up as coverage
+    SkylinePacker packer;
+    SDL_Rect dirty;  // Not uploaded yet.  Empty when w is 0.
+    std::vector<SDL_Surface*> surfaces;  // Staged since the last upload, and freed by it
+    std::vector<Uint32> codepoints;
+    std::vector<FC_GlyphData> glyphs;
+    std::vector<Uint32> unseen;  // Kept between draws, so looking for new glyphs does not allocate
+    std::set<Uint32> skipped;  // Rendered empty, too big for a page or not at all, so left to SDL_FontCache
+    Uint32 num_codepoints;  // FC_GetNumCodepoints() when every cached glyph was last marked seen
+
+    GlyphStage()
+        : ttf(NULL), ttf_failed(false), size(0), level(-1), image(NULL), format(SDL_PIXELFORMAT_UNKNOWN), alpha(false), num_codepoints(0)
+    {
+        dirty.x = dirty.y = dirty.w = dirty.h = 0;
+    }
+};
+
+// Drops what was staged and the level, as when the glyph cache is emptied
+static void resetGlyphStage(GlyphStage* stage)
+{
+    if(stage == NULL)
+        return;
+
+    for(size_t i = 0; i < stage->surfaces.size(); ++i)
+        SDL_FreeSurface(stage->surfaces[i]);
+    stage->surfaces.clear();
+    stage->size = 0;
+    stage->level = -1;
+    stage->image = NULL;
+    stage->alpha = false;
+    stage->dirty.w = stage->dirty.h = 0;
+    stage->codepoints.clear();
+    stage->glyphs.clear();
+}
+
+static void freeGlyphStage(GlyphStage* stage)
+{
+    if(stage == NULL)
+        return;
+
+    resetGlyphStage(stage);
+    closeTTF(stage->ttf);
+    delete stage;
+}
+
+// An empty surface in the given pixel format
+static SDL_Surface* createSurfaceInFormat(Uint32 format, int width, int height)
+{
+    int bpp;
+    Uint32 r, g, b, a;
+    if(!SDL_PixelFormatEnumToMasks(format, &bpp, &r, &g, &b, &a))
+        return NULL;
+
+    SDL_Surface* result = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, bpp, r, g, b, a);
+    if(result != NULL)
+        SDL_FillRect(result, NULL, 0);
+    return result;
+}
+
+// The first 32-bit format with alpha that the renderer lists, which it prefers.  SDL_gpu's images are RGBA
+// bytes, as createSurface32() makes them.
+static Uint32 getStageFormat(NFont_Target* renderer)
+{
+    #ifndef NFONT_USE_SDL_GPU
+    SDL_RendererInfo info;
+    if(renderer != NULL && SDL_GetRendererInfo(renderer, &info) == 0)
+    {
+        for(Uint32 i = 0; i < info.num_texture_formats; ++i)
+        {
+            Uint32 format = info.texture_formats[i];
+            if(SDL_BYTESPERPIXEL(format) == 4 && SDL_ISPIXELFORMAT_ALPHA(format))
+                return format;
+        }
+    }
+    #else
+    (void)renderer;
+    #endif
+
+    #if SDL_BYTEORDER == SDL_BIG_ENDIAN
+    return SDL_PIXELFORMAT_RGBA8888;
+    #else
+    return SDL_PIXELFORMAT_ABGR8888;
+    #endif
+}
+
+// Copies the staged glyphs into a surface that starts at (x, y) of the level
+static void copyStagedGlyphs(GlyphStage* stage, SDL_Surface* dest, int x, int y)
+{
+    for(size_t i = 0; i < stage->surfaces.size(); ++i)
+    {
+        SDL_Rect r = {stage->glyphs[i].rect.x - x, stage->glyphs[i].rect.y - y, stage->surfaces[i]->w, stage->surfaces[i]->h};
+        SDL_SetSurfaceBlendMode(stage->surfaces[i], SDL_BLENDMODE_NONE);
+        SDL_BlitSurface(stage->surfaces[i], NULL, dest, &r);
+    }
+}
+
+#ifdef NFONT_USE_SDL_GPU
+// Copies the coverage of the staged glyphs into bytes that start at (x, y) of the level
+static void copyStagedCoverage(GlyphStage* stage, Uint8* dest, int pitch, int x, int y)
+{
+    for(size_t i = 0; i < stage->surfaces.size(); ++i)
+    {
+        const SDL_Surface* surface = stage->surfaces[i];
+        const SDL_PixelFormat* format = surface->format;
+        for(int row = 0; row < surface->h; ++row)
+        {
+            const Uint32* src = (const Uint32*)((const Uint8*)surface->pixels + row*surface->pitch);
+            Uint8* out = dest + (stage->glyphs[i].rect.y - y + row)*pitch + stage->glyphs[i].rect.x - x;
+            for(int col = 0; col < surface->w; ++col)
+                out[col] = Uint8((src[col] & format->Amask) >> format->Ashift);
+        }
+    }
+}
+#endif
+
+// Sends what was staged since the last upload to the texture, making the cache level the first time, and
+// points the glyphs at it.  The font must be locked on the rendering thread.
+static void uploadGlyphStage(NFont_FontData* data)
+{
+    GlyphStage* stage = data->stage;
+    if(stage->codepoints.empty())
+        return;
+
+    FC_Font* font = data->font;
+    NFont_Stats* stats = &data->stats;
+    const SDL_Rect r = stage->dirty;
+    bool uploaded = false;
+    if(stage->level < 0)
+    {
+        // The whole level goes up once, to make its texture
+        int level = FC_GetNumCacheLevels(font);
+        #ifdef NFONT_USE_SDL_GPU
+        if(loadAlphaShader())
+        {
+            std::vector<Uint8> coverage(size_t(stage->size)*stage->size, 0);
+            copyStagedCoverage(stage, &coverage[0], stage->size, 0, 0);
+            uploaded = stage->alpha = uploadAlphaLevel(font, stats->font_id, level, &coverage[0], stage->size, stage->size);
+        }
+        #endif
+        SDL_Surface* page = (uploaded? NULL : createSurfaceInFormat(getStageFormat(data->renderer), stage->size, stage->size));
+        if(page != NULL)
+        {
+            copyStagedGlyphs(stage, page, 0, 0);
+            uploaded = uploadCacheLevel(font, stats->font_id, data->renderer, level, page);
+            stage->format = page->format->format;
+            SDL_FreeSurface(page);
+        }
+        if(uploaded)
+        {
+            stage->level = level;
+            stage->image = FC_GetGlyphCacheLevel(font, level);
+            ++stats->counts.texture_uploads;
+            stats->counts.texture_upload_bytes += Uint64(stage->size)*stage->size*(stage->alpha? 1 : 4);
+            countCacheLevels(stats, font);
+
+            #ifndef NFONT_USE_SDL_GPU
+            // SDL_CreateTextureFromSurface() picks a format of its own
+            SDL_QueryTexture(stage->image, &stage->format, NULL, NULL, NULL);
+            #endif
+        }
+    }
+    else
+    {
+        Uint64 bytes = Uint64(r.w)*r.h*(stage->alpha? 1 : 4);
+        TraceScope trace("NFont texture upload", stats->font_id, bytes);
+        #ifdef NFONT_USE_SDL_GPU
+        if(stage->alpha)
+        {
+            std::vector<Uint8> coverage(size_t(r.w)*r.h, 0);
+            copyStagedCoverage(stage, &coverage[0], r.w, r.x, r.y);
+            GPU_Rect rect = GPU_MakeRect(r.x, r.y, r.w, r.h);
+            GPU_UpdateImageBytes(stage->image, &rect, &coverage[0], r.w);
+            uploaded = true;
+        }
+        #endif
+        SDL_Surface* part = (uploaded? NULL : createSurfaceInFormat(stage->format, r.w, r.h));
+        if(part != NULL)
+        {
+            copyStagedGlyphs(stage, part, r.x, r.y);
+            #ifdef NFONT_USE_SDL_GPU
+            GPU_Rect rect = GPU_MakeRect(r.x, r.y, r.w, r.h);
+            GPU_UpdateImage(stage->image, &rect, part, NULL);
+            uploaded = true;
+            #else
+            uploaded = (SDL_UpdateTexture(stage->image, &r, part->pixels, part->pitch) == 0);
+            #endif
+            SDL_FreeSurface(part);
+        }
+        if(uploaded)
+        {
+            ++stats->counts.texture_uploads;
+            stats->counts.texture_upload_bytes += bytes;
+        }
+    }
+
+    if(uploaded)
+    {
+        for(size_t i = 0; i < stage->glyphs.size(); ++i)
+        {
+            stage->glyphs[i].cache_level = stage->level;
+            FC_SetGlyphData(font, stage->codepoints[i], stage->glyphs[i]);
+            markGlyphSeen(stats, stage->codepoints[i]);
+        }
+        stage->num_codepoints += Uint32(stage->codepoints.size());
+    }
+
+    for(size_t i = 0; i < stage->surfaces.size(); ++i)
+        SDL_FreeSurface(stage->surfaces[i]);
+    stage->surfaces.clear();
+    stage->codepoints.clear();
+    stage->glyphs.clear();
+    stage->dirty.w = stage->dirty.h = 0;
+
+    // What failed is rendered by SDL_FontCache when it is drawn
+    if(!uploaded)
+        resetGlyphStage(stage);
+}
+
+// Renders the glyphs of the text that are not cached yet and uploads them together, before the draw looks
+// any of them up.  Glyphs that render empty or too big for a page are left to SDL_FontCache, and so are fonts
+// without a TTF file to render from (bitmap and SDF fonts, ones loaded from SDL_RWops or a TTF_Font).  Each
+// codepoint is tried once, so a draw that has nothing new for the stage only reads its text.  The font must
+// be locked by a draw.
+static void stageNewGlyphs(NFont_FontData* data, const char* text, const char* end)
+{
+    FC_Font* font = data->font;
+    if(text == NULL || !canReloadGlyphCache(data) || FC_GetNumCacheLevels(font) == 0)
+        return;
+
+    if(data->stage == NULL)
+        data->stage = new GlyphStage;
+    GlyphStage* stage = data->stage;
+    NFont_Stats* stats = &data->stats;
+    std::vector<Uint32>& codepoints = stage->unseen;
+    codepoints.clear();
+    for(const char* c = text; c < end;)
+    {
+        Uint32 codepoint = readCodepoint(c, end);
+        if(codepoint != '\n' && !isGlyphSeen(stats, codepoint) && stage->skipped.find(codepoint) == stage->skipped.end())
+            codepoints.push_back(codepoint);
+    }
+    if(codepoints.empty())
+        return;
+
+    // Measuring has SDL_FontCache render glyphs without marking them, so some may be cached already
+    Uint32 numCodepoints = FC_GetNumCodepoints(font);
+    if(numCodepoints != stage->num_codepoints)
+    {
+        markCachedGlyphsSeen(data);
+        stage->num_codepoints = numCodepoints;
+        size_t n = 0;
+        for(size_t i = 0; i < codepoints.size(); ++i)
+        {
+            if(!isGlyphSeen(stats, codepoints[i]))
+                codepoints[n++] = codepoints[i];
+        }
+        codepoints.resize(n);
+    }
+    std::sort(codepoints.begin(), codepoints.end());
+    codepoints.erase(std::unique(codepoints.begin(), codepoints.end()), codepoints.end());
+    if(codepoints.empty())
+        return;
+
+    if(stage->level >= 0 && (stage->level >= int(FC_GetNumCacheLevels(font)) || FC_GetGlyphCacheLevel(font, stage->level) != stage->image))
+        resetGlyphStage(stage);
+
+    TTF_Font* ttf = data->owned_ttf;
+    if(ttf == NULL)
+    {
+        if(stage->ttf == NULL && !stage->ttf_failed)
+        {
+            stage->ttf = openTTF(data->source_filename, NULL, 0, data->source_size, data->source_style);
+            stage->ttf_failed = (stage->ttf == NULL);
+        }
+        ttf = stage->ttf;
+    }
+    if(ttf == NULL)
+        return;
+
+    // Room for a few lines of glyphs, so small fonts do not take a big texture for a handful of them
+    const int padding = NFONT_PRELOAD_PADDING;
+    int size = 256;
+    while(size < 8*getLineHeight(data) && size < NFONT_PRELOAD_PAGE_SIZE)
+        size *= 2;
+
+    TraceScope trace("NFont rasterize", stats->font_id);
+    SDL_Color white = {255, 255, 255, 255};
+    for(size_t i = 0; i < codepoints.size(); ++i)
+    {
+        char buff[5];
+        unpackCodepoint(buff, codepoints[i]);
+        SDL_Surface* surface = TTF_RenderUTF8_Blended(ttf, buff, white);
+        if(surface == NULL || surface->w <= 0 || surface->h <= 0 || surface->w + padding > size || surface->h + padding > size)
+        {
+            stage->skipped.insert(codepoints[i]);
+            SDL_FreeSurface(surface);
+            continue;
+        }
+
+        int x, y;
+        if(stage->size == 0 || !packSkyline(&stage->packer, surface->w + padding, surface->h + padding, &x, &y))
+        {
+            // The next page is another cache level
+            uploadGlyphStage(data);
+            resetGlyphStage(stage);
+            stage->size = size;
+            resetSkyline(&stage->packer, size, size);
+            packSkyline(&stage->packer, surface->w + padding, surface->h + padding, &x, &y);
+        }
+
+        SDL_Rect dest = {x, y, surface->w, surface->h};
+        SDL_Rect& dirty = stage->dirty;
+        if(dirty.w == 0 || dirty.h == 0)
+            dirty = dest;
+        else
+        {
+            int right = MAX(dirty.x + dirty.w, dest.x + dest.w);
+            int bottom = MAX(dirty.y + dirty.h, dest.y + dest.h);
+            dirty.x = MIN(dirty.x, dest.x);
+            dirty.y = MIN(dirty.y, dest.y);
+            dirty.w = right - dirty.x;
+            dirty.h = bottom - dirty.y;
+        }
+        stage->surfaces.push_back(surface);
+        stage->codepoints.push_back(codepoints[i]);
+        stage->glyphs.push_back(FC_MakeGlyphData(0, x, y, surface->w, surface->h));
+
+        ++stats->counts.cache_misses;
+        ++stats->counts.glyphs_rasterized;
+        ++trace.zone.glyphs;
+        trace.zone.bytes += Uint64(surface->w)*surface->h*4;
+    }
+    uploadGlyphStage(data);
+}
+
+// Returns the first pixel in [x, end) that does (or, if match is false, does not) equal color.
+static inline int findPixel(const Uint32* row, int x, int end, Uint32 color, bool match)
+{
+    #ifdef NFONT_USE_SSE2
+    const __m128i c = _mm_set1_epi32((int)color);
+    const int miss = (match? 0 : 0xF);
+    for(; x + 4 <= end; x += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(row + x));
+        if(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(pixels, c))) != miss)
+            break;
+    }
+    #endif
+    for(; x < end; ++x)
+    {
+        if((row[x] == color) == match)
+            return x;
+    }
+    return end;
+}
+
+// Finds the topmost and bottommost rows of a glyph that have a visible pixel.  Returns false if it is blank.
+static bool getGlyphRows(SDL_Surface* surface, int x, int w, int* top, int* bottom)
+{
+    *top = -1;
+    for(int y = 1; y < surface->h; ++y)
+    {
+        const Uint32* row = (const Uint32*)((Uint8*)surface->pixels + y*surface->pitch);
+        if(findPixel(row, x, x + w, 0, false) < x + w)
+        {
+            if(*top < 0)
+                *top = y - 1;
+            *bottom = y - 1;
+        }
+    }
+    return (*top >= 0);
+}
+
+// Loads an old-style NFont bitmap: the top row holds runs of glyph columns for '!' onward, split by
+// the separator color in the top-left pixel.  The bottom-left pixel is the background color.
+static bool loadBitmapFont(NFont_FontData* data, NFont_Target* renderer, SDL_Surface* src)
+{
+    FC_Font* font = data->font;
+    if(src == NULL || src->w < 2 || src->h < 2)
+        return false;
+
+    // Normalize to 32-bit RGBA so the scan compares whole pixels
+    SDL_Surface* surface = createSurface32(src->w, src->h);
+    if(surface == NULL)
+        return false;
+    SDL_FillRect(surface, NULL, 0);
+    SDL_BlendMode blendMode;
+    SDL_GetSurfaceBlendMode(src, &blendMode);
+    SDL_SetSurfaceBlendMode(src, SDL_BLENDMODE_NONE);
+    SDL_BlitSurface(src, NULL, surface, NULL);
+    SDL_SetSurfaceBlendMode(src, blendMode);
+
+    const Uint32* top = (const Uint32*)surface->pixels;
+    const Uint32 separator = top[0];
+    const Uint32 background = *(const Uint32*)((Uint8*)surface->pixels + (surface->h - 1)*surface->pitch);
+    const int height = surface->h - 1;
+
+    // Find the glyph columns
+    std::vector<SDL_Rect> columns;
+    for(int x = findPixel(top, 0, surface->w, separator, false); x < surface->w; )
+    {
+        int end = findPixel(top, x, surface->w, separator, true);
+        SDL_Rect r = {x, 1, end - x, height};
+        columns.push_back(r);
+        x = findPixel(top, end, surface->w, separator, false);
+    }
+    if(columns.empty())
+    {
+        SDL_FreeSurface(surface);
+        return false;
+    }
+    if(columns.size() > 256 - 33)
+        columns.resize(256 - 33);
+
+    // Clear the background
+    for(int y = 1; y < surface->h; ++y)
+    {
+        Uint32* row = (Uint32*)((Uint8*)surface->pixels + y*surface->pitch);
+        for(int x = findPixel(row, 0, surface->w, background, true); x < surface->w; x = findPixel(row, x + 1, surface->w, background, true))
+            row[x] = 0;
+    }
+
+    // Pack the glyphs into one cache level, shelf by shelf
+    const int padding = NFONT_PRELOAD_PADDING;
+    int pageWidth = 0;
+    for(size_t i = 0; i < columns.size(); ++i)
+        pageWidth += columns[i].w + padding;
+    pageWidth = MIN(pageWidth, NFONT_PRELOAD_PAGE_SIZE);
+
+    std::vector<FC_GlyphData> glyphs;
+    int x = 0;
+    int y = 0;
+    for(size_t i = 0; i < columns.size(); ++i)
+    {
+        if(x > 0 && x + columns[i].w + padding > pageWidth)
+        {
+            x = 0;
+            y += height + padding;
+        }
+        glyphs.push_back(FC_MakeGlyphData(0, x, y, columns[i].w, height));
+        x += columns[i].w + padding;
+    }
+
+    SDL_Surface* page = createSurface32(MAX(pageWidth, 1), y + height);
+    if(page == NULL)
+    {
+        SDL_FreeSurface(surface);
+        return false;
+    }
+    SDL_FillRect(page, NULL, 0);
+    SDL_SetSurfaceBlendMode(surface, SDL_BLENDMODE_NONE);
+    for(size_t i = 0; i < columns.size(); ++i)
+        SDL_BlitSurface(surface, &columns[i], page, &glyphs[i].rect);
+
+    bool uploaded = uploadCacheLevel(font, 0, renderer, 0, page);
+    SDL_FreeSurface(page);
+    if(!uploaded)
+    {
+        SDL_FreeSurface(surface);
+        return false;
+    }
+
+    BitmapFontMetrics metrics;
+    metrics.height = height;
+    metrics.ascent = 0;
+    metrics.descent = 0;
+    metrics.baseline = height;
+    metrics.max_width = 0;
+
+    int first = height;
+    int last = 0;
+    for(size_t i = 0; i < columns.size(); ++i)
+    {
+        FC_SetGlyphData(font, packCodepoint(33 + i), glyphs[i]);
+        metrics.max_width = MAX(metrics.max_width, columns[i].w);
+
+        int glyphTop, glyphBottom;
+        if(getGlyphRows(surface, columns[i].x, columns[i].w, &glyphTop, &glyphBottom))
+        {
+            first = MIN(first, glyphTop);
+            last = MAX(last, glyphBottom);
+            if(33 + i == 'A')
+                metrics.baseline = glyphBottom + 1;
+        }
+    }
+    // Space is as wide as the first glyph, with nothing to draw
+    FC_SetGlyphData(font, ' ', FC_MakeGlyphData(0, glyphs[0].rect.x, glyphs[0].rect.y, glyphs[0].rect.w, 0));
+
+    if(first <= last)
+    {
+        metrics.ascent = MAX(0, metrics.baseline - first);
+        metrics.descent = MAX(0, last + 1 - metrics.baseline);
+    }
+    setBitmapMetrics(data, &metrics);
+
+    FC_SetDefaultColor(font, NFont::Color(255, 255, 255, 255).to_SDL_Color());
+    SDL_FreeSurface(surface);
+    return true;
+}
+
+// AngelCode BMFont descriptors, parsed in place
+struct BMFontChar
+{
+    Uint32 id;
+    int x, y, w, h;
+    int xoffset, yoffset, xadvance;
+    int page;
+    int chnl;
+};
+
+struct BMFontPage
+{
+    const char* file;  // Points into the descriptor
+    size_t length;
+};
+
+struct BMFontDesc
+{
+    int line_height;
+    int base;
+    bool packed;
+    std::vector<BMFontPage> pages;
+    std::vector<BMFontChar> chars;
+    KerningTable kerning;  // In Unicode values until loaded
+};
+
+static inline bool isBMFontSpace(char c)
+{
+    return (c == ' ' || c == '\t' || c == '\r');
+}
+
+static int parseBMFontInt(const char* c, const char* end)
+{
+    bool negative = (c < end && *c == '-');
+    if(negative)
+        ++c;
+    int result = 0;
+    for(; c < end && *c >= '0' && *c <= '9'; ++c)
+        result = result*10 + (*c - '0');
+    return (negative? -result : result);
+}
+
+static inline bool matchBMFontKey(const char* key, const char* keyEnd, const char* name)
+{
+    size_t length = strlen(name);
+    return (size_t(keyEnd - key) == length && memcmp(key, name, length) == 0);
+}
+
+// Reads the next word or key=value pair of a text descriptor line.  Quotes are stripped from the value.
+static bool readBMFontPair(const char*& c, const char* end, const char** key, const char** keyEnd, const char** value, const char** valueEnd)
+{
+    while(c < end && isBMFontSpace(*c))
+        ++c;
+    if(c >= end)
+        return false;
+
+    *key = c;
+    while(c < end && *c != '=' && !isBMFontSpace(*c))
+        ++c;
+    *keyEnd = c;
+    *value = *valueEnd = c;
+    if(c >= end || *c != '=')
+        return true;
+
+    ++c;
+    if(c < end && *c == '"')
+    {
+        *value = ++c;
+        while(c < end && *c != '"')
+            ++c;
+        *valueEnd = c;
+        if(c < end)
+            ++c;
+    }
+    else
+    {
+        *value = c;
+        while(c < end && !isBMFontSpace(*c))
+            ++c;
+        *valueEnd = c;
+    }
+    return true;
+}
+
+static bool parseBMFontText(const char* data, size_t size, BMFontDesc* desc)
+{
+    const char* end = data + size;
+    const char* line = data;
+    while(line < end)
+    {
+        const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+        if(lineEnd == NULL)
+            lineEnd = end;
+        const char* c = line;
+        line = (lineEnd < end? lineEnd + 1 : end);
+
+        const char* tag;
+        const char* tagEnd;
+        const char* key;
+        const char* keyEnd;
+        const char* value;
+        const char* valueEnd;
+        if(!readBMFontPair(c, lineEnd, &tag, &tagEnd, &value, &valueEnd))
+            continue;
+
+        if(matchBMFontKey(tag, tagEnd, "common"))
+        {
+            while(readBMFontPair(c, lineEnd, &key, &keyEnd, &value, &valueEnd))
+            {
+                if(matchBMFontKey(key, keyEnd, "lineHeight"))
+                    desc->line_height = parseBMFontInt(value, valueEnd);
+                else if(matchBMFontKey(key, keyEnd, "base"))
+                    desc->base = parseBMFontInt(value, valueEnd);
+                else if(matchBMFontKey(key, keyEnd, "packed"))
+                    desc->packed = (parseBMFontInt(value, valueEnd) != 0);
+            }
+        }
+        else if(matchBMFontKey(tag, tagEnd, "page"))
+        {
+            int id = -1;
+            BMFontPage page = {NULL, 0};
+            while(readBMFontPair(c, lineEnd, &key, &keyEnd, &value, &valueEnd))
+            {
+                if(matchBMFontKey(key, keyEnd, "id"))
+                    id = parseBMFontInt(value, valueEnd);
+                else if(matchBMFontKey(key, keyEnd, "file"))
+                {
+                    page.file = value;
+                    page.length = size_t(valueEnd - value);
+                }
+            }
+            if(id < 0 || id > 0xFF)
+                return false;
+            if(int(desc->pages.size()) <= id)
+                desc->pages.resize(id + 1, page);
+            desc->pages[id] = page;
+        }
+        else if(matchBMFontKey(tag, tagEnd, "char"))
+        {
+            BMFontChar ch = {0, 0, 0, 0, 0, 0, 0, 0, 0, 15};
+            while(readBMFontPair(c, lineEnd, &key, &keyEnd, &value, &valueEnd))
+            {
+                int n = parseBMFontInt(value, valueEnd);
+                if(matchBMFontKey(key, keyEnd, "id"))
+                    ch.id = Uint32(n);
+                else if(matchBMFontKey(key, keyEnd, "x"))
+                    ch.x = n;
+                else if(matchBMFontKey(key, keyEnd, "y"))
+                    ch.y = n;
+                else if(matchBMFontKey(key, keyEnd, "width"))
+                    ch.w = n;
+                else if(matchBMFontKey(key, keyEnd, "height"))
+                    ch.h = n;
+                else if(matchBMFontKey(key, keyEnd, "xoffset"))
+                    ch.xoffset = n;
+                else if(matchBMFontKey(key, keyEnd, "yoffset"))
+                    ch.yoffset = n;
+                else if(matchBMFontKey(key, keyEnd, "xadvance"))
+                    ch.xadvance = n;
+                else if(matchBMFontKey(key, keyEnd, "page"))
+                    ch.page = n;
+                else if(matchBMFontKey(key, keyEnd, "chnl"))
+                    ch.chnl = n;
+            }
+            desc->chars.push_back(ch);
+        }
+        else if(matchBMFontKey(tag, tagEnd, "kerning"))
+        {
+            KerningPair pair = {0, 0, 0};
+            while(readBMFontPair(c, lineEnd, &key, &keyEnd, &value, &valueEnd))
+            {
+                if(matchBMFontKey(key, keyEnd, "first"))
+                    pair.first = Uint32(parseBMFontInt(value, valueEnd));
+                else if(matchBMFontKey(key, keyEnd, "second"))
+                    pair.second = Uint32(parseBMFontInt(value, valueEnd));
+                else if(matchBMFontKey(key, keyEnd, "amount"))
+                    pair.amount = parseBMFontInt(value, valueEnd);
+            }
+            if(pair.amount != 0)
+                desc->kerning.push_back(pair);
+        }
+    }
+    return true;
+}
+
+static inline Uint32 readBMFontLE(const Uint8* c, int bytes)
+{
+    Uint32 result = 0;
+    for(int i = bytes - 1; i >= 0; --i)
+        result = (result << 8) | c[i];
+    return result;
+}
+
+// Version 3 of the binary format: "BMF", the version, then blocks of type, size and data
+static bool parseBMFontBinary(const Uint8* data, size_t size, BMFontDesc* desc)
+{
+    if(size < 4 || data[3] != 3)
+        return false;
+
+    const Uint8* end = data + size;
+    const Uint8* c = data + 4;
+    while(end - c >= 5)
+    {
+        int type = c[0];
+        Uint32 blockSize = readBMFontLE(c + 1, 4);
+        c += 5;
+        if(blockSize > size_t(end - c))
+            return false;
+        const Uint8* block = c;
+        const Uint8* blockEnd = c + blockSize;
+        c = blockEnd;
+
+        if(type == 2 && blockSize >= 15)
+        {
+            desc->line_height = readBMFontLE(block, 2);
+            desc->base = readBMFontLE(block + 2, 2);
+            desc->packed = ((block[10] & 0x01) != 0);
+        }
+        else if(type == 3)
+        {
+            // Page names are null-terminated
+            while(block < blockEnd)
+            {
+                const Uint8* nameEnd = (const Uint8*)memchr(block, 0, blockEnd - block);
+                if(nameEnd == NULL)
+                    nameEnd = blockEnd;
+                BMFontPage page = {(const char*)block, size_t(nameEnd - block)};
+                desc->pages.push_back(page);
+                block = nameEnd + 1;
+            }
+        }
+        else if(type == 4)
+        {
+            for(; blockEnd - block >= 20; block += 20)
+            {
+                BMFontChar ch;
+                ch.id = readBMFontLE(block, 4);
+                ch.x = readBMFontLE(block + 4, 2);
+                ch.y = readBMFontLE(block + 6, 2);
+                ch.w = readBMFontLE(block + 8, 2);
+                ch.h = readBMFontLE(block + 10, 2);
+                ch.xoffset = Sint16(readBMFontLE(block + 12, 2));
+                ch.yoffset = Sint16(readBMFontLE(block + 14, 2));
+                ch.xadvance = Sint16(readBMFontLE(block + 16, 2));
+                ch.page = block[18];
+                ch.chnl = block[19];
+                desc->chars.push_back(ch);
+            }
+        }
+        else if(type == 5)
+        {
+            for(; blockEnd - block >= 10; block += 10)
+            {
+                KerningPair pair = {readBMFontLE(block, 4), readBMFontLE(block + 4, 4), Sint16(readBMFontLE(block + 8, 2))};
+                if(pair.amount != 0)
+                    desc->kerning.push_back(pair);
+            }
+        }
+    }
+    return true;
+}
+
+static bool parseBMFont(const void* data, size_t size, BMFontDesc* desc)
+{
+    desc->line_height = 0;
+    desc->base = 0;
+    desc->packed = false;
+
+    bool parsed;
+    if(size >= 3 && memcmp(data, "BMF", 3) == 0)
+        parsed = parseBMFontBinary((const Uint8*)data, size, desc);
+    else
+        parsed = parseBMFontText((const char*)data, size, desc);
+    return (parsed && desc->line_height > 0);
+}
+
+// Packed descriptors keep each glyph in one channel (chnl: 1 blue, 2 green, 4 red, 8 alpha).
+// That channel becomes the alpha of a white glyph.
+static void extractBMFontChannel(SDL_Surface* surface, int chnl)
+{
+    int channel;
+    switch(chnl)
+    {
+    case 1: channel = 2; break;
+    case 2: channel = 1; break;
+    case 4: channel = 0; break;
+    case 8: channel = 3; break;
+    default: return;
+    }
+
+    // createSurface32() keeps the bytes in RGBA order on either endianness
+    for(int y = 0; y < surface->h; ++y)
+    {
+        Uint8* p = (Uint8*)surface->pixels + y*surface->pitch;
+        for(int x = 0; x < surface->w; ++x, p += 4)
+        {
+            Uint8 alpha = p[channel];
+            p[0] = p[1] = p[2] = 255;
+            p[3] = alpha;
+        }
+    }
+}
+
+// Cuts each character out of its page into a cell as wide as its advance and as tall as a line, since
+// SDL_FontCache glyphs have no offsets, then packs the cells as preloadGlyphs() does.
+static bool loadBMFont(NFont_FontData* data, NFont_Target* renderer, const BMFontDesc& desc, SDL_Surface** pages, int num_pages)
+{
+    FC_Font* font = data->font;
+    std::vector<SDL_BlendMode> blendModes(num_pages, SDL_BLENDMODE_NONE);
+    for(int i = 0; i < num_pages; ++i)
+    {
+        if(pages[i] == NULL)
+            continue;
+        SDL_GetSurfaceBlendMode(pages[i], &blendModes[i]);
+        SDL_SetSurfaceBlendMode(pages[i], SDL_BLENDMODE_NONE);
+    }
+
+    BitmapFontMetrics metrics;
+    metrics.height = desc.line_height;
+    metrics.baseline = desc.base;
+    metrics.max_width = 0;
+    int top = desc.base;
+    int bottom = desc.base;
+
+    std::vector<Uint32> codepoints;
+    std::vector<StagedGlyph> cells;
+    for(size_t i = 0; i < desc.chars.size(); ++i)
+    {
+        const BMFontChar& ch = desc.chars[i];
+        if(ch.xadvance <= 0 || ch.page < 0 || ch.page >= num_pages || pages[ch.page] == NULL)
+            continue;
+
+        SDL_Surface* cell = createSurface32(ch.xadvance, desc.line_height);
+        if(cell == NULL)
+            continue;
+        SDL_FillRect(cell, NULL, 0);
+        if(ch.w > 0 && ch.h > 0)
+        {
+            SDL_Rect srcRect = {ch.x, ch.y, ch.w, ch.h};
+            SDL_Rect destRect = {ch.xoffset, ch.yoffset, ch.w, ch.h};
+            SDL_BlitSurface(pages[ch.page], &srcRect, cell, &destRect);
+            if(desc.packed)
+                extractBMFontChannel(cell, ch.chnl);
+
+            top = MIN(top, ch.yoffset);
+            bottom = MAX(bottom, ch.yoffset + ch.h);
+        }
+
+        codepoints.push_back(packCodepoint(ch.id));
+        cells.push_back(StagedGlyph());
+        takeGlyph(cell, &cells.back());
+        metrics.max_width = MAX(metrics.max_width, ch.xadvance);
+    }
+
+    for(int i = 0; i < num_pages; ++i)
+    {
+        if(pages[i] != NULL)
+            SDL_SetSurfaceBlendMode(pages[i], blendModes[i]);
+    }
+
+    int numLoaded = uploadPreloadedGlyphs(font, NULL, renderer, codepoints, cells);
+    if(numLoaded == 0)
+        return false;
+
+    metrics.ascent = desc.base - top;
+    metrics.descent = bottom - desc.base;
+    setBitmapMetrics(data, &metrics);
+
+    data->kerning = desc.kerning;
+    for(size_t i = 0; i < data->kerning.size(); ++i)
+    {
+        KerningPair& pair = data->kerning[i];
+        pair.first = packCodepoint(pair.first);
+        pair.second = packCodepoint(pair.second);
+    }
+    std::sort(data->kerning.begin(), data->kerning.end(), lessKerningPair);
+
+    FC_SetDefaultColor(font, NFont::Color(255, 255, 255, 255).to_SDL_Color());
+    return true;
+}
+
+static SDL_Surface* loadBMFontPage(const string& filename)
+{
+    #ifdef NFONT_USE_SDL_IMAGE
+    return IMG_Load(filename.c_str());
+    #else
+    return SDL_LoadBMP(filename.c_str());
+    #endif
+}
+
+static Uint32 packColor(const SDL_Color& color)
+{
+    return (Uint32(color.r) << 24) | (Uint32(color.g) << 16) | (Uint32(color.b) << 8) | color.a;
+}
+
+// NFont::Registry's fonts, keyed by where they came from and how they were rendered
+struct RegistryKey
+{
+    NFont_Target* renderer;
+    string filename;  // Empty for an RWops
+    SDL_RWops* rwops;
+    Uint32 pointSize;
+    int style;
+    Uint32 color;
+
+    bool operator<(const RegistryKey& key) const
+    {
+        if(renderer != key.renderer)
+            return renderer < key.renderer;
+        if(rwops != key.rwops)
+            return rwops < key.rwops;
+        if(pointSize != key.pointSize)
+            return pointSize < key.pointSize;
+        if(style != key.style)
+            return style < key.style;
+        if(color != key.color)
+            return color < key.color;
+        return filename < key.filename;
+    }
+};
+
+typedef std::map<RegistryKey, NFont_FontData*> RegistryMap;
+
+static RegistryMap registry_fonts;
+static SDL_mutex* registry_mutex = NULL;
+static SDL_SpinLock registry_mutex_lock = 0;
+
+static SDL_mutex* getRegistryMutex()
+{
+    SDL_AtomicLock(&registry_mutex_lock);
+    if(registry_mutex == NULL)
+        registry_mutex = SDL_CreateMutex();
+    SDL_AtomicUnlock(&registry_mutex_lock);
+    return registry_mutex;
+}
+
+static RegistryKey makeRegistryKey(NFont_Target* renderer, const char* filename_ttf, SDL_RWops* rwops, Uint32 pointSize, const SDL_Color& color, int style)
+{
+    RegistryKey key;
+    key.renderer = renderer;
+    if(filename_ttf != NULL)
+        key.filename = filename_ttf;
+    key.rwops = rwops;
+    key.pointSize = pointSize;
+    key.style = style;
+    key.color = packColor(color);
+    return key;
+}
+
+// The registry must be locked.
+static void unregisterFont(NFont_FontData* data)
+{
+    for(RegistryMap::iterator e = registry_fonts.begin(); e != registry_fonts.end(); ++e)
+    {
+        if(e->second == data)
+        {
+            registry_fonts.erase(e);
+            return;
+        }
+    }
+}
+
+// The size of a cache level's texture, padding included
+static bool getImageSize(NFont_Image* image, int* w, int* h)
+{
+    if(image == NULL)
+        return false;
+    #ifdef NFONT_USE_SDL_GPU
+    *w = image->texture_w;
+    *h = image->texture_h;
+    return true;
+    #else
+    return (SDL_QueryTexture(image, NULL, NULL, w, h) == 0);
+    #endif
+}
+
+static Uint64 getCacheLevelBytes(FC_Font* font, int level)
+{
+    NFont_Image* image = FC_GetGlyphCacheLevel(font, level);
+    int w, h;
+    if(!getImageSize(image, &w, &h))
+        return 0;
+
+    #ifdef NFONT_USE_SDL_GPU
+    return Uint64(w)*h*image->bytes_per_pixel;
+    #else
+    return Uint64(w)*h*4;
+    #endif
+}
+
+static Uint64 getCacheTextureBytes(FC_Font* font)
+{
+    Uint64 bytes = 0;
+    int numLevels = FC_GetNumCacheLevels(font);
+    for(int i = 0; i < numLevels; ++i)
+        bytes += getCacheLevelBytes(font, i);
+    return bytes;
+}
+
+// The glyphs of a font loaded by loadSDF(), as signed distance fields kept on the CPU for surface draws alone.
+// A field byte is 128 on the glyph's outline and moves 127 every 'spread' pixels, rising inside the glyph and
+// falling outside.
+struct SDFGlyph
+{
+    Uint16 w;
+    Uint16 h;
+    size_t offset;  // Into SDFAtlas::fields
+};
+
+struct SDFAtlas
+{
+    TTF_Font* ttf;  // Renders the glyphs that were not in the loading string
+    int spread;
+    std::map<Uint32, SDFGlyph> glyphs;
+    std::vector<Uint8> fields;
+};
+
+static void freeSDFAtlas(SDFAtlas* atlas)
+{
+    if(atlas == NULL)
+        return;
+
+    closeTTF(atlas->ttf);
+    delete atlas;
+}
+
+#define NFONT_SDF_FAR 1e20f
+
+// Squared distance transform of n samples, stride apart (Felzenszwalb and Huttenlocher).  Each sample is
+// replaced by its smallest f[q] + (p - q)^2, and nearest gets that q.  d needs n elements, v n and z n + 1.
+static void transformDistances(float* f, int n, int stride, float* d, int* v, float* z, int* nearest)
+{
+    int k = 0;
+    v[0] = 0;
+    z[0] = -NFONT_SDF_FAR;
+    z[1] = NFONT_SDF_FAR;
+    for(int q = 1; q < n; ++q)
+    {
+        float s;
+        while(1)
+        {
+            int r = v[k];
+            s = ((f[q*stride] + float(q*q)) - (f[r*stride] + float(r*r)))/float(2*q - 2*r);
+            if(s > z[k] || k == 0)
+                break;
+            --k;
+        }
+        ++k;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = NFONT_SDF_FAR;
+    }
+
+    k = 0;
+    for(int q = 0; q < n; ++q)
+    {
+        while(z[k + 1] < q)
+            ++k;
+        d[q] = float((q - v[k])*(q - v[k])) + f[v[k]*stride];
+        nearest[q] = v[k];
+    }
+    for(int q = 0; q < n; ++q)
+        f[q*stride] = d[q];
+}
+
+// Finds the nearest seed (a 0 in grid) to each pixel of a w x h grid, or -1 if there are none.
+static void findNearestSeeds(std::vector<float>& grid, int w, int h, std::vector<int>& result)
+{
+    int n = MAX(w, h);
+    std::vector<float> d(n);
+    std::vector<int> v(n);
+    std::vector<float> z(n + 1);
+    std::vector<int> nearest(n);
+    std::vector<int> rows(w*h);
+
+    for(int x = 0; x < w; ++x)
+    {
+        transformDistances(&grid[x], h, w, &d[0], &v[0], &z[0], &nearest[0]);
+        for(int y = 0; y < h; ++y)
+            rows[y*w + x] = nearest[y];
+    }
+
+    result.resize(w*h);
+    for(int y = 0; y < h; ++y)
+    {
+        transformDistances(&grid[y*w], w, 1, &d[0], &v[0], &z[0], &nearest[0]);
+        for(int x = 0; x < w; ++x)
+        {
+            int seed = nearest[x];
+            result[y*w + x] = (grid[y*w + x] < NFONT_SDF_FAR/2? rows[y*w + seed]*w + seed : -1);
+        }
+    }
+}
+
+// Turns a glyph rendered by SDL_ttf into a distance field of the same size.  Each pixel measures to the
+// nearest pixel across the outline, which is placed inside that pixel by its coverage.  The field is
+// padded so that ink at the edge of the glyph still ends there.
+static void buildDistanceField(SDL_Surface* glyph, int spread, Uint8* result)
+{
+    const int w = glyph->w + 2;
+    const int h = glyph->h + 2;
+    std::vector<float> coverage(w*h, 0.0f);
+    const SDL_PixelFormat* format = glyph->format;
+    for(int y = 0; y < glyph->h; ++y)
+    {
+        const Uint32* row = (const Uint32*)((Uint8*)glyph->pixels + y*glyph->pitch);
+        for(int x = 0; x < glyph->w; ++x)
+            coverage[(y + 1)*w + x + 1] = ((row[x] & format->Amask) >> format->Ashift)/255.0f;
+    }
+
+    // Pixels that hold some background, and some ink
+    std::vector<float> grid(w*h);
+    std::vector<int> nearestOutside;
+    std::vector<int> nearestInside;
+    for(int i = 0; i < w*h; ++i)
+        grid[i] = (coverage[i] < 1.0f? 0.0f : NFONT_SDF_FAR);
+    findNearestSeeds(grid, w, h, nearestOutside);
+    for(int i = 0; i < w*h; ++i)
+        grid[i] = (coverage[i] > 0.0f? 0.0f : NFONT_SDF_FAR);
+    findNearestSeeds(grid, w, h, nearestInside);
+
+    float step = 127.0f/spread;
+    for(int y = 1; y < h - 1; ++y)
+    {
+        for(int x = 1; x < w - 1; ++x)
+        {
+            int i = y*w + x;
+            bool inside = (coverage[i] >= 0.5f);
+            const std::vector<int>& nearest = (inside? nearestOutside : nearestInside);
+
+            // Seeds tie often, so the neighbors' nearest seeds are tried as well
+            float distance = float(spread);
+            for(int j = -1; j <= 1; ++j)
+            {
+                for(int k = -1; k <= 1; ++k)
+                {
+                    int seed = nearest[i + j*w + k];
+                    if(seed < 0)
+                        continue;
+                    float dx = float(x - seed%w);
+                    float dy = float(y - seed/w);
+                    float d = sqrtf(dx*dx + dy*dy) + (inside? coverage[seed] - 0.5f : 0.5f - coverage[seed]);
+                    distance = MIN(distance, d);
+                }
+            }
+            float value = 128.0f + (inside? distance : -distance)*step;
+            *result++ = Uint8(MAX(0.0f, MIN(255.0f, value + 0.5f)));
+        }
+    }
+}
+
+// Returns a glyph's field, rendering it first if needed, or NULL if it has none.  The font must be locked.
+static const SDFGlyph* getSDFGlyph(SDFAtlas* atlas, Uint32 codepoint)
+{
+    std::map<Uint32, SDFGlyph>::const_iterator e = atlas->glyphs.find(codepoint);
+    if(e != atlas->glyphs.end())
+        return (e->second.w > 0? &e->second : NULL);
+
+    SDFGlyph glyph = {0, 0, atlas->fields.size()};
+    char buff[5];
+    unpackCodepoint(buff, codepoint);
+    SDL_Color white = {255, 255, 255, 255};
+    SDL_Surface* surface = (atlas->ttf != NULL? TTF_RenderUTF8_Blended(atlas->ttf, buff, white) : NULL);
+    if(surface != NULL && surface->format->BytesPerPixel == 4 && surface->w > 0 && surface->h > 0)
+    {
+        glyph.w = Uint16(surface->w);
+        glyph.h = Uint16(surface->h);
+        atlas->fields.resize(glyph.offset + glyph.w*glyph.h);
+        buildDistanceField(surface, atlas->spread, &atlas->fields[glyph.offset]);
+    }
+    SDL_FreeSurface(surface);
+
+    // Glyphs that fail are remembered too, so they are not rendered again
+    const SDFGlyph& result = (atlas->glyphs[codepoint] = glyph);
+    return (result.w > 0? &result : NULL);
+}
+
+// SDL_FontCache's own loading string, the printable ASCII characters
+static string getDefaultLoadingString()
+{
+    string result;
+    for(char c = 32; c < 127; ++c)
+        result += c;
+    return result;
+}
+
+// An NFont::loadAsync() in flight.  The thread owns everything but 'done' until it sets it.
+struct NFont_AsyncLoad
+{
+    SDL_Thread* thread;
+    SDL_atomic_t done;
+
+    #ifndef NFONT_USE_SDL_GPU
+    NFont_Target* renderer;
+    #endif
+    string filename;
+    SDL_RWops* rwops;  // Used instead of the filename when not NULL
+    Uint8 own_rwops;
+    Uint32 pointSize;
+    int style;
+    SDL_Color color;
+    string loading_string;
+
+    TTF_Font* ttf;
+    std::vector<Uint32> codepoints;
+    std::vector<StagedGlyph> glyphs;
+    Uint32 font_id;  // For the trace zones
+};
+
+// Opens the TTF and renders the loading string's glyphs, leaving only the upload to the render thread
+static int asyncLoadWorker(void* data)
+{
+    NFont_AsyncLoad* load = (NFont_AsyncLoad*)data;
+    load->ttf = openTTF((load->rwops == NULL? load->filename.c_str() : NULL), load->rwops, load->own_rwops, load->pointSize, load->style);
+    if(load->ttf != NULL)
+    {
+        const char* end = load->loading_string.c_str() + load->loading_string.size();
+        for(const char* c = load->loading_string.c_str(); c < end;)
+            load->codepoints.push_back(readCodepoint(c, end));
+        std::sort(load->codepoints.begin(), load->codepoints.end());
+        load->codepoints.erase(std::unique(load->codepoints.begin(), load->codepoints.end()), load->codepoints.end());
+
+        TraceScope trace("NFont rasterize", load->font_id);
+        SDL_Color white = {255, 255, 255, 255};
+        load->glyphs.resize(load->codepoints.size());
+        for(size_t i = 0; i < load->codepoints.size(); ++i)
+        {
+            char buff[5];
+            unpackCodepoint(buff, load->codepoints[i]);
+            SDL_Surface* surface = TTF_RenderUTF8_Blended(load->ttf, buff, white);
+            if(surface != NULL)
+            {
+                ++trace.zone.glyphs;
+                trace.zone.bytes += Uint64(surface->w)*surface->h*4;
+            }
+            takeGlyph(surface, &load->glyphs[i]);
+        }
+    }
+
+    SDL_AtomicSet(&load->done, 1);
+    return 0;
+}
+
+// Starts SDL_FontCache on an open TTF without rendering the loading string, for glyphs that come from elsewhere
+static bool loadFontWithoutGlyphs(FC_Font* font, NFont_Target* renderer, TTF_Font* ttf, const SDL_Color& color, const string& loadingString)
+{
+    FC_SetLoadingString(font, " ");
+    #ifdef NFONT_USE_SDL_GPU
+    (void)renderer;
+    bool result = FC_LoadFontFromTTF(font, ttf, color);
+    #else
+    bool result = FC_LoadFontFromTTF(font, renderer, ttf, color);
+    #endif
+    FC_SetLoadingString(font, loadingString.c_str());
+    return result;
+}
+
+// Glyph cache files hold the cache levels and glyph rects of one font, keyed by the TTF's contents,
+// point size, style and color.  Values are little-endian and pixels are RGBA bytes.
+#define NFONT_GLYPH_CACHE_MAGIC 0x4347464E  // "NFGC"
+#define NFONT_GLYPH_CACHE_VERSION 1
+
+struct GlyphCacheHeader
+{
+    Uint64 font_hash;
+    Uint32 pointSize;
+    Uint32 style;
+    Uint32 color;
+    Uint32 line_height;
+    Uint32 ascent;
+    Uint32 descent;
+    Uint32 baseline;
+};
+
+static Uint8* readFile(const char* filename, size_t* size)
+{
+    SDL_RWops* rwops = SDL_RWFromFile(filename, "rb");
+    if(rwops == NULL)
+        return NULL;
+
+    Sint64 fileSize = SDL_RWsize(rwops);
+    Uint8* data = (fileSize > 0? (Uint8*)SDL_malloc(size_t(fileSize)) : NULL);
+    if(data != NULL && SDL_RWread(rwops, data, size_t(fileSize), 1) != 1)
+    {
+        SDL_free(data);
+        data = NULL;
+    }
+    SDL_RWclose(rwops);
+
+    *size = size_t(fileSize);
+    return data;
+}
+
+// 64-bit FNV-1a of a whole file
+static bool hashFile(const char* filename, Uint64* result)
+{
+    SDL_RWops* rwops = SDL_RWFromFile(filename, "rb");
+    if(rwops == NULL)
+        return false;
+
+    Uint64 hash = 14695981039346656037ULL;
+    Uint8 buffer[65536];
+    size_t size;
+    while((size = SDL_RWread(rwops, buffer, 1, sizeof(buffer))) > 0)
+    {
+        for(size_t i = 0; i < size; ++i)
+            hash = (hash ^ buffer[i])*1099511628211ULL;
+    }
+    SDL_RWclose(rwops);
+
+    *result = hash;
+    return true;
+}
+
+static void getGlyphCacheHeader(NFont_FontData* data, GlyphCacheHeader* header)
+{
+    header->line_height = getLineHeight(data);
+    header->ascent = getFontAscent(data);
+    header->descent = getFontDescent(data);
+    header->baseline = getFontBaseline(data);
+}
+
+static void writeGlyphCacheHeader(SDL_RWops* rwops, const GlyphCacheHeader& header)
+{
+    SDL_WriteLE32(rwops, NFONT_GLYPH_CACHE_MAGIC);
+    SDL_WriteLE32(rwops, NFONT_GLYPH_CACHE_VERSION);
+    SDL_WriteLE64(rwops, header.font_hash);
+    SDL_WriteLE32(rwops, header.pointSize);
+    SDL_WriteLE32(rwops, header.style);
+    SDL_WriteLE32(rwops, header.color);
+    SDL_WriteLE32(rwops, header.line_height);
+    SDL_WriteLE32(rwops, header.ascent);
+    SDL_WriteLE32(rwops, header.descent);
+    SDL_WriteLE32(rwops, header.baseline);
+}
+
+// Reads values out of a glyph cache file that is loaded whole, so pixels can be used in place.
+struct GlyphCacheReader
+{
+    const Uint8* data;
+    size_t size;
+    size_t pos;
+    bool ok;
+
+    const Uint8* read(size_t n)
+    {
+        if(!ok || n > size - pos)
+        {
+            ok = false;
+            return NULL;
+        }
+        const Uint8* result = data + pos;
+        pos += n;
+        return result;
+    }
+
+    Uint32 readLE32()
+    {
+        const Uint8* c = read(4);
+        return (c == NULL? 0 : Uint32(c[0]) | (Uint32(c[1]) << 8) | (Uint32(c[2]) << 16) | (Uint32(c[3]) << 24));
+    }
+
+    Uint64 readLE64()
+    {
+        Uint64 low = readLE32();
+        return low | (Uint64(readLE32()) << 32);
+    }
+};
+
+static bool readGlyphCacheHeader(GlyphCacheReader& reader, GlyphCacheHeader* header)
+{
+    if(reader.readLE32() != NFONT_GLYPH_CACHE_MAGIC || reader.readLE32() != NFONT_GLYPH_CACHE_VERSION)
+        return false;
+
+    header->font_hash = reader.readLE64();
+    header->pointSize = reader.readLE32();
+    header->style = reader.readLE32();
+    header->color = reader.readLE32();
+    header->line_height = reader.readLE32();
+    header->ascent = reader.readLE32();
+    header->descent = reader.readLE32();
+    header->baseline = reader.readLE32();
+    return reader.ok;
+}
+
+// Copies a cache level back from video memory
+static SDL_Surface* readCacheLevel(NFont_Target* renderer, NFont_Image* image)
+{
+    #ifdef NFONT_USE_SDL_GPU
+    (void)renderer;
+    SDL_Surface* surface = GPU_CopySurfaceFromImage(image);
+    if(surface == NULL)
+        return NULL;
+    SDL_Surface* result = createSurface32(surface->w, surface->h);
+    if(result != NULL && image->format == GPU_FORMAT_ALPHA && surface->format->BytesPerPixel == 1)
+    {
+        // Coverage, which comes back as the white glyphs it was packed from
+        for(int y = 0; y < surface->h; ++y)
+        {
+            const Uint8* src = (const Uint8*)surface->pixels + y*surface->pitch;
+            Uint8* row = (Uint8*)result->pixels + y*result->pitch;
+            for(int x = 0; x < surface->w; ++x, row += 4)
+            {
+                row[0] = row[1] = row[2] = 255;
+                row[3] = src[x];
+            }
+        }
+    }
+    else if(result != NULL)
+    {
+        SDL_SetSurfaceBlendMode(surface, SDL_BLENDMODE_NONE);
+        SDL_BlitSurface(surface, NULL, result, NULL);
+    }
+    SDL_FreeSurface(surface);
+    return result;
+    #else
+    int w, h;
+    if(SDL_QueryTexture(image, NULL, NULL, &w, &h) < 0)
+        return NULL;
+    SDL_Surface* result = createSurface32(w, h);
+    if(result == NULL)
+        return NULL;
+
+    // Only render target textures can be read back
+    SDL_Texture* target = SDL_GetRenderTarget(renderer);
+    bool ok = (SDL_SetRenderTarget(renderer, image) == 0
+               && SDL_RenderReadPixels(renderer, NULL, result->format->format, result->pixels, result->pitch) == 0);
+    SDL_SetRenderTarget(renderer, target);
+    if(!ok)
+    {
+        SDL_FreeSurface(result);
+        return NULL;
+    }
+    return result;
+    #endif
+}
+
+static bool writeGlyphCache(FC_Font* font, NFont_Target* renderer, SDL_RWops* rwops, const GlyphCacheHeader& header)
+{
+    writeGlyphCacheHeader(rwops, header);
+
+    int numLevels = FC_GetNumCacheLevels(font);
+    SDL_WriteLE32(rwops, numLevels);
+    for(int i = 0; i < numLevels; ++i)
+    {
+        SDL_Surface* surface = readCacheLevel(renderer, FC_GetGlyphCacheLevel(font, i));
+        if(surface == NULL)
+            return false;
+
+        SDL_WriteLE32(rwops, surface->w);
+        SDL_WriteLE32(rwops, surface->h);
+        bool ok = true;
+        for(int y = 0; y < surface->h && ok; ++y)
+            ok = (SDL_RWwrite(rwops, (Uint8*)surface->pixels + y*surface->pitch, surface->w*4, 1) == 1);
+        SDL_FreeSurface(surface);
+        if(!ok)
+            return false;
+    }
+
+    std::vector<Uint32> codepoints;
+    getCachedCodepoints(font, codepoints);
+    SDL_WriteLE32(rwops, Uint32(codepoints.size()));
+    for(size_t i = 0; i < codepoints.size(); ++i)
+    {
+        FC_GlyphData glyph;
+        FC_GetGlyphData(font, &glyph, codepoints[i]);
+        SDL_WriteLE32(rwops, codepoints[i]);
+        SDL_WriteLE32(rwops, glyph.cache_level);
+        SDL_WriteLE32(rwops, glyph.rect.x);
+        SDL_WriteLE32(rwops, glyph.rect.y);
+        SDL_WriteLE32(rwops, glyph.rect.w);
+        if(SDL_WriteLE32(rwops, glyph.rect.h) != 1)
+            return false;
+    }
+    return true;
+}
+
+// Uploads the cache levels and glyphs of a glyph cache file after those the font already has.
+// Returns false, leaving the font for the caller to clear, if the file is truncated or a glyph lies outside its level.
+static bool readGlyphCache(FC_Font* font, GlyphCacheReader& reader)
+{
+    int firstLevel = FC_GetNumCacheLevels(font);
+    Uint32 numLevels = reader.readLE32();
+    std::vector<SDL_Point> levelSizes;
+    for(Uint32 i = 0; i < numLevels && reader.ok; ++i)
+    {
+        int w = reader.readLE32();
+        int h = reader.readLE32();
+        if(w <= 0 || h <= 0 || w > 16384 || h > 16384)
+            return false;
+        SDL_Point size = {w, h};
+        levelSizes.push_back(size);
+        const Uint8* pixels = reader.read(size_t(w)*h*4);
+        if(pixels == NULL)
+            return false;
+
+        SDL_Surface* surface = createSurface32From((void*)pixels, w, h);
+        bool ok = (surface != NULL && uploadCacheLevel(font, 0, NULL, firstLevel + i, surface));
+        SDL_FreeSurface(surface);
+        if(!ok)
+            return false;
+    }
+
+    std::vector<Uint32> cached;
+    getCachedCodepoints(font, cached);
+    Uint32 numGlyphs = reader.readLE32();
+    for(Uint32 i = 0; i < numGlyphs && reader.ok; ++i)
+    {
+        Uint32 codepoint = reader.readLE32();
+        Uint32 level = reader.readLE32();
+        int x = reader.readLE32();
+        int y = reader.readLE32();
+        int w = reader.readLE32();
+        int h = reader.readLE32();
+        if(!reader.ok || level >= levelSizes.size())
+            return false;
+        const SDL_Point& levelSize = levelSizes[level];
+        if(x < 0 || y < 0 || w < 0 || h < 0 || w > levelSize.x - x || h > levelSize.y - y)
+            return false;
+        if(!std::binary_search(cached.begin(), cached.end(), codepoint))
+            FC_SetGlyphData(font, codepoint, FC_MakeGlyphData(firstLevel + level, x, y, w, h));
+    }
+    return reader.ok;
+}
+
+static bool getClip(NFont_Target* dest, NFont::Rectf* clip)
+{
+    #ifdef NFONT_USE_SDL_GPU
+    if(!dest->use_clip_rect)
+        return false;
+    *clip = NFont::Rectf(dest->clip_rect);
+    #else
+    if(!SDL_RenderIsClipEnabled(dest))
+        return false;
+    SDL_Rect r;
+    SDL_RenderGetClipRect(dest, &r);
+    *clip = NFont::Rectf(r);
+    #endif
+    return true;
+}
+
+static void setClip(NFont_Target* dest, const NFont::Rectf* clip)
+{
+    #ifdef NFONT_USE_SDL_GPU
+    if(clip != NULL)
+        GPU_SetClipRect(dest, clip->to_GPU_Rect());
+    else
+        GPU_UnsetClip(dest);
+    #else
+    if(clip != NULL)
+    {
+        SDL_Rect r = clip->to_SDL_Rect();
+        SDL_RenderSetClipRect(dest, &r);
+    }
+    else
+        SDL_RenderSetClipRect(dest, NULL);
+    #endif
+}
+
+static NFont::Rectf drawBoxText(NFont_FontData* data, NFont_Target* dest, const NFont::Rectf& box, const NFont::Effect& effect, const char* text, const char* end)
+{
+    if(text == NULL)
+        return NFont::Rectf(box.x, box.y, 0, 0);
+
+    if(active_batch != NULL && active_batch->dest == dest)
+    {
+        bool oldUseClip = active_batch->use_clip;
+        NFont::Rectf oldClip = active_batch->clip;
+        active_batch->clip = (oldUseClip? rectIntersect(oldClip, box) : box);
+        active_batch->use_clip = true;
+
+        drawColumnText(data, dest, box.x, box.y, box.w, effect, text, end);
+
+        active_batch->use_clip = oldUseClip;
+        active_batch->clip = oldClip;
+        return box;
+    }
+
+    NFont::Rectf oldClip;
+    bool useClip = getClip(dest, &oldClip);
+    NFont::Rectf newClip = (useClip? rectIntersect(oldClip, box) : box);
+    setClip(dest, &newClip);
+
+    drawColumnText(data, dest, box.x, box.y, box.w, effect, text, end);
+
+    setClip(dest, useClip? &oldClip : NULL);
+    return box;
+}
+
+// Glyphs copied out of the glyph cache, so they can be drawn into surfaces without reading textures back
+// every time.  Glyphs that are white wherever they show keep one byte of coverage per pixel; those of bitmap
+// fonts keep RGBA bytes, as readCacheLevel() returns them.
+struct SurfaceGlyph
+{
+    Uint16 w;
+    Uint16 h;
+    size_t offset;  // Into SurfaceAtlas::pixels
+    Uint8 bytes_per_pixel;  // 1 or 4
+};
+
+struct SurfaceAtlas
+{
+    std::map<Uint32, SurfaceGlyph> glyphs;
+    std::vector<Uint8> pixels;
+};
+
+// Copies the glyphs of the text that are not on the CPU yet, reading each cache level they are on back once.
+// The font must be locked.
+static void copySurfaceGlyphs(FC_Font* font, NFont_Target* renderer, SurfaceAtlas* atlas, const char* text, const char* end)
+{
+    std::vector<Uint32> codepoints;
+    std::vector<FC_GlyphData> glyphs;
+    for(const char* c = text; c < end;)
+    {
+        Uint32 codepoint = readCodepoint(c, end);
+        FC_GlyphData glyph;
+        if(codepoint == '\n' || atlas->glyphs.find(codepoint) != atlas->glyphs.end() || !FC_GetGlyphData(font, &glyph, codepoint))
+            continue;
+
+        // Held empty until it is copied, so repeats are skipped
+        SurfaceGlyph empty = {0, 0, 0, 1};
+        atlas->glyphs[codepoint] = empty;
+        codepoints.push_back(codepoint);
+        glyphs.push_back(glyph);
+    }
+
+    std::vector<bool> done(codepoints.size(), false);
+    for(size_t i = 0; i < codepoints.size(); ++i)
+    {
+        if(done[i])
+            continue;
+
+        int level = glyphs[i].cache_level;
+        SDL_Surface* surface = readCacheLevel(renderer, FC_GetGlyphCacheLevel(font, level));
+        for(size_t j = i; j < codepoints.size(); ++j)
+        {
+            if(done[j] || glyphs[j].cache_level != level)
+                continue;
+            done[j] = true;
+
+            SDL_Rect r = glyphs[j].rect;
+            if(surface == NULL || r.x < 0 || r.y < 0 || r.w <= 0 || r.h <= 0 || r.x + r.w > surface->w || r.y + r.h > surface->h)
+            {
+                // Tried again on the next draw
+                atlas->glyphs.erase(codepoints[j]);
+                continue;
+            }
+
+            StagedGlyph staged;
+            stageGlyph(surface, r, &staged);
+            SurfaceGlyph glyph = {Uint16(r.w), Uint16(r.h), atlas->pixels.size(), staged.bytes_per_pixel};
+            atlas->pixels.insert(atlas->pixels.end(), staged.pixels.begin(), staged.pixels.end());
+            atlas->glyphs[codepoints[j]] = glyph;
+        }
+        SDL_FreeSurface(surface);
+    }
+}
+
+// A draw into an SDL_Surface, from the glyphs kept on the CPU
+struct SurfaceDraw
+{
+    NFont_FontData* data;
+    NFont_Stats* stats;
+    NFont_Target* renderer;
+    SurfaceAtlas* glyphs;
+    SDFAtlas* sdf;  // Drawn from instead of glyphs when not NULL
+    SDL_Surface* dest;
+    SDL_Rect clip;
+    SDL_Color color;
+    Uint32 mapped_color;  // color in dest's format
+    NFont_SpanBlender blend;  // NULL to blend with drawPixel()
+    std::vector<Uint8> span;  // The alpha of each pixel of the row being drawn
+};
+
+// Locks the surface, fills in the draw and copies the text's new glyphs.  Returns false if there is nothing to
+// draw into.
+static bool beginSurfaceDraw(SurfaceDraw* draw, NFont_FontData* data, SDL_Surface* dest, const NFont::Effect& effect, const char* text, const char* end)
+{
+    if(dest == NULL || FC_GetNumCacheLevels(data->font) == 0 || effect.scale.x <= 0 || effect.scale.y <= 0)
+        return false;
+    if(SDL_MUSTLOCK(dest) && SDL_LockSurface(dest) < 0)
+        return false;
+
+    if(data->sdf == NULL && data->surface_glyphs == NULL)
+        data->surface_glyphs = new SurfaceAtlas;
+
+    draw->data = data;
+    draw->stats = &data->stats;
+    draw->renderer = data->renderer;
+    draw->glyphs = data->surface_glyphs;
+    draw->sdf = data->sdf;
+    draw->dest = dest;
+    draw->clip = dest->clip_rect;
+    draw->color = (effect.use_color? effect.color.to_SDL_Color() : FC_GetDefaultColor(data->font));
+    draw->mapped_color = SDL_MapRGB(dest->format, draw->color.r, draw->color.g, draw->color.b);
+    draw->blend = getSpanBlender(dest->format);
+    draw->span.resize(MAX(1, draw->clip.w));
+    if(draw->sdf == NULL)
+        copySurfaceGlyphs(data->font, draw->renderer, draw->glyphs, text, end);
+    ++data->stats.counts.draw_calls;
+    return true;
+}
+
+static void endSurfaceDraw(SurfaceDraw* draw)
+{
+    if(SDL_MUSTLOCK(draw->dest))
+        SDL_UnlockSurface(draw->dest);
+}
+
+static inline float sampleField(const Uint8* field, int w, int h, float u, float v)
+{
+    u = MAX(0.0f, MIN(float(w - 1), u));
+    v = MAX(0.0f, MIN(float(h - 1), v));
+    int x = int(u);
+    int y = int(v);
+    int x2 = MIN(x + 1, w - 1);
+    int y2 = MIN(y + 1, h - 1);
+    float fx = u - x;
+    float fy = v - y;
+    float top = field[y*w + x] + (field[y*w + x2] - field[y*w + x])*fx;
+    float bottom = field[y2*w + x] + (field[y2*w + x2] - field[y2*w + x])*fx;
+    return top + (bottom - top)*fy;
+}
+
+// The pixels of the clip rect that a glyph of w x h drawn at (x, y) covers
+static inline void getGlyphSpan(const SDL_Rect& clip, float x, float y, float w, float h, int* left, int* top, int* right, int* bottom)
+{
+    *left = MAX(int(floorf(x)), clip.x);
+    *right = MIN(int(ceilf(x + w)), clip.x + clip.w);
+    *top = MAX(int(floorf(y)), clip.y);
+    *bottom = MIN(int(ceilf(y + h)), clip.y + clip.h);
+}
+
+// Blends the draw's color into a row of pixels, with the alpha of each in span.  The row is clipped already.
+static void blendRow(const SurfaceDraw& draw, int x, int y, int n)
+{
+    const Uint8* alpha = &draw.span[0];
+    if(draw.blend != NULL)
+    {
+        SDL_Surface* dest = draw.dest;
+        draw.blend((Uint8*)dest->pixels + y*dest->pitch + x*dest->format->BytesPerPixel, alpha, n, draw.mapped_color);
+        return;
+    }
+
+    for(int i = 0; i < n; ++i)
+    {
+        if(alpha[i] != 0)
+            drawPixel(draw.dest, Sint16(x + i), Sint16(y), draw.mapped_color, alpha[i]);
+    }
+}
+
+// Blends a distance field glyph, reading the field at each covered pixel's center.  The outline is
+// antialiased over one pixel at any scale.
+static NFont::Rectf compositeSDFGlyph(SurfaceDraw& draw, const SDFGlyph& glyph, float x, float y, float scale_x, float scale_y)
+{
+    const Uint8* field = &draw.sdf->fields[glyph.offset];
+    int left, top, right, bottom;
+    getGlyphSpan(draw.clip, x, y, glyph.w*scale_x, glyph.h*scale_y, &left, &top, &right, &bottom);
+
+    // Field steps per screen pixel, centered on the outline
+    float coverageStep = draw.sdf->spread*(scale_x + scale_y)/2.0f/127.0f;
+    for(int py = top; py < bottom && left < right; ++py)
+    {
+        float v = (py + 0.5f - y)/scale_y - 0.5f;
+        if(v < -0.5f || v > glyph.h - 0.5f)
+            continue;
+
+        Uint8* alpha = &draw.span[0];
+        for(int px = left; px < right; ++px)
+        {
+            float u = (px + 0.5f - x)/scale_x - 0.5f;
+            float coverage = 0.0f;
+            if(u >= -0.5f && u <= glyph.w - 0.5f)
+                coverage = (sampleField(field, glyph.w, glyph.h, u, v) - 128.0f)*coverageStep + 0.5f;
+            alpha[px - left] = (coverage <= 0.0f? 0 : coverage >= 1.0f? draw.color.a : Uint8(draw.color.a*coverage));
+        }
+        blendRow(draw, left, py, right - left);
+    }
+    return NFont::Rectf(x, y, glyph.w*scale_x, glyph.h*scale_y);
+}
+
+// Blends a glyph copied from the glyph cache, scaled by nearest neighbor and tinted like the cache textures are.
+static NFont::Rectf compositeGlyph(SurfaceDraw& draw, const SurfaceGlyph& glyph, float x, float y, float scale_x, float scale_y)
+{
+    const Uint8* pixels = &draw.glyphs->pixels[glyph.offset];
+    const SDL_Color& color = draw.color;
+    int left, top, right, bottom;
+    getGlyphSpan(draw.clip, x, y, glyph.w*scale_x, glyph.h*scale_y, &left, &top, &right, &bottom);
+
+    for(int py = top; py < bottom && left < right; ++py)
+    {
+        float v = (py + 0.5f - y)/scale_y;
+        if(v < 0.0f || v >= glyph.h)
+            continue;
+
+        Uint8* alpha = &draw.span[0];
+        if(glyph.bytes_per_pixel == 1)
+        {
+            const Uint8* row = pixels + int(v)*glyph.w;
+            for(int px = left; px < right; ++px)
+            {
+                float u = (px + 0.5f - x)/scale_x;
+                alpha[px - left] = (u < 0.0f || u >= glyph.w? 0 : Uint8(row[int(u)]*color.a/255));
+            }
+            blendRow(draw, left, py, right - left);
+            continue;
+        }
+
+        const Uint8* row = pixels + int(v)*glyph.w*4;
+        bool tinted = false;
+        for(int px = left; px < right; ++px)
+        {
+            float u = (px + 0.5f - x)/scale_x;
+            alpha[px - left] = 0;
+            if(u < 0.0f || u >= glyph.w)
+                continue;
+
+            // SDL_FontCache renders its glyphs white, so only bitmap fonts have pixels of their own color
+            const Uint8* p = row + int(u)*4;
+            if(p[0] == 255 && p[1] == 255 && p[2] == 255)
+                alpha[px - left] = Uint8(p[3]*color.a/255);
+            else
+                tinted = true;
+        }
+        blendRow(draw, left, py, right - left);
+
+        for(int px = left; tinted && px < right; ++px)
+        {
+            float u = (px + 0.5f - x)/scale_x;
+            if(u < 0.0f || u >= glyph.w)
+                continue;
+
+            const Uint8* p = row + int(u)*4;
+            Uint8 a = Uint8(p[3]*color.a/255);
+            if(a == 0 || (p[0] == 255 && p[1] == 255 && p[2] == 255))
+                continue;
+            Uint32 c = SDL_MapRGB(draw.dest->format, Uint8(p[0]*color.r/255), Uint8(p[1]*color.g/255), Uint8(p[2]*color.b/255));
+            drawPixel(draw.dest, Sint16(px), Sint16(py), c, a);
+        }
+    }
+    return NFont::Rectf(x, y, glyph.w*scale_x, glyph.h*scale_y);
+}
+
+// Draws one line (no newlines) with its left edge at x, like renderLine().  Returns the dirty rect.
+static NFont::Rectf compositeLine(SurfaceDraw& draw, float x, float y, float scale_x, float scale_y, const char* text, const char* end)
+{
+    FC_Font* font = draw.data->font;
+    NFont::Rectf dirty(x, y, 0, 0);
+    const KerningTable* kerning = getKerning(draw.data);
+    Uint32 previous = 0;
+    float spacing = FC_GetSpacing(font)*scale_x;
+
+    for(const char* c = text; c < end;)
+    {
+        FC_GlyphData glyph;
+        Uint32 codepoint = readCodepoint(c, end);
+        x += getKerningAmount(kerning, previous, codepoint)*scale_x;
+        previous = codepoint;
+        if(!getGlyphData(draw.stats, font, &glyph, codepoint))
+        {
+            codepoint = ' ';
+            if(!FC_GetGlyphData(font, &glyph, codepoint))
+                continue;
+        }
+
+        if(codepoint != ' ')
+        {
+            ++draw.stats->counts.glyphs_submitted;
+            NFont::Rectf r(x, y, 0, 0);
+            if(draw.sdf != NULL)
+            {
+                const SDFGlyph* field = getSDFGlyph(draw.sdf, codepoint);
+                if(field != NULL)
+                    r = compositeSDFGlyph(draw, *field, x, y, scale_x, scale_y);
+            }
+            else
+            {
+                std::map<Uint32, SurfaceGlyph>::const_iterator e = draw.glyphs->glyphs.find(codepoint);
+                if(e != draw.glyphs->glyphs.end() && e->second.w > 0)
+                    r = compositeGlyph(draw, e->second, x, y, scale_x, scale_y);
+            }
+            if(r.w > 0 && r.h > 0)
+                dirty = ((dirty.w == 0 || dirty.h == 0)? r : rectUnion(dirty, r));
+        }
+        x += glyph.rect.w*scale_x + spacing;
+    }
+    return dirty;
+}
+
+static NFont::Rectf compositeAlignedLine(SurfaceDraw& draw, float x, float y, NFont::AlignEnum align, float scale_x, float scale_y, const char* text, const char* end)
+{
+    if(align == NFont::CENTER)
+        x -= measureWidth(draw.data, text, end)*scale_x/2.0f;
+    else if(align == NFont::RIGHT)
+        x -= measureWidth(draw.data, text, end)*scale_x;
+    return compositeLine(draw, x, y, scale_x, scale_y, text, end);
+}
+
+// Like drawText(), into a surface
+static NFont::Rectf compositeText(SurfaceDraw& draw, float x, float y, const NFont::Effect& effect, const char* text, const char* end)
+{
+    NFont::Rectf result(x, y, 0, 0);
+    float lineAdvance = (getLineHeight(draw.data) + FC_GetLineSpacing(draw.data->font))*effect.scale.y;
+    const char* line = text;
+    while(1)
+    {
+        const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+        if(lineEnd == NULL)
+            lineEnd = end;
+
+        NFont::Rectf r = compositeAlignedLine(draw, x, y, effect.alignment, effect.scale.x, effect.scale.y, line, lineEnd);
+        if(r.w > 0 && r.h > 0)
+            result = ((result.w == 0 || result.h == 0)? r : rectUnion(result, r));
+
+        if(lineEnd == end)
+            break;
+        line = lineEnd + 1;
+        y += lineAdvance;
+    }
+    return result;
+}
+
+// Like drawColumnText(), into a surface
+static NFont::Rectf compositeColumnText(SurfaceDraw& draw, float x, float y, Uint16 width, const NFont::Effect& effect, const char* text, const char* end)
+{
+    FC_Font* font = draw.data->font;
+    int wrapWidth = (effect.scale.x > 0? int(width/effect.scale.x) : width);
+    float lineAdvance = (getLineHeight(draw.data) + FC_GetLineSpacing(font))*effect.scale.y;
+    float lineX = x;
+    if(effect.alignment == NFont::CENTER)
+        lineX += width/2.0f;
+    else if(effect.alignment == NFont::RIGHT)
+        lineX += width;
+
+    int numLines = 0;
+    float lineY = y;
+    const char* c = text;
+    while(1)
+    {
+        const char* next;
+        const char* lineEnd = findLineBreak(draw.data, c, end, wrapWidth, &next);
+        compositeAlignedLine(draw, lineX, lineY, effect.alignment, effect.scale.x, effect.scale.y, c, lineEnd);
+        ++numLines;
+
+        if(lineEnd == end)
+            break;
+        c = next;
+        lineY += lineAdvance;
+    }
+
+    return NFont::Rectf(x, y, width, getLinesHeight(draw.data, numLines)*effect.scale.y);
+}
+
+// The surface versions of drawText(), drawColumnText() and drawBoxText().  The font must be locked.
+static NFont::Rectf drawSurfaceText(NFont_FontData* data, SDL_Surface* dest, float x, float y, const NFont::Effect& effect, const char* text, const char* end)
+{
+    TraceScope trace("NFont draw", data->stats.font_id, end - text);
+    Uint64 submitted = data->stats.counts.glyphs_submitted;
+    SurfaceDraw draw;
+    if(text == NULL || !beginSurfaceDraw(&draw, data, dest, effect, text, end))
+        return NFont::Rectf(x, y, 0, 0);
+
+    NFont::Rectf result = compositeText(draw, x, y, effect, text, end);
+    endSurfaceDraw(&draw);
+    trace.zone.glyphs = Uint32(data->stats.counts.glyphs_submitted - submitted);
+    return result;
+}
+
+static NFont::Rectf drawSurfaceColumnText(NFont_FontData* data, SDL_Surface* dest, float x, float y, Uint16 width, const NFont::Effect& effect, const char* text, const char* end)
+{
+    TraceScope trace("NFont draw", data->stats.font_id, end - text);
+    Uint64 submitted = data->stats.counts.glyphs_submitted;
+    SurfaceDraw draw;
+    if(text == NULL || !beginSurfaceDraw(&draw, data, dest, effect, text, end))
+        return NFont::Rectf(x, y, 0, 0);
+
+    NFont::Rectf result = compositeColumnText(draw, x, y, width, effect, text, end);
+    endSurfaceDraw(&draw);
+    trace.zone.glyphs = Uint32(data->stats.counts.glyphs_submitted - submitted);
+    return result;
+}
+
+static NFont::Rectf drawSurfaceBoxText(NFont_FontData* data, SDL_Surface* dest, const NFont::Rectf& box, const NFont::Effect& effect, const char* text, const char* end)
+{
+    TraceScope trace("NFont draw", data->stats.font_id, end - text);
+    Uint64 submitted = data->stats.counts.glyphs_submitted;
+    SurfaceDraw draw;
+    if(text == NULL || !beginSurfaceDraw(&draw, data, dest, effect, text, end))
+        return NFont::Rectf(box.x, box.y, 0, 0);
+
+    // Clipped to the box inside the surface's own clip rect
+    SDL_Rect boxRect = {int(floorf(box.x)), int(floorf(box.y)), int(MAX(0.0f, ceilf(box.w))), int(MAX(0.0f, ceilf(box.h)))};
+    if(!SDL_IntersectRect(&draw.clip, &boxRect, &draw.clip))
+        draw.clip.w = draw.clip.h = 0;
+
+    compositeColumnText(draw, box.x, box.y, box.w, effect, text, end);
+    endSurfaceDraw(&draw);
+    trace.zone.glyphs = Uint32(data->stats.counts.glyphs_submitted - submitted);
+    return box;
+}
+
+// Hands a texture to SDL_FontCache as a cache level, or takes one back out of it with NULL
+static bool setCacheLevelImage(FC_Font* font, NFont_Target* renderer, int level, NFont_Image* image)
+{
+    #ifdef NFONT_USE_SDL_GPU
+    (void)renderer;
+    return FC_SetGlyphCacheLevel(font, level, image);
+    #else
+    return FC_SetGlyphCacheLevel(font, renderer, level, image);
+    #endif
+}
+
+static void freeImage(NFont_Image* image)
+{
+    #ifdef NFONT_USE_SDL_GPU
+    GPU_FreeImage(image);
+    #else
+    SDL_DestroyTexture(image);
+    #endif
+}
+
+// Empties the glyph cache by loading the TTF again without glyphs, keeping the cache levels that keep says
+// to (all of them go if it is NULL).  SDL_FontCache can not free single glyphs or cache levels, so this is how
+// their textures are given back: the kept textures are taken out of SDL_FontCache before it is emptied and
+// handed back as levels after its new first one, with their glyphs.  Only for fonts that
+// canReloadGlyphCache() says can be, locked on the rendering thread.
+static bool reloadGlyphCache(NFont_FontData* data, const char* loading_string, const std::vector<bool>* keep = NULL)
+{
+    TTF_Font* ttf = data->owned_ttf;
+    if(ttf == NULL)
+        ttf = openTTF(data->source_filename, NULL, 0, data->source_size, data->source_style);
+    if(ttf == NULL)
+        return false;
+
+    // Loading into a scratch font first means that a TTF or renderer that fails leaves this one as it was,
+    // rather than emptied
+    FC_Font* font = data->font;
+    SDL_Color color = FC_GetDefaultColor(font);
+    string loadingString = (loading_string != NULL? string(loading_string) : getDefaultLoadingString());
+    FC_Font* scratch = FC_CreateFont();
+    bool loaded = loadFontWithoutGlyphs(scratch, data->renderer, ttf, color, loadingString);
+    FC_FreeFont(scratch);
+    if(!loaded)
+    {
+        if(ttf != data->owned_ttf)
+            closeTTF(ttf);
+        return false;
+    }
+
+    // Batched quads still point at the old cache levels
+    if(active_batch != NULL)
+        submitBatch(active_batch);
+
+    int numLevels = FC_GetNumCacheLevels(font);
+    std::vector<int> keptLevels;
+    std::vector<NFont_Image*> keptImages;
+    std::vector<Uint32> keptDraws;
+    std::vector<int> keptIndex(numLevels, -1);  // Where each old level goes, or -1
+    for(int i = 0; i < numLevels && keep != NULL; ++i)
+    {
+        NFont_Image* image = FC_GetGlyphCacheLevel(font, i);
+        if(i >= int(keep->size()) || !(*keep)[i] || image == NULL)
+            continue;
+        keptIndex[i] = int(keptLevels.size());
+        keptLevels.push_back(i);
+        keptImages.push_back(image);
+        keptDraws.push_back(i < int(data->level_draws.size())? data->level_draws[i] : data->draw_clock);
+    }
+
+    std::vector<Uint32> codepoints;
+    std::vector<FC_GlyphData> glyphs;
+    if(!keptImages.empty())
+    {
+        std::vector<Uint32> cached;
+        getCachedCodepoints(font, cached);
+        for(size_t i = 0; i < cached.size(); ++i)
+        {
+            FC_GlyphData glyph;
+            if(FC_GetGlyphData(font, &glyph, cached[i]) && glyph.cache_level >= 0 && glyph.cache_level < numLevels && keptIndex[glyph.cache_level] >= 0)
+            {
+                codepoints.push_back(cached[i]);
+                glyphs.push_back(glyph);
+            }
+        }
+        for(size_t i = 0; i < keptLevels.size(); ++i)
+            setCacheLevelImage(font, data->renderer, keptLevels[i], NULL);
+    }
+
+    {
+        // SDL_FontCache closes the TTF if it opened it itself
+        FontLock ttf_lock(getTTFMutex());
+        FC_ClearFont(font);
+    }
+    data->owned_ttf = ttf;
+    bool result = loadFontWithoutGlyphs(font, data->renderer, ttf, color, loadingString);
+
+    // The kept levels go after SDL_FontCache's new ones, which it keeps packing its own glyphs into
+    int firstKept = FC_GetNumCacheLevels(font);
+    int numKept = 0;
+    std::vector<Uint32> draws(firstKept, data->draw_clock);
+    for(size_t i = 0; i < keptLevels.size(); ++i)
+    {
+        if(result && setCacheLevelImage(font, data->renderer, firstKept + numKept, keptImages[i]))
+        {
+            keptIndex[keptLevels[i]] = firstKept + numKept++;
+            draws.push_back(keptDraws[i]);
+        }
+        else
+        {
+            freeImage(keptImages[i]);
+            keptIndex[keptLevels[i]] = -1;
+        }
+    }
+    for(size_t i = 0; i < glyphs.size(); ++i)
+    {
+        glyphs[i].cache_level = keptIndex[glyphs[i].cache_level];
+        if(glyphs[i].cache_level >= 0)
+            FC_SetGlyphData(font, codepoints[i], glyphs[i]);
+    }
+
+    GlyphStage* stage = data->stage;
+    if(stage != NULL && stage->level >= 0 && stage->level < numLevels && keptIndex[stage->level] >= 0)
+        stage->level = keptIndex[stage->level];  // Its glyphs stay, so it goes on packing the same texture
+    else
+        resetGlyphStage(stage);
+
+    data->level_draws.swap(draws);
+
+    delete data->surface_glyphs;
+    data->surface_glyphs = NULL;
+    changeGeneration(data);  // Layouts hold cache levels
+    data->stats.seen_stale = true;
+    data->budget_levels = FC_GetNumCacheLevels(font);
+    data->cache_bytes = getCacheTextureBytes(font);
+    data->stats.num_levels = data->budget_levels;
+    return result;
+}
+
+// Orders cache levels by when they were last drawn from, longest ago first
+struct CompareLevelDraws
+{
+    const std::vector<Uint32>* draws;
+
+    bool operator()(int a, int b) const
+    {
+        return ((*draws)[a] != (*draws)[b]? (*draws)[a] < (*draws)[b] : a < b);
+    }
+};
+
+// Evicts the cache levels that went the longest without being drawn from once the glyph cache has grown past
+// the font's budget, down to three quarters of it so the next few draws do not evict again.  Their glyphs are
+// rasterized again when they are drawn.  Fonts that can not be reloaded (bitmap fonts, ones loaded from
+// SDL_RWops or a TTF_Font) keep their cache.  The font must be locked by a draw.
+static void enforceCacheBudget(NFont_FontData* data, const char* loading_string)
+{
+    if(data->cache_budget == 0 || !canReloadGlyphCache(data))
+        return;
+
+    FC_Font* font = data->font;
+    int numLevels = FC_GetNumCacheLevels(font);
+    ++data->draw_clock;
+    // Levels added since the last draw were just drawn from
+    data->level_draws.resize(numLevels, data->draw_clock);
+    if(numLevels != data->budget_levels)
+    {
+        data->budget_levels = numLevels;
+        data->cache_bytes = getCacheTextureBytes(font);
+    }
+    if(data->cache_bytes <= data->cache_budget || numLevels <= 1)
+        return;
+
+    TraceScope trace("NFont evict", data->stats.font_id, data->cache_bytes);
+    std::vector<int> order(numLevels);
+    for(int i = 0; i < numLevels; ++i)
+        order[i] = i;
+    CompareLevelDraws compare = {&data->level_draws};
+    std::sort(order.begin(), order.end(), compare);
+
+    // SDL_FontCache starts a new first level as big as its others, which it packs its own glyphs into
+    Uint64 target = data->cache_budget - data->cache_budget/4;
+    Uint64 bytes = data->cache_bytes + getCacheLevelBytes(font, 0);
+    std::vector<bool> keep(numLevels, true);
+    for(int i = 0; i < numLevels && bytes > target; ++i)
+    {
+        keep[order[i]] = false;
+        bytes -= getCacheLevelBytes(font, order[i]);
+    }
+
+    if(reloadGlyphCache(data, loading_string, &keep))
+        ++data->stats.counts.cache_evictions;
+}
+
+
+
+
+
+
+
+
+
+NFont::Color::Color()
+    : r(0), g(0), b(0), a(255)
+{}
+NFont::Color::Color(Uint8 r, Uint8 g, Uint8 b)
+    : r(r), g(g), b(b), a(255)
+{}
+NFont::Color::Color(Uint8 r, Uint8 g, Uint8 b, Uint8 a)
+    : r(r), g(g), b(b), a(a)
+{}
+NFont::Color::Color(const SDL_Color& color)
+    : r(color.r), g(color.g), b(color.b), a(color.a)
+{}
+
+NFont::Color& NFont::Color::rgb(Uint8 R, Uint8 G, Uint8 B)
+{
+    r = R;
+    g = G;
+    b = B;
+
+    return *this;
+}
+
+NFont::Color& NFont::Color::rgba(Uint8 R, Uint8 G, Uint8 B, Uint8 A)
+{
+    r = R;
+    g = G;
+    b = B;
+    a = A;
+
+    return *this;
+}
+
+NFont::Color& NFont::Color::color(const SDL_Color& color)
+{
+    r = color.r;
+    g = color.g;
+    b = color.b;
+    a = color.a;
+
+    return *this;
+}
+
+SDL_Color NFont::Color::to_SDL_Color() const
+{
+    SDL_Color c = {r, g, b, a};
+    return c;
+}
+
+
+
+
+NFont::Rectf::Rectf()
+    : x(0), y(0), w(0), h(0)
+{}
+
+NFont::Rectf::Rectf(float x, float y)
+    : x(x), y(y), w(0), h(0)
+{}
+
+NFont::Rectf::Rectf(float x, float y, float w, float h)
+    : x(x), y(y), w(w), h(h)
+{}
+
+NFont::Rectf::Rectf(const SDL_Rect& rect)
+    : x(rect.x), y(rect.y), w(rect.w), h(rect.h)
+{}
+
+#ifdef NFONT_USE_SDL_GPU
+NFont::Rectf::Rectf(const GPU_Rect& rect)
+    : x(rect.x), y(rect.y), w(rect.w), h(rect.h)
+{}
+#endif
+
+SDL_Rect NFont::Rectf::to_SDL_Rect() const
+{
+    SDL_Rect r = {int(x), int(y), int(w), int(h)};
+    return r;
+}
+
+#ifdef NFONT_USE_SDL_GPU
+GPU_Rect NFont::Rectf::to_GPU_Rect() const
+{
+    return GPU_MakeRect(x, y, w, h);
+}
+#endif
+
+
+
+
+NFont::Batch::Batch()
+    : data(new NFont_BatchData)
+{
+    data->dest = NULL;
+    data->use_clip = false;
+}
+
+NFont::Batch::~Batch()
+{
+    end();
+    delete data;
+}
+
+void NFont::Batch::begin(NFont_Target* dest)
+{
+    end();
+    if(active_batch != NULL)
+        submitBatch(active_batch);
+
+    data->dest = dest;
+    active_batch = data;
+}
+
+void NFont::Batch::flush()
+{
+    if(data->dest != NULL)
+        submitBatch(data);
+}
+
+void NFont::Batch::end()
+{
+    flush();
+    if(active_batch == data)
+        active_batch = NULL;
+    data->dest = NULL;
+}
+
+bool NFont::Batch::isActive() const
+{
+    return (active_batch == data);
+}
+
+
+
+
+
+
+
+NFont::TextLayout::TextLayout()
+    : data(NULL)
+{}
+
+NFont::TextLayout::TextLayout(NFont& font, const StringView& text, Uint16 width, const Effect& effect)
+    : data(NULL)
+{
+    set(font, text, width, effect);
+}
+
+NFont::TextLayout::TextLayout(const TextLayout& layout)
+    : data(NULL)
+{
+    *this = layout;
+}
+
+NFont::TextLayout::~TextLayout()
+{
+    delete data;
+}
+
+NFont::TextLayout& NFont::TextLayout::operator=(const TextLayout& layout)
+{
+    if(this == &layout)
+        return *this;
+
+    if(layout.data == NULL)
+        clear();
+    else
+    {
+        if(data == NULL)
+            data = new NFont_LayoutData;
+        *data = *layout.data;
+        data->batch.dest = NULL;
+    }
+    return *this;
+}
+
+void NFont::TextLayout::set(NFont& font, const StringView& text, Uint16 width, const Effect& effect)
+{
+    if(data == NULL)
+    {
+        data = new NFont_LayoutData;
+        data->batch.dest = NULL;
+        data->batch.use_clip = false;
+    }
+
+    data->font = &font;
+    data->text.assign(text.text == NULL? "" : text.text, text.text == NULL? 0 : text.length);
+    data->width = width;
+    data->effect = effect;
+    data->valid = false;
+}
+
+void NFont::TextLayout::clear()
+{
+    delete data;
+    data = NULL;
+}
+
+NFont::Rectf NFont::TextLayout::draw(NFont_Target* dest, float x, float y)
+{
+    if(data == NULL)
+        return Rectf(x, y, 0, 0);
+
+    NFont* owner = data->font;
+    Lock lock(owner, true);
+    if(!data->valid || data->generation != owner->getGeneration())
+        stageNewGlyphs(owner->shared, data->text.c_str(), data->text.c_str() + data->text.size());
+    if(!updateLayout(data, owner->shared, owner->getGeneration()))
+        return Rectf(x, y, 0, 0);
+
+    SDL_Color color = (data->effect.use_color? data->effect.color.to_SDL_Color() : FC_GetDefaultColor(owner->font));
+    float scale_x = data->effect.scale.x;
+    float scale_y = data->effect.scale.y;
+
+    // Outside of a batch, the layout's own batch still submits one geometry call per texture.
+    NFont_BatchData* previous = active_batch;
+    bool batched = (active_batch != NULL && active_batch->dest == dest);
+    if(!batched)
+    {
+        data->batch.dest = dest;
+        active_batch = &data->batch;
+    }
+
+    int numGlyphs = int(data->glyphs.size());
+    TraceScope trace("NFont draw", owner->shared->stats.font_id);
+    trace.zone.glyphs = numGlyphs;
+    ++owner->shared->stats.counts.draw_calls;
+    owner->shared->stats.counts.glyphs_submitted += numGlyphs;
+    for(int i = 0; i < numGlyphs; ++i)
+    {
+        const LayoutGlyph& g = data->glyphs[i];
+        touchCacheLevel(owner->shared, g.cache_level);
+        renderGlyph(FC_GetGlyphCacheLevel(owner->font, g.cache_level), g.src, dest, x + g.x, y + g.y, scale_x, scale_y, color);
+    }
+
+    if(!batched)
+    {
+        submitBatch(&data->batch);
+        data->batch.dest = NULL;
+        active_batch = previous;
+    }
+
+    Rectf result = data->bounds;
+    result.x += x;
+    result.y += y;
+    return result;
+}
+
+NFont::Rectf NFont::TextLayout::getBounds(float x, float y)
+{
+    if(data == NULL)
+        return Rectf(x, y, 0, 0);
+
+    Lock lock(data->font);
+    if(!updateLayout(data, data->font->shared, data->font->getGeneration()))
+        return Rectf(x, y, 0, 0);
+
+    Rectf result = data->bounds;
+    result.x += x;
+    result.y += y;
+    return result;
+}
+
+Uint16 NFont::TextLayout::getColumnHeight()
+{
+    return Uint16(getBounds(0, 0).h);
+}
+
+int NFont::TextLayout::getNumLines()
+{
+    if(data == NULL)
+        return 0;
+
+    Lock lock(data->font);
+    if(!updateLayout(data, data->font->shared, data->font->getGeneration()))
+        return 0;
+    return int(data->lines.size());
+}
+
+NFont::Rectf NFont::TextLayout::getCharacterOffset(Uint16 position_index)
+{
+    if(data == NULL)
+        return Rectf(0, 0, 1, 0);
+
+    Lock lock(data->font);
+    if(!updateLayout(data, data->font->shared, data->font->getGeneration()))
+        return Rectf(0, 0, 1, 0);
+
+    // The first line that reaches the position holds the caret, so a wrapped line keeps
+    // the caret at its end while a newline moves it to the next line.
+    std::vector<LayoutLine>::const_iterator e = std::lower_bound(data->lines.begin(), data->lines.end(), int(position_index), compareLineEnds);
+    if(e == data->lines.end())
+        --e;
+
+    int index = MAX(0, MIN(int(position_index), e->end_char) - e->first_char);
+    return Rectf(data->stops[e->first_stop + index], e->y, 1, data->line_height);
+}
+
+Uint16 NFont::TextLayout::getPositionFromOffset(float x, float y)
+{
+    if(data == NULL)
+        return 0;
+
+    Lock lock(data->font);
+    if(!updateLayout(data, data->font->shared, data->font->getGeneration()))
+        return 0;
+
+    int numLines = int(data->lines.size());
+    float lineAdvance = (numLines > 1? data->lines[1].y : 0);
+    int lineNum = (y <= 0 || lineAdvance <= 0? 0 : MIN(int(y/lineAdvance), numLines - 1));
+    const LayoutLine& line = data->lines[lineNum];
+
+    // Nearest caret stop on the line
+    const float* first = &data->stops[line.first_stop];
+    const float* last = first + (line.end_char - line.first_char);
+    const float* stop = std::upper_bound(first, last + 1, x);
+    if(stop > last)
+        stop = last;
+    else if(stop > first && x - stop[-1] < stop[0] - x)
+        --stop;
+
+    return Uint16(line.first_char + (stop - first));
+}
+
+
+
+
+NFont::EditBuffer::EditBuffer()
+    : data(new NFont_EditData)
+{
+    data->font = NULL;
+    data->width = 0;
+    data->length = 0;
+    data->generation = 0;
+    data->valid = false;
+}
+
+NFont::EditBuffer::EditBuffer(NFont& font, Uint16 width, const StringView& text)
+    : data(new NFont_EditData)
+{
+    data->font = &font;
+    data->width = width;
+    data->length = 0;
+    data->generation = 0;
+    data->valid = false;
+    setText(text);
+}
+
+NFont::EditBuffer::~EditBuffer()
+{
+    clearEditLines(data->lines, 0, data->lines.size());
+    delete data;
+}
+
+void NFont::EditBuffer::setFont(NFont& font)
+{
+    data->font = &font;
+    data->valid = false;
+}
+
+void NFont::EditBuffer::setWidth(Uint16 width)
+{
+    data->width = width;
+    data->valid = false;
+}
+
+void NFont::EditBuffer::setText(const StringView& text)
+{
+    data->text.assign(text.text == NULL? "" : text.text, text.text == NULL? 0 : text.length);
+    data->length = countCodepoints(data->text.c_str(), data->text.c_str() + data->text.size());
+    data->valid = false;
+}
+
+void NFont::EditBuffer::insert(Uint32 position, const StringView& text)
+{
+    if(text.text == NULL || text.length == 0)
+        return;
+
+    position = MIN(position, data->length);
+    Uint32 numChars = countCodepoints(text.text, text.text + text.length);
+    if(data->font == NULL)
+    {
+        data->text.insert(getByteOffset(position), text.text, text.length);
+        data->length += numChars;
+        return;
+    }
+
+    Lock lock(data->font);
+    Uint32 offset = getByteOffset(position);
+    data->text.insert(offset, text.text, text.length);
+    data->length += numChars;
+
+    if(isCurrent())
+    {
+        size_t line = findEditLine(data->lines, position);
+        rewrapEditLines(data, data->font->shared, (line > 0? line - 1 : 0), offset, Sint64(text.length), numChars);
+    }
+}
+
+void NFont::EditBuffer::erase(Uint32 position, Uint32 count)
+{
+    position = MIN(position, data->length);
+    count = MIN(count, data->length - position);
+    if(count == 0)
+        return;
+
+    if(data->font == NULL)
+    {
+        Uint32 offset = getByteOffset(position);
+        data->text.erase(offset, getByteOffset(position + count) - offset);
+        data->length -= count;
+        return;
+    }
+
+    Lock lock(data->font);
+    Uint32 offset = getByteOffset(position);
+    Uint32 endOffset = getByteOffset(position + count);
+    data->text.erase(offset, endOffset - offset);
+    data->length -= count;
+
+    if(isCurrent())
+    {
+        size_t line = findEditLine(data->lines, position);
+        rewrapEditLines(data, data->font->shared, (line > 0? line - 1 : 0), endOffset, -Sint64(endOffset - offset), -Sint64(count));
+    }
+}
+
+const char* NFont::EditBuffer::getText() const
+{
+    return data->text.c_str();
+}
+
+Uint32 NFont::EditBuffer::getLength() const
+{
+    return data->length;
+}
+
+int NFont::EditBuffer::getNumLines()
+{
+    if(data->font == NULL)
+        return 0;
+
+    Lock lock(data->font);
+    if(!update())
+        return 0;
+    return int(data->lines.size());
+}
+
+Uint16 NFont::EditBuffer::getColumnHeight()
+{
+    if(data->font == NULL)
+        return 0;
+
+    Lock lock(data->font);
+    if(!update())
+        return 0;
+    return getLinesHeight(data->font->shared, int(data->lines.size()));
+}
+
+NFont::Rectf NFont::EditBuffer::getCharacterOffset(Uint32 position)
+{
+    if(data->font == NULL)
+        return Rectf(0, 0, 1, 0);
+
+    Lock lock(data->font);
+    FC_Font* font = data->font->font;
+    if(!update())
+        return Rectf(0, 0, 1, getLineHeight(data->font->shared));
+
+    // As in TextLayout, the caret stays at the end of a wrapped line but moves past a newline.
+    const std::vector<EditLine*>& lines = data->lines;
+    std::vector<EditLine*>::const_iterator e = std::lower_bound(lines.begin(), lines.end(), position, compareEditLineEnds);
+    if(e == lines.end())
+        --e;
+
+    const EditLine* line = *e;
+    Uint32 index = MIN(position, line->end_char) - MIN(position, line->first_char);
+    float y = float(e - lines.begin())*(getLineHeight(data->font->shared) + FC_GetLineSpacing(font));
+    return Rectf(line->stops[index], y, 1, getLineHeight(data->font->shared));
+}
+
+Uint32 NFont::EditBuffer::getPositionFromOffset(float x, float y)
+{
+    if(data->font == NULL)
+        return 0;
+
+    Lock lock(data->font);
+    FC_Font* font = data->font->font;
+    if(!update())
+        return 0;
+
+    int lineAdvance = getLineHeight(data->font->shared) + FC_GetLineSpacing(font);
+    int numLines = int(data->lines.size());
+    int lineNum = (y <= 0 || lineAdvance <= 0? 0 : MIN(int(y/lineAdvance), numLines - 1));
+    const EditLine* line = data->lines[lineNum];
+
+    // Nearest caret stop on the line
+    const int* first = &line->stops[0];
+    const int* last = first + (line->stops.size() - 1);
+    const int* stop = std::upper_bound(first, last + 1, int(x));
+    if(stop > last)
+        stop = last;
+    else if(stop > first && x - stop[-1] < stop[0] - x)
+        --stop;
+
+    return line->first_char + Uint32(stop - first);
+}
+
+bool NFont::EditBuffer::isCurrent() const
+{
+    return (data->valid && data->generation == data->font->getGeneration());
+}
+
+bool NFont::EditBuffer::update()
+{
+    FC_Font* font = data->font->font;
+    if(FC_GetNumCacheLevels(font) == 0)
+        return false;
+    if(isCurrent())
+        return true;
+
+    clearEditLines(data->lines, 0, data->lines.size());
+    data->lines.clear();
+    rewrapEditLines(data, data->font->shared, 0, 0, 0, 0);
+    data->generation = data->font->getGeneration();
+    data->valid = true;
+    return true;
+}
+
+Uint32 NFont::EditBuffer::getByteOffset(Uint32 position) const
+{
+    if(data->font != NULL && isCurrent())
+        return getEditByteOffset(data, position);
+
+    const char* text = data->text.c_str();
+    const char* end = text + data->text.size();
+    const char* c = text;
+    for(Uint32 i = 0; i < position && c < end; ++i)
+        readCodepoint(c, end);
+    return Uint32(c - text);
+}
+
+
+
+
+// Registry
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::Registry::load(NFont& font, const char* filename_ttf, Uint32 pointSize, const Color& color, int style)
+#else
+bool NFont::Registry::load(NFont& font, NFont_Target* renderer, const char* filename_ttf, Uint32 pointSize, const Color& color, int style)
+#endif
+{
+    if(filename_ttf == NULL)
+        return false;
+
+    #ifdef NFONT_USE_SDL_GPU
+    NFont_Target* renderer = NULL;
+    #endif
+
+    FontLock lock(getRegistryMutex());
+    RegistryKey key = makeRegistryKey(renderer, filename_ttf, NULL, pointSize, color.to_SDL_Color(), style);
+    RegistryMap::iterator e = registry_fonts.find(key);
+    if(e != registry_fonts.end())
+    {
+        font.share(e->second);
+        font.spacing = 0;
+        font.line_spacing = 0;
+        font.default_color = color;
+        font.filter_mode = NEAREST;
+        return true;
+    }
+
+    #ifdef NFONT_USE_SDL_GPU
+    if(!font.load(filename_ttf, pointSize, color, style))
+    #else
+    if(!font.load(renderer, filename_ttf, pointSize, color, style))
+    #endif
+        return false;
+
+    font.shared->registered = true;
+    registry_fonts[key] = font.shared;
+    return true;
+}
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::Registry::load(NFont& font, SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const Color& color, int style)
+#else
+bool NFont::Registry::load(NFont& font, NFont_Target* renderer, SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const Color& color, int style)
+#endif
+{
+    if(file_rwops_ttf == NULL)
+        return false;
+
+    #ifdef NFONT_USE_SDL_GPU
+    NFont_Target* renderer = NULL;
+    #endif
+
+    FontLock lock(getRegistryMutex());
+    RegistryKey key = makeRegistryKey(renderer, NULL, file_rwops_ttf, pointSize, color.to_SDL_Color(), style);
+    RegistryMap::iterator e = registry_fonts.find(key);
+    if(e != registry_fonts.end())
+    {
+        // The font already reads from this RWops, so it stays open whatever own_rwops says
+        font.share(e->second);
+        font.spacing = 0;
+        font.line_spacing = 0;
+        font.default_color = color;
+        font.filter_mode = NEAREST;
+        return true;
+    }
+
+    #ifdef NFONT_USE_SDL_GPU
+    if(!font.load(file_rwops_ttf, own_rwops, pointSize, color, style))
+    #else
+    if(!font.load(renderer, file_rwops_ttf, own_rwops, pointSize, color, style))
+    #endif
+        return false;
+
+    font.shared->registered = true;
+    registry_fonts[key] = font.shared;
+    return true;
+}
+
+int NFont::Registry::getNumFonts()
+{
+    FontLock lock(getRegistryMutex());
+    return int(registry_fonts.size());
+}
+
+Uint64 NFont::Registry::getSavedTextureBytes()
+{
+    FontLock lock(getRegistryMutex());
+    Uint64 saved = 0;
+    for(RegistryMap::iterator e = registry_fonts.begin(); e != registry_fonts.end(); ++e)
+    {
+        NFont_FontData* data = e->second;
+        int handles = SDL_AtomicGet(&data->refcount);
+        if(handles > 1)
+        {
+            FontLock font_lock(data->mutex);
+            saved += (handles - 1)*getCacheTextureBytes(data->font);
+        }
+    }
+    return saved;
+}
+
+
+// Constructors
+NFont::NFont()
+{
+    init();
+}
+
+NFont::NFont(const NFont& font)
+    : shared(NULL), font(NULL), mutex(NULL), measure_cache(NULL), loading_string(NULL)
+{
+    *this = font;
+}
+
+#ifdef NFONT_HAS_MOVE
+NFont::NFont(NFont&& font) noexcept
+    : shared(font.shared), font(font.font), mutex(font.mutex), generation(font.generation),
+      measure_cache(font.measure_cache), loading_string(font.loading_string), spacing(font.spacing),
+      line_spacing(font.line_spacing), default_color(font.default_color), filter_mode(font.filter_mode)
+{
+    font.shared = NULL;
+    font.font = NULL;
+    font.mutex = NULL;
+    font.measure_cache = NULL;
+    font.loading_string = NULL;
+}
+#endif
+
+#ifdef NFONT_USE_SDL_GPU
+NFont::NFont(SDL_Surface* src)
+{
+    init();
+    load(src);
+}
+NFont::NFont(TTF_Font* ttf)
+{
+    init();
+    load(ttf, FC_GetDefaultColor(font));
+}
+NFont::NFont(TTF_Font* ttf, const NFont::Color& color)
+{
+    init();
+    load(ttf, color);
+}
+NFont::NFont(const char* filename_ttf, Uint32 pointSize)
+{
+    init();
+    load(filename_ttf, pointSize);
+}
+NFont::NFont(const char* filename_ttf, Uint32 pointSize, const NFont::Color& color, int style)
+{
+    init();
+    load(filename_ttf, pointSize, color, style);
+}
+NFont::NFont(SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color, int style)
+{
+    init();
+    load(file_rwops_ttf, own_rwops, pointSize, color, style);
+}
+
+#else
+
+NFont::NFont(NFont_Target* renderer, SDL_Surface* src)
+{
+    init();
+    load(renderer, src);
+}
+NFont::NFont(NFont_Target* renderer, TTF_Font* ttf)
+{
+    init();
+    load(renderer, ttf, FC_GetDefaultColor(font));
+}
+NFont::NFont(NFont_Target* renderer, TTF_Font* ttf, const NFont::Color& color)
+{
+    init();
+    load(renderer, ttf, color);
+}
+NFont::NFont(NFont_Target* renderer, const char* filename_ttf, Uint32 pointSize)
+{
+    init();
+    load(renderer, filename_ttf, pointSize);
+}
+NFont::NFont(NFont_Target* renderer, const char* filename_ttf, Uint32 pointSize, const NFont::Color& color, int style)
+{
+    init();
+    load(renderer, filename_ttf, pointSize, color, style);
+}
+NFont::NFont(NFont_Target* renderer, SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color, int style)
+{
+    init();
+    load(renderer, file_rwops_ttf, own_rwops, pointSize, color, style);
+}
+#endif
+
+
+NFont::~NFont()
+{
+    release();
+    delete measure_cache;
+    delete[] loading_string;
+}
+
+
+NFont& NFont::operator=(const NFont& font)
+{
+    if(this == &font)
+        return *this;
+
+    delete[] loading_string;
+    loading_string = copyString(font.loading_string);
+    share(font.shared);
+    spacing = font.spacing;
+    line_spacing = font.line_spacing;
+    default_color = font.default_color;
+    filter_mode = font.filter_mode;
+
+    delete measure_cache;
+    measure_cache = NULL;
+    if(font.measure_cache != NULL)
+        enableMeasureCache(font.measure_cache->max_entries, font.measure_cache->max_bytes);
+    return *this;
+}
+
+#ifdef NFONT_HAS_MOVE
+NFont& NFont::operator=(NFont&& font) noexcept
+{
+    if(this == &font)
+        return *this;
+
+    release();
+    delete measure_cache;
+    delete[] loading_string;
+
+    shared = font.shared;
+    this->font = font.font;
+    mutex = font.mutex;
+    generation = font.generation;
+    measure_cache = font.measure_cache;
+    loading_string = font.loading_string;
+    spacing = font.spacing;
+    line_spacing = font.line_spacing;
+    default_color = font.default_color;
+    filter_mode = font.filter_mode;
+
+    font.shared = NULL;
+    font.font = NULL;
+    font.mutex = NULL;
+    font.measure_cache = NULL;
+    font.loading_string = NULL;
+    return *this;
+}
+#endif
+
+void NFont::init()
+{
+    shared = createFontData();
+    font = shared->font;
+    mutex = shared->mutex;
+    generation = nextGeneration();
+    measure_cache = NULL;
+    loading_string = NULL;
+    saveStyle();
+}
+
+void NFont::share(NFont_FontData* data)
+{
+    if(data != NULL)
+        SDL_AtomicIncRef(&data->refcount);
+    release();
+    if(data != NULL)
+    {
+        shared = data;
+        font = data->font;
+        mutex = data->mutex;
+    }
+    else
+        detach();
+
+    generation = nextGeneration();
+}
+
+void NFont::detach()
+{
+    if(shared != NULL && !shared->registered && SDL_AtomicGet(&shared->refcount) == 1)
+        return;
+
+    Uint64 budget = (shared != NULL? shared->cache_budget : 0);
+    release();
+    shared = createFontData();
+    shared->cache_budget = budget;
+    font = shared->font;
+    mutex = shared->mutex;
+    if(loading_string != NULL)
+        FC_SetLoadingString(font, loading_string);
+}
+
+void NFont::release()
+{
+    if(shared == NULL)
+        return;
+
+    bool last;
+    if(shared->registered)
+    {
+        // The registry only hands out fonts that are still referenced
+        FontLock registry_lock(getRegistryMutex());
+        last = SDL_AtomicDecRef(&shared->refcount);
+        if(last)
+            unregisterFont(shared);
+    }
+    else
+        last = SDL_AtomicDecRef(&shared->refcount);
+
+    if(last)
+    {
+        {
+            FontLock lock(mutex);
+            clear();
+        }
+        freeFontStats(shared);
+        freeGlyphMetrics(&shared->metrics);
+        FC_FreeFont(font);
+        SDL_DestroyMutex(mutex);
+        delete shared;
+    }
+    shared = NULL;
+    font = NULL;
+    mutex = NULL;
+}
+
+Uint32 NFont::getGeneration() const
+{
+    return MAX(generation, shared->generation);
+}
+
+void NFont::applyStyle() const
+{
+    FC_SetSpacing(font, spacing);
+    FC_SetLineSpacing(font, line_spacing);
+    FC_SetDefaultColor(font, default_color.to_SDL_Color());
+    // SDL_gpu refilters every cache level, so only when copies disagree
+    FC_FilterEnum filter = (filter_mode == LINEAR? FC_FILTER_LINEAR : FC_FILTER_NEAREST);
+    if(FC_GetFilterMode(font) != filter)
+        FC_SetFilterMode(font, filter);
+}
+
+void NFont::saveStyle() const
+{
+    spacing = FC_GetSpacing(font);
+    line_spacing = FC_GetLineSpacing(font);
+    default_color = FC_GetDefaultColor(font);
+    filter_mode = (FC_GetFilterMode(font) == FC_FILTER_LINEAR? LINEAR : NEAREST);
+}
+
+void NFont::clear()
+{
+    cancelLoading();
+    {
+        // SDL_FontCache closes the TTFs it opened itself
+        FontLock ttf_lock(getTTFMutex());
+        FC_ClearFont(font);
+    }
+    closeTTF(shared->owned_ttf);
+    shared->owned_ttf = NULL;
+    freeSDFAtlas(shared->sdf);
+    shared->sdf = NULL;
+    delete shared->surface_glyphs;
+    shared->surface_glyphs = NULL;
+    freeGlyphStage(shared->stage);
+    shared->stage = NULL;
+    #ifndef NFONT_USE_SDL_GPU
+    // The glyph cache's textures went with the font
+    if(shared->own_renderer != NULL)
+        SDL_DestroyRenderer(shared->own_renderer);
+    SDL_FreeSurface(shared->own_renderer_target);
+    shared->own_renderer = NULL;
+    shared->own_renderer_target = NULL;
+    #endif
+    shared->renderer = NULL;
+    setBitmapMetrics(shared, NULL);
+    KerningTable().swap(shared->kerning);
+    changeGeneration(shared);
+    shared->stats.seen_stale = true;
+    collectFormatStats(&shared->stats);
+    shared->stats.reset_counts = shared->stats.counts;
+    setSource(NULL, 0, 0);
+}
+
+void NFont::setSource(const char* filename_ttf, Uint32 pointSize, int style)
+{
+    delete[] shared->source_filename;
+    shared->source_filename = copyString(filename_ttf);
+    shared->source_size = pointSize;
+    shared->source_style = style;
+}
+
+
+
+
+
+
+void NFont::setLoadingString(const char* str)
+{
+    Lock lock(this);
+    FC_SetLoadingString(font, str);
+    delete[] loading_string;
+    loading_string = copyString(str);
+}
+
+int NFont::preloadGlyphs(Uint32 first_codepoint, Uint32 last_codepoint, int num_threads)
+{
+    last_codepoint = MIN(last_codepoint, 0x10FFFF);
+    if(num_threads <= 0)
+        num_threads = SDL_GetCPUCount();
+
+    std::vector<Uint32> unicode;
+    std::vector<Uint32> codepoints;
+    string filename;
+    Uint32 pointSize;
+    int style;
+    Uint32 startGeneration;
+    Uint32 fontID;
+    {
+        Lock lock(this);
+        if(FC_GetNumCacheLevels(font) == 0)
+            return 0;
+
+        std::vector<Uint32> cached;
+        getCachedCodepoints(font, cached);
+        for(Uint32 c = first_codepoint; c <= last_codepoint; ++c)
+        {
+            if(c >= 0xD800 && c <= 0xDFFF)
+                continue;
+            Uint32 codepoint = packCodepoint(c);
+            if(!std::binary_search(cached.begin(), cached.end(), codepoint))
+            {
+                unicode.push_back(c);
+                codepoints.push_back(codepoint);
+            }
+        }
+
+        // Without a file to open again, SDL_FontCache renders them here one at a time.
+        if(shared->source_filename == NULL || num_threads == 1)
+        {
+            TraceScope trace("NFont rasterize", shared->stats.font_id);
+            int numLoaded = 0;
+            for(size_t i = 0; i < codepoints.size(); ++i)
+            {
+                FC_GlyphData glyph;
+                if(FC_GetGlyphData(font, &glyph, codepoints[i]))
+                {
+                    countRasterizedGlyph(&shared->stats, font, glyph);
+                    markGlyphSeen(&shared->stats, codepoints[i]);
+                    trace.zone.bytes += Uint64(glyph.rect.w)*glyph.rect.h*4;
+                    ++numLoaded;
+                }
+            }
+            trace.zone.glyphs = numLoaded;
+            return numLoaded;
+        }
+
+        filename = shared->source_filename;
+        pointSize = shared->source_size;
+        style = shared->source_style;
+        startGeneration = getGeneration();
+        fontID = shared->stats.font_id;
+    }
+
+    if(codepoints.empty())
+        return 0;
+
+    // Rendering runs without the font locked, so drawing and measuring can go on meanwhile.
+    std::vector<StagedGlyph> glyphs(codepoints.size());
+    PreloadJob job;
+    job.font_id = fontID;
+    job.filename = filename.c_str();
+    job.pointSize = pointSize;
+    job.style = style;
+    job.unicode = &unicode;
+    job.codepoints = &codepoints;
+    job.glyphs = &glyphs;
+    SDL_AtomicSet(&job.next, 0);
+
+    std::vector<SDL_Thread*> threads;
+    for(int i = 1; i < num_threads; ++i)
+    {
+        SDL_Thread* thread = SDL_CreateThread(preloadWorker, "NFont preload", &job);
+        if(thread != NULL)
+            threads.push_back(thread);
+    }
+    preloadWorker(&job);
+    for(size_t i = 0; i < threads.size(); ++i)
+        SDL_WaitThread(threads[i], NULL);
+
+    int numLoaded = 0;
+    {
+        Lock lock(this);
+        if(getGeneration() == startGeneration)
+        {
+            // Skip anything that was rendered on demand in the meantime
+            std::vector<Uint32> cached;
+            getCachedCodepoints(font, cached);
+            for(size_t i = 0; i < codepoints.size(); ++i)
+            {
+                if(std::binary_search(cached.begin(), cached.end(), codepoints[i]))
+                    glyphs[i].pixels.clear();
+            }
+
+            numLoaded = uploadPreloadedGlyphs(font, &shared->stats, NULL, codepoints, glyphs);
+            shared->stats.counts.glyphs_rasterized += numLoaded;
+        }
+    }
+    return numLoaded;
+}
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::load(SDL_Surface* FontSurface)
+#else
+bool NFont::load(NFont_Target* renderer, SDL_Surface* FontSurface)
+#endif
+{
+    if(FontSurface == NULL)
+        return false;
+
+    #ifdef NFONT_USE_SDL_GPU
+    NFont_Target* renderer = NULL;
+    #endif
+
+    detach();
+    TraceScope trace("NFont load", shared->stats.font_id);
+    Lock lock(this);
+    clear();
+    if(!useRenderer(shared, &renderer) || !loadBitmapFont(shared, renderer, FontSurface))
+    {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::load(const char* filename_fnt)
+#else
+bool NFont::load(NFont_Target* renderer, const char* filename_fnt)
+#endif
+{
+    if(filename_fnt == NULL)
+        return false;
+
+    #ifdef NFONT_USE_SDL_GPU
+    NFont_Target* renderer = NULL;
+    #endif
+
+    size_t size;
+    Uint8* data = readFile(filename_fnt, &size);
+    if(data == NULL)
+        return false;
+
+    BMFontDesc desc;
+    if(!parseBMFont(data, size, &desc))
+    {
+        SDL_free(data);
+        return false;
+    }
+
+    // Page files are relative to the descriptor
+    string dir(filename_fnt);
+    size_t slash = dir.find_last_of("/\\");
+    dir.erase(slash == string::npos? 0 : slash + 1);
+
+    std::vector<SDL_Surface*> pages(desc.pages.size(), (SDL_Surface*)NULL);
+    for(size_t i = 0; i < pages.size(); ++i)
+    {
+        if(desc.pages[i].file != NULL)
+            pages[i] = loadBMFontPage(dir + string(desc.pages[i].file, desc.pages[i].length));
+    }
+
+    bool result;
+    {
+        detach();
+        TraceScope trace("NFont load", shared->stats.font_id);
+        Lock lock(this);
+        clear();
+        result = (useRenderer(shared, &renderer) && loadBMFont(shared, renderer, desc, (pages.empty()? NULL : &pages[0]), int(pages.size())));
+        if(!result)
+            clear();
+    }
+
+    for(size_t i = 0; i < pages.size(); ++i)
+        SDL_FreeSurface(pages[i]);
+    SDL_free(data);
+    return result;
+}
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::load(const char* filename_fnt, SDL_Surface** pages, int num_pages)
+#else
+bool NFont::load(NFont_Target* renderer, const char* filename_fnt, SDL_Surface** pages, int num_pages)
+#endif
+{
+    if(filename_fnt == NULL)
+        return false;
+
+    #ifdef NFONT_USE_SDL_GPU
+    return load(SDL_RWFromFile(filename_fnt, "rb"), 1, pages, num_pages);
+    #else
+    return load(renderer, SDL_RWFromFile(filename_fnt, "rb"), 1, pages, num_pages);
+    #endif
+}
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::load(SDL_RWops* file_rwops_fnt, Uint8 own_rwops, SDL_Surface** pages, int num_pages)
+#else
+bool NFont::load(NFont_Target* renderer, SDL_RWops* file_rwops_fnt, Uint8 own_rwops, SDL_Surface** pages, int num_pages)
+#endif
+{
+    if(file_rwops_fnt == NULL)
+        return false;
+
+    size_t size;
+    void* data = SDL_LoadFile_RW(file_rwops_fnt, &size, own_rwops);
+    if(data == NULL)
+        return false;
+
+    #ifdef NFONT_USE_SDL_GPU
+    bool result = load(data, size, pages, num_pages);
+    #else
+    bool result = load(renderer, data, size, pages, num_pages);
+    #endif
+    SDL_free(data);
+    return result;
+}
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::load(const void* fnt_data, size_t fnt_size, SDL_Surface** pages, int num_pages)
+#else
+bool NFont::load(NFont_Target* renderer, const void* fnt_data, size_t fnt_size, SDL_Surface** pages, int num_pages)
+#endif
+{
+    if(fnt_data == NULL || (pages == NULL && num_pages > 0))
+        return false;
+
+    #ifdef NFONT_USE_SDL_GPU
+    NFont_Target* renderer = NULL;
+    #endif
+
+    BMFontDesc desc;
+    if(!parseBMFont(fnt_data, fnt_size, &desc))
+        return false;
+
+    detach();
+    TraceScope trace("NFont load", shared->stats.font_id);
+    Lock lock(this);
+    clear();
+    if(!useRenderer(shared, &renderer) || !loadBMFont(shared, renderer, desc, pages, num_pages))
+    {
+        clear();
+        return false;
+    }
+    return true;
+}
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::load(TTF_Font* ttf)
+#else
 bool NFont::load(NFont_Target* renderer, TTF_Font* ttf)
 #endif
 {
@@ -531,12 +6698,15 @@ bool NFont::load(NFont_Target* renderer, TTF_Font* ttf, const NFont::Color& colo
     if(ttf == NULL)
         return false;
 
-    #ifndef NFONT_USE_SDL_GPU
-    if(renderer == NULL)
-        return false;
+    detach();
+    TraceScope trace("NFont load", shared->stats.font_id);
+    Lock lock(this);
+    clear();
+    #ifdef NFONT_USE_SDL_GPU
+    NFont_Target* renderer = NULL;
     #endif
-
-    FC_ClearFont(font);
+    if(!useRenderer(shared, &renderer))
+        return false;
     #ifdef NFONT_USE_SDL_GPU
     return FC_LoadFontFromTTF(font, ttf, color.to_SDL_Color());
     #else
@@ -550,46 +6720,379 @@ bool NFont::load(const char* filename_ttf, Uint32 pointSize)
 bool NFont::load(NFont_Target* renderer, const char* filename_ttf, Uint32 pointSize)
 #endif
 {
-    #ifdef NFONT_USE_SDL_GPU
-    return load(filename_ttf, pointSize, Color(0,0,0,255));
-    #else
-    return load(renderer, filename_ttf, pointSize, Color(0,0,0,255));
-    #endif
+    #ifdef NFONT_USE_SDL_GPU
+    return load(filename_ttf, pointSize, Color(0,0,0,255));
+    #else
+    return load(renderer, filename_ttf, pointSize, Color(0,0,0,255));
+    #endif
+}
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::load(const char* filename_ttf, Uint32 pointSize, const NFont::Color& color, int style)
+#else
+bool NFont::load(NFont_Target* renderer, const char* filename_ttf, Uint32 pointSize, const NFont::Color& color, int style)
+#endif
+{
+    detach();
+    TraceScope trace("NFont load", shared->stats.font_id);
+    Lock lock(this);
+    clear();
+    #ifdef NFONT_USE_SDL_GPU
+    NFont_Target* renderer = NULL;
+    #endif
+    if(!useRenderer(shared, &renderer))
+        return false;
+    FontLock ttf_lock(getTTFMutex());
+    #ifdef NFONT_USE_SDL_GPU
+    bool result = FC_LoadFont(font, filename_ttf, pointSize, color.to_SDL_Color(), style);
+    #else
+    bool result = FC_LoadFont(font, renderer, filename_ttf, pointSize, color.to_SDL_Color(), style);
+    #endif
+    if(result)
+        setSource(filename_ttf, pointSize, style);
+    return result;
+}
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::load(SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color, int style)
+#else
+bool NFont::load(NFont_Target* renderer, SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color, int style)
+#endif
+{
+    detach();
+    TraceScope trace("NFont load", shared->stats.font_id);
+    Lock lock(this);
+    clear();
+    #ifdef NFONT_USE_SDL_GPU
+    NFont_Target* renderer = NULL;
+    #endif
+    if(!useRenderer(shared, &renderer))
+    {
+        if(own_rwops)
+            SDL_RWclose(file_rwops_ttf);
+        return false;
+    }
+    FontLock ttf_lock(getTTFMutex());
+    #ifdef NFONT_USE_SDL_GPU
+    return FC_LoadFont_RW(font, file_rwops_ttf, own_rwops, pointSize, color.to_SDL_Color(), style);
+    #else
+    return FC_LoadFont_RW(font, renderer, file_rwops_ttf, own_rwops, pointSize, color.to_SDL_Color(), style);
+    #endif
+}
+
+
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::loadAsync(const char* filename_ttf, Uint32 pointSize, const NFont::Color& color, int style)
+#else
+bool NFont::loadAsync(NFont_Target* renderer, const char* filename_ttf, Uint32 pointSize, const NFont::Color& color, int style)
+#endif
+{
+    if(filename_ttf == NULL)
+        return false;
+
+    NFont_AsyncLoad* load = new NFont_AsyncLoad;
+    #ifndef NFONT_USE_SDL_GPU
+    load->renderer = renderer;
+    #endif
+    load->filename = filename_ttf;
+    load->rwops = NULL;
+    load->own_rwops = 0;
+    load->pointSize = pointSize;
+    load->style = style;
+    load->color = color.to_SDL_Color();
+    return startLoading(load);
+}
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::loadAsync(SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color, int style)
+#else
+bool NFont::loadAsync(NFont_Target* renderer, SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color, int style)
+#endif
+{
+    if(file_rwops_ttf == NULL)
+        return false;
+
+    NFont_AsyncLoad* load = new NFont_AsyncLoad;
+    #ifndef NFONT_USE_SDL_GPU
+    load->renderer = renderer;
+    #endif
+    load->rwops = file_rwops_ttf;
+    load->own_rwops = own_rwops;
+    load->pointSize = pointSize;
+    load->style = style;
+    load->color = color.to_SDL_Color();
+    return startLoading(load);
+}
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::loadCached(const char* filename_ttf, Uint32 pointSize, const char* cache_filename, const NFont::Color& color, int style)
+#else
+bool NFont::loadCached(NFont_Target* renderer, const char* filename_ttf, Uint32 pointSize, const char* cache_filename, const NFont::Color& color, int style)
+#endif
+{
+    if(filename_ttf == NULL || cache_filename == NULL)
+        return false;
+
+    #ifdef NFONT_USE_SDL_GPU
+    NFont_Target* renderer = NULL;
+    #endif
+
+    GlyphCacheHeader key;
+    bool warm = false;
+    size_t size;
+    Uint8* data;
+    if(hashFile(filename_ttf, &key.font_hash) && (data = readFile(cache_filename, &size)) != NULL)
+    {
+        GlyphCacheReader reader = {data, size, 0, true};
+        GlyphCacheHeader header;
+        if(readGlyphCacheHeader(reader, &header) && header.font_hash == key.font_hash && header.pointSize == pointSize
+           && header.style == Uint32(style) && header.color == packColor(color.to_SDL_Color()))
+        {
+            detach();
+            TraceScope trace("NFont load", shared->stats.font_id);
+            Lock lock(this);
+            clear();
+
+            string loadingString = (loading_string != NULL? string(loading_string) : getDefaultLoadingString());
+            TTF_Font* ttf = openTTF(filename_ttf, NULL, 0, pointSize, style);
+            if(ttf != NULL && useRenderer(shared, &renderer) && loadFontWithoutGlyphs(font, renderer, ttf, color.to_SDL_Color(), loadingString))
+            {
+                shared->owned_ttf = ttf;
+                setSource(filename_ttf, pointSize, style);
+
+                // A different SDL_ttf or FreeType could lay the font out differently
+                getGlyphCacheHeader(shared, &key);
+                warm = (key.line_height == header.line_height && key.ascent == header.ascent
+                        && key.descent == header.descent && key.baseline == header.baseline
+                        && readGlyphCache(font, reader));
+                if(!warm)
+                    clear();
+            }
+            else
+                closeTTF(ttf);
+        }
+        SDL_free(data);
+    }
+
+    if(warm)
+        return true;
+
+    #ifdef NFONT_USE_SDL_GPU
+    if(!load(filename_ttf, pointSize, color, style))
+        return false;
+    saveGlyphCache(cache_filename);
+    #else
+    if(!load(renderer, filename_ttf, pointSize, color, style))
+        return false;
+    saveGlyphCache(renderer, cache_filename);
+    #endif
+    return true;
+}
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::saveGlyphCache(const char* cache_filename)
+#else
+bool NFont::saveGlyphCache(NFont_Target* renderer, const char* cache_filename)
+#endif
+{
+    if(cache_filename == NULL)
+        return false;
+
+    #ifdef NFONT_USE_SDL_GPU
+    NFont_Target* renderer = NULL;
+    #endif
+
+    Lock lock(this);
+    if(shared->source_filename == NULL || FC_GetNumCacheLevels(font) == 0)
+        return false;
+    if(renderer == NULL)
+        renderer = shared->renderer;
+
+    GlyphCacheHeader header;
+    if(!hashFile(shared->source_filename, &header.font_hash))
+        return false;
+    header.pointSize = shared->source_size;
+    header.style = shared->source_style;
+    header.color = packColor(FC_GetDefaultColor(font));
+    getGlyphCacheHeader(shared, &header);
+
+    SDL_RWops* rwops = SDL_RWFromFile(cache_filename, "wb");
+    if(rwops == NULL)
+        return false;
+    bool result = writeGlyphCache(font, renderer, rwops, header);
+    SDL_RWclose(rwops);
+    if(!result)
+        remove(cache_filename);
+    return result;
+}
+
+
+#ifdef NFONT_USE_SDL_GPU
+bool NFont::loadSDF(const char* filename_ttf, Uint32 pointSize, const NFont::Color& color, int style)
+#else
+bool NFont::loadSDF(NFont_Target* renderer, const char* filename_ttf, Uint32 pointSize, const NFont::Color& color, int style)
+#endif
+{
+    if(filename_ttf == NULL)
+        return false;
+
+    detach();
+    TraceScope trace("NFont load", shared->stats.font_id);
+    Lock lock(this);
+    clear();
+    #ifdef NFONT_USE_SDL_GPU
+    NFont_Target* renderer = NULL;
+    #endif
+    if(!useRenderer(shared, &renderer))
+        return false;
+    // Renderer draws and measuring use the glyph cache, as the fields are only read on the CPU
+    {
+        FontLock ttf_lock(getTTFMutex());
+        #ifdef NFONT_USE_SDL_GPU
+        bool result = FC_LoadFont(font, filename_ttf, pointSize, color.to_SDL_Color(), style);
+        #else
+        bool result = FC_LoadFont(font, renderer, filename_ttf, pointSize, color.to_SDL_Color(), style);
+        #endif
+        if(!result)
+            return false;
+    }
+    setSource(filename_ttf, pointSize, style);
+
+    // The fields have a TTF of their own, as SDL_FontCache's is not ours to use
+    TTF_Font* ttf = openTTF(filename_ttf, NULL, 0, pointSize, style);
+    if(ttf == NULL)
+    {
+        clear();
+        return false;
+    }
+
+    SDFAtlas* atlas = new SDFAtlas;
+    atlas->ttf = ttf;
+    atlas->spread = MAX(2, int(pointSize/8));
+
+    string loadingString = (loading_string != NULL? string(loading_string) : getDefaultLoadingString());
+    const char* end = loadingString.c_str() + loadingString.size();
+    for(const char* c = loadingString.c_str(); c < end;)
+    {
+        Uint32 codepoint = readCodepoint(c, end);
+        if(codepoint != ' ')
+            getSDFGlyph(atlas, codepoint);
+    }
+
+    shared->sdf = atlas;
+    changeGeneration(shared);
+    return true;
+}
+
+bool NFont::isSDF() const
+{
+    Lock lock(this);
+    return (shared->sdf != NULL);
+}
+
+bool NFont::isLoading() const
+{
+    Lock lock(this);
+    return (shared->async_load != NULL);
+}
+
+bool NFont::poll()
+{
+    Lock lock(this);
+    if(shared->async_load != NULL && SDL_AtomicGet(&shared->async_load->done))
+        finishAsyncLoad();
+    return (shared->async_load == NULL);
+}
+
+bool NFont::finishLoading()
+{
+    Lock lock(this);
+    if(shared->async_load != NULL)
+        finishAsyncLoad();
+    return (FC_GetNumCacheLevels(font) > 0);
 }
 
-#ifdef NFONT_USE_SDL_GPU
-bool NFont::load(const char* filename_ttf, Uint32 pointSize, const NFont::Color& color, int style)
-#else
-bool NFont::load(NFont_Target* renderer, const char* filename_ttf, Uint32 pointSize, const NFont::Color& color, int style)
-#endif
+bool NFont::startLoading(NFont_AsyncLoad* load)
 {
-    FC_ClearFont(font);
-    #ifdef NFONT_USE_SDL_GPU
-    return FC_LoadFont(font, filename_ttf, pointSize, color.to_SDL_Color(), style);
-    #else
-    return FC_LoadFont(font, renderer, filename_ttf, pointSize, color.to_SDL_Color(), style);
-    #endif
+    detach();
+    TraceScope trace("NFont load", shared->stats.font_id);
+    Lock lock(this);
+    clear();
+
+    load->loading_string = (loading_string != NULL? string(loading_string) : getDefaultLoadingString());
+    load->ttf = NULL;
+    load->font_id = shared->stats.font_id;
+    SDL_AtomicSet(&load->done, 0);
+    load->thread = SDL_CreateThread(asyncLoadWorker, "NFont load", load);
+    if(load->thread == NULL)
+    {
+        if(load->rwops != NULL && load->own_rwops)
+            SDL_RWclose(load->rwops);
+        delete load;
+        return false;
+    }
+
+    shared->async_load = load;
+    return true;
 }
 
-#ifdef NFONT_USE_SDL_GPU
-bool NFont::load(SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color, int style)
-#else
-bool NFont::load(NFont_Target* renderer, SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color, int style)
-#endif
+void NFont::finishAsyncLoad()
 {
-    FC_ClearFont(font);
-    #ifdef NFONT_USE_SDL_GPU
-    return FC_LoadFont_RW(font, file_rwops_ttf, own_rwops, pointSize, color.to_SDL_Color(), style);
-    #else
-    return FC_LoadFont_RW(font, renderer, file_rwops_ttf, own_rwops, pointSize, color.to_SDL_Color(), style);
-    #endif
+    TraceScope trace("NFont load", shared->stats.font_id);
+    NFont_AsyncLoad* load = shared->async_load;
+    shared->async_load = NULL;
+    SDL_WaitThread(load->thread, NULL);
+
+    if(load->ttf != NULL)
+    {
+        // The loading string's glyphs are rendered already, so SDL_FontCache only needs to start the cache.
+        #ifdef NFONT_USE_SDL_GPU
+        NFont_Target* renderer = NULL;
+        #else
+        NFont_Target* renderer = load->renderer;
+        #endif
+        string loadingString = (loading_string != NULL? string(loading_string) : getDefaultLoadingString());
+        if(useRenderer(shared, &renderer) && loadFontWithoutGlyphs(font, renderer, load->ttf, load->color, loadingString))
+        {
+            shared->owned_ttf = load->ttf;
+            if(load->rwops == NULL)
+                setSource(load->filename.c_str(), load->pointSize, load->style);
+
+            std::vector<Uint32> cached;
+            getCachedCodepoints(font, cached);
+            for(size_t i = 0; i < load->codepoints.size(); ++i)
+            {
+                if(std::binary_search(cached.begin(), cached.end(), load->codepoints[i]))
+                    load->glyphs[i].pixels.clear();
+            }
+            uploadPreloadedGlyphs(font, NULL, NULL, load->codepoints, load->glyphs);
+        }
+        else
+            closeTTF(load->ttf);
+    }
+    changeGeneration(shared);
+    shared->stats.seen_stale = true;
+    delete load;
 }
 
+void NFont::cancelLoading()
+{
+    if(shared->async_load == NULL)
+        return;
+
+    SDL_WaitThread(shared->async_load->thread, NULL);
+    closeTTF(shared->async_load->ttf);
+    delete shared->async_load;
+    shared->async_load = NULL;
+}
 
 
 void NFont::free()
 {
-    FC_ClearFont(font);
+    detach();
+    Lock lock(this);
+    clear();
 }
 
 
@@ -601,10 +7104,16 @@ NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, const char* forma
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_Draw(font, dest, x, y, "%s", buffer);
+    return draw(dest, x, y, text);
+}
+
+NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawText(shared, dest, x, y, Effect(), text.text, text.text + text.length);
 }
 
 /*static int getIndexPastWidth(const char* text, int width, const int* charWidth)
@@ -651,247 +7160,584 @@ NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, const char* forma
     return result;
 }*/
 
-NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, const char* formatted_text, ...)
+NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(box.x, box.y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return drawBox(dest, box, text);
+}
+
+NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawBoxText(shared, dest, box, Effect(), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, AlignEnum align, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(box.x, box.y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return drawBox(dest, box, align, text);
+}
+
+NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, AlignEnum align, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawBoxText(shared, dest, box, Effect(align), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, const Scale& scale, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(box.x, box.y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return drawBox(dest, box, scale, text);
+}
+
+NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, const Scale& scale, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawBoxText(shared, dest, box, Effect(scale), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, const Color& color, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(box.x, box.y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return drawBox(dest, box, color, text);
+}
+
+NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, const Color& color, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawBoxText(shared, dest, box, Effect(color), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, const Effect& effect, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(box.x, box.y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return drawBox(dest, box, effect, text);
+}
+
+NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, const Effect& effect, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawBoxText(shared, dest, box, effect, text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return drawColumn(dest, x, y, width, text);
+}
+
+NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawColumnText(shared, dest, x, y, width, Effect(), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, AlignEnum align, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return drawColumn(dest, x, y, width, align, text);
+}
+
+NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, AlignEnum align, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawColumnText(shared, dest, x, y, width, Effect(align), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, const Scale& scale, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return drawColumn(dest, x, y, width, scale, text);
+}
+
+NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, const Scale& scale, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawColumnText(shared, dest, x, y, width, Effect(scale), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, const Color& color, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return drawColumn(dest, x, y, width, color, text);
+}
+
+NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, const Color& color, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawColumnText(shared, dest, x, y, width, Effect(color), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, const Effect& effect, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return drawColumn(dest, x, y, width, effect, text);
+}
+
+NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, const Effect& effect, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawColumnText(shared, dest, x, y, width, effect, text.text, text.text + text.length);
+}
+
+
+
+NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, AlignEnum align, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return draw(dest, x, y, align, text);
+}
+
+NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, AlignEnum align, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawText(shared, dest, x, y, Effect(align), text.text, text.text + text.length);
+}
+
+
+NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, const Scale& scale, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return draw(dest, x, y, scale, text);
+}
+
+NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, const Scale& scale, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawText(shared, dest, x, y, Effect(scale), text.text, text.text + text.length);
+}
+
+
+NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, const Color& color, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return draw(dest, x, y, color, text);
+}
+
+NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, const Color& color, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawText(shared, dest, x, y, Effect(color), text.text, text.text + text.length);
+}
+
+
+NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, const Effect& effect, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return draw(dest, x, y, effect, text);
+}
+
+NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, const Effect& effect, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawText(shared, dest, x, y, effect, text.text, text.text + text.length);
+}
+
+
+NFont::Rectf NFont::draw(SDL_Surface* dest, float x, float y, const char* formatted_text, ...)
+{
+    if(formatted_text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    va_list lst;
+    va_start(lst, formatted_text);
+    StringView text = formatText(shared, formatted_text, lst);
+    va_end(lst);
+
+    return draw(dest, x, y, text);
+}
+
+NFont::Rectf NFont::draw(SDL_Surface* dest, float x, float y, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceText(shared, dest, x, y, Effect(), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::draw(SDL_Surface* dest, float x, float y, AlignEnum align, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
-        return Rectf(box.x, box.y, 0, 0);
+        return Rectf(x, y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    #ifdef NFONT_USE_SDL_GPU
-    return FC_DrawBox(font, dest, box.to_GPU_Rect(), "%s", buffer);
-    #else
-    return FC_DrawBox(font, dest, box.to_SDL_Rect(), "%s", buffer);
-    #endif
+    return draw(dest, x, y, align, text);
 }
 
-static FC_AlignEnum translate_enum_NFont_to_FC(NFont::AlignEnum align)
+NFont::Rectf NFont::draw(SDL_Surface* dest, float x, float y, AlignEnum align, const StringView& text)
 {
-    switch(align)
-    {
-    case NFont::LEFT:
-        return FC_ALIGN_LEFT;
-    case NFont::CENTER:
-        return FC_ALIGN_CENTER;
-    case NFont::RIGHT:
-        return FC_ALIGN_RIGHT;
-    default:
-        return FC_ALIGN_LEFT;
-    }
+    Lock lock(this, text);
+    return drawSurfaceText(shared, dest, x, y, Effect(align), text.text, text.text + text.length);
 }
 
-NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, AlignEnum align, const char* formatted_text, ...)
+NFont::Rectf NFont::draw(SDL_Surface* dest, float x, float y, const Scale& scale, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
-        return Rectf(box.x, box.y, 0, 0);
+        return Rectf(x, y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    #ifdef NFONT_USE_SDL_GPU
-    return FC_DrawBoxAlign(font, dest, box.to_GPU_Rect(), translate_enum_NFont_to_FC(align), "%s", buffer);
-    #else
-    return FC_DrawBoxAlign(font, dest, box.to_SDL_Rect(), translate_enum_NFont_to_FC(align), "%s", buffer);
-    #endif
+    return draw(dest, x, y, scale, text);
 }
 
-NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, const Scale& scale, const char* formatted_text, ...)
+NFont::Rectf NFont::draw(SDL_Surface* dest, float x, float y, const Scale& scale, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceText(shared, dest, x, y, Effect(scale), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::draw(SDL_Surface* dest, float x, float y, const Color& color, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
-        return Rectf(box.x, box.y, 0, 0);
+        return Rectf(x, y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    #ifdef NFONT_USE_SDL_GPU
-    return FC_DrawBoxScale(font, dest, box.to_GPU_Rect(), FC_MakeScale(scale.x, scale.y), "%s", buffer);
-    #else
-    return FC_DrawBoxScale(font, dest, box.to_SDL_Rect(), FC_MakeScale(scale.x, scale.y), "%s", buffer);
-    #endif
+    return draw(dest, x, y, color, text);
 }
 
-NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, const Color& color, const char* formatted_text, ...)
+NFont::Rectf NFont::draw(SDL_Surface* dest, float x, float y, const Color& color, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceText(shared, dest, x, y, Effect(color), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::draw(SDL_Surface* dest, float x, float y, const Effect& effect, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
-        return Rectf(box.x, box.y, 0, 0);
+        return Rectf(x, y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    #ifdef NFONT_USE_SDL_GPU
-    return FC_DrawBoxColor(font, dest, box.to_GPU_Rect(), color.to_SDL_Color(), "%s", buffer);
-    #else
-    return FC_DrawBoxColor(font, dest, box.to_SDL_Rect(), color.to_SDL_Color(), "%s", buffer);
-    #endif
+    return draw(dest, x, y, effect, text);
 }
 
-NFont::Rectf NFont::drawBox(NFont_Target* dest, const Rectf& box, const Effect& effect, const char* formatted_text, ...)
+NFont::Rectf NFont::draw(SDL_Surface* dest, float x, float y, const Effect& effect, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceText(shared, dest, x, y, effect, text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawBox(SDL_Surface* dest, const Rectf& box, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
         return Rectf(box.x, box.y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    #ifdef NFONT_USE_SDL_GPU
-    return FC_DrawBoxEffect(font, dest, box.to_GPU_Rect(), FC_MakeEffect(translate_enum_NFont_to_FC(effect.alignment), FC_MakeScale(effect.scale.x, effect.scale.y), effect.color.to_SDL_Color()), "%s", buffer);
-    #else
-    return FC_DrawBoxEffect(font, dest, box.to_SDL_Rect(), FC_MakeEffect(translate_enum_NFont_to_FC(effect.alignment), FC_MakeScale(effect.scale.x, effect.scale.y), effect.color.to_SDL_Color()), "%s", buffer);
-    #endif
+    return drawBox(dest, box, text);
 }
 
-NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, const char* formatted_text, ...)
+NFont::Rectf NFont::drawBox(SDL_Surface* dest, const Rectf& box, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceBoxText(shared, dest, box, Effect(), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawBox(SDL_Surface* dest, const Rectf& box, AlignEnum align, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
-        return Rectf(x, y, 0, 0);
+        return Rectf(box.x, box.y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_DrawColumn(font, dest, x, y, width, "%s", buffer);
+    return drawBox(dest, box, align, text);
 }
 
-NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, AlignEnum align, const char* formatted_text, ...)
+NFont::Rectf NFont::drawBox(SDL_Surface* dest, const Rectf& box, AlignEnum align, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceBoxText(shared, dest, box, Effect(align), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawBox(SDL_Surface* dest, const Rectf& box, const Scale& scale, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
-        return Rectf(x, y, 0, 0);
+        return Rectf(box.x, box.y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_DrawColumnAlign(font, dest, x, y, width, translate_enum_NFont_to_FC(align), "%s", buffer);
+    return drawBox(dest, box, scale, text);
 }
 
-NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, const Scale& scale, const char* formatted_text, ...)
+NFont::Rectf NFont::drawBox(SDL_Surface* dest, const Rectf& box, const Scale& scale, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceBoxText(shared, dest, box, Effect(scale), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawBox(SDL_Surface* dest, const Rectf& box, const Color& color, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
-        return Rectf(x, y, 0, 0);
+        return Rectf(box.x, box.y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_DrawColumnScale(font, dest, x, y, width, FC_MakeScale(scale.x, scale.y), "%s", buffer);
+    return drawBox(dest, box, color, text);
 }
 
-NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, const Color& color, const char* formatted_text, ...)
+NFont::Rectf NFont::drawBox(SDL_Surface* dest, const Rectf& box, const Color& color, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceBoxText(shared, dest, box, Effect(color), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawBox(SDL_Surface* dest, const Rectf& box, const Effect& effect, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
-        return Rectf(x, y, 0, 0);
+        return Rectf(box.x, box.y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_DrawColumnColor(font, dest, x, y, width, color.to_SDL_Color(), "%s", buffer);
+    return drawBox(dest, box, effect, text);
 }
 
-NFont::Rectf NFont::drawColumn(NFont_Target* dest, float x, float y, Uint16 width, const Effect& effect, const char* formatted_text, ...)
+NFont::Rectf NFont::drawBox(SDL_Surface* dest, const Rectf& box, const Effect& effect, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceBoxText(shared, dest, box, effect, text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
         return Rectf(x, y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    #ifdef NFONT_USE_SDL_GPU
-    return FC_DrawColumnEffect(font, dest, x, y, width, FC_MakeEffect(translate_enum_NFont_to_FC(effect.alignment), FC_MakeScale(effect.scale.x, effect.scale.y), effect.color.to_SDL_Color()), "%s", buffer);
-    #else
-    return FC_DrawColumnEffect(font, dest, x, y, width, FC_MakeEffect(translate_enum_NFont_to_FC(effect.alignment), FC_MakeScale(effect.scale.x, effect.scale.y), effect.color.to_SDL_Color()), "%s", buffer);
-    #endif
+    return drawColumn(dest, x, y, width, text);
 }
 
+NFont::Rectf NFont::drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceColumnText(shared, dest, x, y, width, Effect(), text.text, text.text + text.length);
+}
 
-
-NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, const Scale& scale, const char* formatted_text, ...)
+NFont::Rectf NFont::drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, AlignEnum align, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
         return Rectf(x, y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_DrawScale(font, dest, x, y, FC_MakeScale(scale.x, scale.y), "%s", buffer);
+    return drawColumn(dest, x, y, width, align, text);
 }
 
-NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, AlignEnum align, const char* formatted_text, ...)
+NFont::Rectf NFont::drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, AlignEnum align, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceColumnText(shared, dest, x, y, width, Effect(align), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const Scale& scale, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
         return Rectf(x, y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_DrawAlign(font, dest, x, y, translate_enum_NFont_to_FC(align), "%s", buffer);
+    return drawColumn(dest, x, y, width, scale, text);
 }
 
-NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, const Color& color, const char* formatted_text, ...)
+NFont::Rectf NFont::drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const Scale& scale, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceColumnText(shared, dest, x, y, width, Effect(scale), text.text, text.text + text.length);
+}
+
+NFont::Rectf NFont::drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const Color& color, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
         return Rectf(x, y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_DrawColor(font, dest, x, y, color.to_SDL_Color(), "%s", buffer);
+    return drawColumn(dest, x, y, width, color, text);
 }
 
+NFont::Rectf NFont::drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const Color& color, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceColumnText(shared, dest, x, y, width, Effect(color), text.text, text.text + text.length);
+}
 
-NFont::Rectf NFont::draw(NFont_Target* dest, float x, float y, const Effect& effect, const char* formatted_text, ...)
+NFont::Rectf NFont::drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const Effect& effect, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
         return Rectf(x, y, 0, 0);
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_DrawEffect(font, dest, x, y, FC_MakeEffect(translate_enum_NFont_to_FC(effect.alignment), FC_MakeScale(effect.scale.x, effect.scale.y), effect.color.to_SDL_Color()), "%s", buffer);
+    return drawColumn(dest, x, y, width, effect, text);
+}
+
+NFont::Rectf NFont::drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const Effect& effect, const StringView& text)
+{
+    Lock lock(this, text);
+    return drawSurfaceColumnText(shared, dest, x, y, width, effect, text.text, text.text + text.length);
 }
 
 
 
 
+
 // Getters
 
 
 NFont::FilterEnum NFont::getFilterMode() const
 {
-    FC_FilterEnum f = FC_GetFilterMode(font);
-    if(f == FC_FILTER_LINEAR)
-        return NFont::LINEAR;
-    return NFont::NEAREST;
+    return filter_mode;
 }
 
+// The FC_Font's metrics change when draws evict cache levels, so these read the published copy or lock.
 Uint16 NFont::getHeight() const
 {
-    return FC_GetLineHeight(font);
+    FontLineMetrics line;
+    if(peekLineMetrics(&shared->metrics, &line))
+        return line.height;
+
+    Lock lock(this);
+    return getLineHeight(shared);
 }
 
 Uint16 NFont::getHeight(const char* formatted_text, ...) const
@@ -901,23 +7747,59 @@ Uint16 NFont::getHeight(const char* formatted_text, ...) const
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_GetHeight(font, "%s", buffer);
+    return getHeight(text);
+}
+
+Uint16 NFont::getHeight(const StringView& text) const
+{
+    if(text.text == NULL)
+        return 0;
+
+    int numLines = countLines(text.text, text.text + text.length);
+    Uint16 result;
+    if(peekLinesHeight(&shared->metrics, numLines, line_spacing, &result))
+        return result;
+
+    // Locking applies this copy's line spacing to the shared font, which other threads may be drawing with
+    Lock lock(this);
+    return getLinesHeight(shared, numLines);
 }
 
 Uint16 NFont::getWidth(const char* formatted_text, ...)
 {
-    if (formatted_text == NULL)
+    if(formatted_text == NULL)
         return 0;
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_GetWidth(font, "%s", buffer);
+    return getWidth(text);
+}
+
+Uint16 NFont::getWidth(const StringView& text)
+{
+    if(text.text == NULL)
+        return 0;
+
+    // Copies measure the glyphs they share without locking once any of them measured those
+    Uint16 result;
+    if(measure_cache == NULL && peekWidth(&shared->metrics, text.text, text.text + text.length, &result))
+        return result;
+
+    Lock lock(this);
+    MeasureKey key;
+    Rectf cached;
+    if(findMeasure(measure_cache, getGeneration(), makeMeasureKey(&key, MEASURE_WIDTH, text, 0, Effect()), &cached))
+        return Uint16(cached.w);
+
+    result = measureWidth(&shared->metrics, shared, text.text, text.text + text.length);
+    storeMeasure(measure_cache, key, Rectf(0, 0, result, 0));
+    return result;
 }
 
 
@@ -928,10 +7810,19 @@ NFont::Rectf NFont::getCharacterOffset(Uint16 position_index, int column_width,
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_GetCharacterOffset(font, position_index, column_width, "%s", buffer);
+    return getCharacterOffset(position_index, column_width, text);
+}
+
+NFont::Rectf NFont::getCharacterOffset(Uint16 position_index, int column_width, const StringView& text)
+{
+    if(text.text == NULL)
+        return Rectf(0,0,0,0);
+
+    Lock lock(this);
+    return measureCharacterOffset(shared, position_index, column_width, text.text, text.text + text.length);
 }
 
 // Given an offset (x,y) from the text draw position (the upper-left corner), returns the character position (UTF-8 index)
@@ -942,10 +7833,19 @@ Uint16 NFont::getPositionFromOffset(float x, float y, int column_width, NFont::A
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_GetPositionFromOffset(font, x, y, column_width, translate_enum_NFont_to_FC(align), "%s", buffer);
+    return getPositionFromOffset(x, y, column_width, align, text);
+}
+
+Uint16 NFont::getPositionFromOffset(float x, float y, int column_width, NFont::AlignEnum align, const StringView& text)
+{
+    if(text.text == NULL)
+        return 0;
+
+    Lock lock(this);
+    return measurePositionFromOffset(shared, x, y, column_width, align, text.text, text.text + text.length);
 }
 
 
@@ -956,10 +7856,32 @@ Uint16 NFont::getColumnHeight(Uint16 width, const char* formatted_text, ...)
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_GetColumnHeight(font, width, "%s", buffer);
+    return getColumnHeight(width, text);
+}
+
+Uint16 NFont::getColumnHeight(Uint16 width, const StringView& text)
+{
+    if(text.text == NULL || width == 0)
+        return 0;
+
+    int numLines;
+    Uint16 result;
+    if(measure_cache == NULL && peekWrappedLines(&shared->metrics, text.text, text.text + text.length, width, &numLines)
+       && peekLinesHeight(&shared->metrics, numLines, line_spacing, &result))
+        return result;
+
+    Lock lock(this);
+    MeasureKey key;
+    Rectf cached;
+    if(findMeasure(measure_cache, getGeneration(), makeMeasureKey(&key, MEASURE_COLUMN_HEIGHT, text, width, Effect()), &cached))
+        return Uint16(cached.h);
+
+    result = getLinesHeight(shared, measureWrappedLines(shared, text.text, text.text + text.length, width));
+    storeMeasure(measure_cache, key, Rectf(0, 0, width, result));
+    return result;
 }
 
 int NFont::getWrappedText(char* result, int max_result_size, Uint16 width, const char* formatted_text, ...)
@@ -969,146 +7891,398 @@ int NFont::getWrappedText(char* result, int max_result_size, Uint16 width, const
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_GetWrappedText(font, result, max_result_size, width, "%s", buffer);
+    return getWrappedText(result, max_result_size, width, text);
+}
+
+int NFont::getWrappedText(char* result, int max_result_size, Uint16 width, const StringView& text)
+{
+    if(text.text == NULL || width == 0)
+        return 0;
+
+    Lock lock(this);
+    return writeWrappedText(shared, result, max_result_size, text.text, text.text + text.length, width);
 }
 
 int NFont::getAscent(const char character)
 {
-    return FC_GetAscent(font, "%c", character);
+    return getAscent(StringView(&character, 1));
 }
 
 int NFont::getAscent() const
 {
-    return FC_GetAscent(font, NULL);
+    FontLineMetrics line;
+    if(peekLineMetrics(&shared->metrics, &line))
+        return line.ascent;
+
+    Lock lock(this);
+    return getFontAscent(shared);
 }
 
 int NFont::getAscent(const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
-        return FC_GetAscent(font, NULL);
+        return getAscent();
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_GetAscent(font, "%s", buffer);
+    return getAscent(text);
+}
+
+int NFont::getAscent(const StringView& text)
+{
+    if(text.text == NULL)
+        return getAscent();
+
+    Lock lock(this);
+    return measureAscent(shared, text.text, text.text + text.length);
 }
 
 int NFont::getDescent(const char character)
 {
-    return FC_GetDescent(font, "%c", character);
+    return getDescent(StringView(&character, 1));
 }
 
 int NFont::getDescent() const
 {
-    return FC_GetDescent(font, NULL);
+    FontLineMetrics line;
+    if(peekLineMetrics(&shared->metrics, &line))
+        return line.descent;
+
+    Lock lock(this);
+    return getFontDescent(shared);
 }
 
 int NFont::getDescent(const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
-        return FC_GetDescent(font, NULL);
+        return getDescent();
 
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
 
-    return FC_GetDescent(font, "%s", buffer);
+    return getDescent(text);
+}
+
+int NFont::getDescent(const StringView& text)
+{
+    if(text.text == NULL)
+        return getDescent();
+
+    Lock lock(this);
+    return measureDescent(shared, text.text, text.text + text.length);
 }
 
 int NFont::getSpacing() const
 {
-    return FC_GetSpacing(font);
+    return spacing;
 }
 
 int NFont::getLineSpacing() const
 {
-    return FC_GetLineSpacing(font);
+    return line_spacing;
 }
 
 Uint16 NFont::getBaseline() const
 {
-    return FC_GetBaseline(font);
+    FontLineMetrics line;
+    if(peekLineMetrics(&shared->metrics, &line))
+        return line.baseline;
+
+    Lock lock(this);
+    return getFontBaseline(shared);
 }
 
 NFont::Rectf NFont::getBounds(float x, float y, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
         return Rectf(x, y, 0, 0);
-    
+
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
-    
-    return NFont::Rectf(FC_GetBounds(font, x, y, FC_ALIGN_LEFT, FC_MakeScale(1.0f, 1.0f), "%s", buffer));
+
+    return getBounds(x, y, text);
+}
+
+NFont::Rectf NFont::getBounds(float x, float y, const StringView& text)
+{
+    if(text.text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    return getBounds(x, y, Effect(), text);
 }
 
 NFont::Rectf NFont::getBounds(float x, float y, AlignEnum align, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
         return Rectf(x, y, 0, 0);
-    
+
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
-    
-    return NFont::Rectf(FC_GetBounds(font, x, y, translate_enum_NFont_to_FC(align), FC_MakeScale(1.0f, 1.0f), "%s", buffer));
+
+    return getBounds(x, y, align, text);
+}
+
+NFont::Rectf NFont::getBounds(float x, float y, AlignEnum align, const StringView& text)
+{
+    if(text.text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    return getBounds(x, y, Effect(align), text);
 }
 
 NFont::Rectf NFont::getBounds(float x, float y, const Scale& scale, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
         return Rectf(x, y, 0, 0);
-    
+
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
-    
-    return NFont::Rectf(FC_GetBounds(font, x, y, FC_ALIGN_LEFT, FC_MakeScale(scale.x, scale.y), "%s", buffer));
+
+    return getBounds(x, y, scale, text);
+}
+
+NFont::Rectf NFont::getBounds(float x, float y, const Scale& scale, const StringView& text)
+{
+    if(text.text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    return getBounds(x, y, Effect(scale), text);
 }
 
 NFont::Rectf NFont::getBounds(float x, float y, const Effect& effect, const char* formatted_text, ...)
 {
     if(formatted_text == NULL)
         return Rectf(x, y, 0, 0);
-    
+
     va_list lst;
     va_start(lst, formatted_text);
-    vsnprintf(buffer, NFONT_BUFFER_SIZE, formatted_text, lst);
+    StringView text = formatText(shared, formatted_text, lst);
     va_end(lst);
-    
-    return NFont::Rectf(FC_GetBounds(font, x, y, translate_enum_NFont_to_FC(effect.alignment), FC_MakeScale(effect.scale.x, effect.scale.y), "%s", buffer));
+
+    return getBounds(x, y, effect, text);
+}
+
+NFont::Rectf NFont::getBounds(float x, float y, const Effect& effect, const StringView& text)
+{
+    if(text.text == NULL)
+        return Rectf(x, y, 0, 0);
+
+    const char* end = text.text + text.length;
+    Uint16 width;
+    Uint16 height;
+    if(measure_cache == NULL && peekWidth(&shared->metrics, text.text, end, &width)
+       && peekLinesHeight(&shared->metrics, countLines(text.text, end), line_spacing, &height))
+        return alignBounds(x, y, effect.alignment, width*effect.scale.x, height*effect.scale.y);
+
+    Lock lock(this);
+    MeasureKey key;
+    Rectf result;
+    if(!findMeasure(measure_cache, getGeneration(), makeMeasureKey(&key, MEASURE_BOUNDS, text, 0, effect), &result))
+    {
+        width = measureWidth(&shared->metrics, shared, text.text, end);
+        height = getLinesHeight(shared, countLines(text.text, end));
+        result = alignBounds(0, 0, effect.alignment, width*effect.scale.x, height*effect.scale.y);
+        storeMeasure(measure_cache, key, result);
+    }
+    result.x += x;
+    result.y += y;
+    return result;
 }
 
 Uint16 NFont::getMaxWidth() const
 {
-    return FC_GetMaxWidth(font);
+    FontLineMetrics line;
+    if(peekLineMetrics(&shared->metrics, &line))
+        return line.max_width;
+
+    Lock lock(this);
+    return getFontMaxWidth(shared);
+}
+
+float NFont::getMeasureCacheHitRate() const
+{
+    Lock lock(this);
+    if(measure_cache == NULL || measure_cache->hits + measure_cache->misses == 0)
+        return 0.0f;
+    return measure_cache->hits/float(measure_cache->hits + measure_cache->misses);
 }
 
 NFont::Color NFont::getDefaultColor() const
 {
-    return FC_GetDefaultColor(font);
+    return default_color;
 }
 
     
 int NFont::getNumCacheLevels() const
 {
+    FontLock lock(mutex);
     return FC_GetNumCacheLevels(font);
 }
 
 NFont_Image* NFont::getCacheLevel(int level) const
 {
+    FontLock lock(mutex);
     return FC_GetGlyphCacheLevel(font, level);
 }
 
+Uint64 NFont::getCacheBytes() const
+{
+    FontLock lock(mutex);
+    return getCacheTextureBytes(font);
+}
+
+Uint64 NFont::getDistanceFieldBytes() const
+{
+    FontLock lock(mutex);
+    if(shared->sdf == NULL)
+        return 0;
+    return shared->sdf->fields.size() + shared->sdf->glyphs.size()*sizeof(SDFGlyph);
+}
+
+Uint64 NFont::getCacheBudget() const
+{
+    FontLock lock(mutex);
+    return shared->cache_budget;
+}
+
+NFont::CacheLevelUsage NFont::getCacheLevelUsage(int level) const
+{
+    FontLock lock(mutex);
+    CacheLevelUsage result;
+    if(level < 0 || level >= int(FC_GetNumCacheLevels(font)) || !getImageSize(FC_GetGlyphCacheLevel(font, level), &result.width, &result.height))
+        return result;
+
+    std::vector<Uint32> codepoints;
+    getCachedCodepoints(font, codepoints);
+    int bottom = 0;
+    for(size_t i = 0; i < codepoints.size(); ++i)
+    {
+        FC_GlyphData glyph;
+        if(!FC_GetGlyphData(font, &glyph, codepoints[i]) || glyph.cache_level != level)
+            continue;
+        ++result.glyphs;
+        result.glyph_pixels += Uint64(glyph.rect.w)*Uint64(glyph.rect.h);
+        bottom = MAX(bottom, int(glyph.rect.y + glyph.rect.h));
+    }
+
+    result.extent_pixels = Uint64(result.width)*MIN(bottom, result.height);
+    if(result.width > 0 && result.height > 0)
+        result.occupancy = float(double(result.glyph_pixels)/(double(result.width)*result.height));
+    if(result.extent_pixels > 0)
+        result.fragmentation = float(1.0 - MIN(1.0, double(result.glyph_pixels)/double(result.extent_pixels)));
+    return result;
+}
+
+bool NFont::compactAtlas()
+{
+    Lock lock(this);
+    int numLevels = FC_GetNumCacheLevels(font);
+    if(numLevels == 0 || !canReloadGlyphCache(shared))
+        return false;
+
+    TraceScope trace("NFont compact", shared->stats.font_id, getCacheTextureBytes(font));
+
+    // Cut every glyph out of a copy of its cache level
+    std::vector<SDL_Surface*> levels(numLevels, (SDL_Surface*)NULL);
+    for(int i = 0; i < numLevels; ++i)
+    {
+        levels[i] = readCacheLevel(shared->renderer, FC_GetGlyphCacheLevel(font, i));
+        if(levels[i] == NULL)
+        {
+            for(int j = 0; j < i; ++j)
+                SDL_FreeSurface(levels[j]);
+            return false;
+        }
+    }
+
+    std::vector<Uint32> codepoints;
+    getCachedCodepoints(font, codepoints);
+    std::vector<StagedGlyph> glyphs(codepoints.size());
+    for(size_t i = 0; i < codepoints.size(); ++i)
+    {
+        FC_GlyphData glyph;
+        if(!FC_GetGlyphData(font, &glyph, codepoints[i]) || glyph.cache_level < 0 || glyph.cache_level >= numLevels)
+            continue;
+        SDL_Surface* level = levels[glyph.cache_level];
+        SDL_Rect src = {int(glyph.rect.x), int(glyph.rect.y), int(glyph.rect.w), int(glyph.rect.h)};
+        // Empty ones are rendered again by SDL_FontCache when they are drawn
+        if(src.x >= 0 && src.y >= 0 && src.x + src.w <= level->w && src.y + src.h <= level->h)
+            stageGlyph(level, src, &glyphs[i]);
+    }
+    for(int i = 0; i < numLevels; ++i)
+        SDL_FreeSurface(levels[i]);
+
+    bool result = reloadGlyphCache(shared, loading_string);
+    if(result)
+    {
+        // Keep what SDL_FontCache rendered while loading
+        std::vector<Uint32> cached;
+        getCachedCodepoints(font, cached);
+        for(size_t i = 0; i < codepoints.size(); ++i)
+        {
+            if(std::binary_search(cached.begin(), cached.end(), codepoints[i]))
+                glyphs[i].pixels.clear();
+        }
+        trace.zone.glyphs = uploadPreloadedGlyphs(font, &shared->stats, shared->renderer, codepoints, glyphs);
+        shared->budget_levels = 0;  // Counted again
+    }
+    return result;
+}
+
+NFont::Stats NFont::getStats() const
+{
+    FontLock lock(mutex);
+    collectFormatStats(&shared->stats);
+    return subtractStats(shared->stats.counts, shared->stats.reset_counts);
+}
+
+void NFont::resetStats()
+{
+    FontLock lock(mutex);
+    collectFormatStats(&shared->stats);
+    shared->stats.reset_counts = shared->stats.counts;
+}
+
+NFont::Stats NFont::getTotalStats()
+{
+    FontLock stats_lock(getStatsMutex());
+    return subtractStats(sumStats(), total_reset_counts);
+}
+
+void NFont::resetTotalStats()
+{
+    FontLock stats_lock(getStatsMutex());
+    total_reset_counts = sumStats();
+}
+
+void NFont::setTraceCallbacks(TraceCallback begin, TraceCallback end, void* userdata)
+{
+    if(begin == NULL || end == NULL)
+        begin = end = NULL;
+    trace_begin = begin;
+    trace_end = end;
+    trace_userdata = userdata;
+}
+
+Uint32 NFont::getID() const
+{
+    return shared->stats.font_id;
+}
+
 
 
 
@@ -1117,6 +8291,7 @@ NFont_Image* NFont::getCacheLevel(int level) const
 
 void NFont::setFilterMode(NFont::FilterEnum filter)
 {
+    Lock lock(this);
     if(filter == NFont::LINEAR)
         FC_SetFilterMode(font, FC_FILTER_LINEAR);
     else
@@ -1125,12 +8300,16 @@ void NFont::setFilterMode(NFont::FilterEnum filter)
 
 void NFont::setSpacing(int LetterSpacing)
 {
+    Lock lock(this);
     FC_SetSpacing(font, LetterSpacing);
+    generation = nextGeneration();
 }
 
 void NFont::setLineSpacing(int LineSpacing)
 {
+    Lock lock(this);
     FC_SetLineSpacing(font, LineSpacing);
+    generation = nextGeneration();
 }
 
 void NFont::setBaseline()
@@ -1140,11 +8319,24 @@ void NFont::setBaseline()
 
 void NFont::setBaseline(Uint16 Baseline)
 {
+    // TTF fonts take their baseline from the font itself
+    Lock lock(this);
+    if(shared->bitmap_metrics != NULL)
+    {
+        shared->bitmap_metrics->baseline = Baseline;
+        changeGeneration(shared);
+    }
+}
 
+void NFont::setCacheBudget(Uint64 max_texture_bytes)
+{
+    FontLock lock(mutex);
+    shared->cache_budget = max_texture_bytes;
 }
 
 void NFont::setDefaultColor(const Color& color)
 {
+    Lock lock(this);
     FC_SetDefaultColor(font, color.to_SDL_Color());
 }
 
@@ -1153,6 +8345,42 @@ void NFont::enableTTFOwnership()
 
 }
 
+void NFont::enableMeasureCache(int max_entries, Uint32 max_bytes)
+{
+    Lock lock(this);
+    if(measure_cache == NULL)
+    {
+        measure_cache = new NFont_MeasureCache;
+        measure_cache->generation = getGeneration();
+        measure_cache->bytes = 0;
+        measure_cache->hits = 0;
+        measure_cache->misses = 0;
+    }
+
+    measure_cache->max_entries = MAX(0, max_entries);
+    measure_cache->max_bytes = max_bytes;
+    while(int(measure_cache->index.size()) > measure_cache->max_entries || measure_cache->bytes > measure_cache->max_bytes)
+        eraseMeasureEntry(measure_cache, --measure_cache->entries.end());
+}
+
+void NFont::disableMeasureCache()
+{
+    Lock lock(this);
+    delete measure_cache;
+    measure_cache = NULL;
+}
+
+void NFont::clearMeasureCache()
+{
+    Lock lock(this);
+    if(measure_cache == NULL)
+        return;
+
+    ::clearMeasureCache(measure_cache);
+    measure_cache->hits = 0;
+    measure_cache->misses = 0;
+}
+
 
 
 
@@ -55,12 +55,30 @@ THE SOFTWARE.
 
 #include "stdarg.h"
 
+#if !defined(NFONT_HAS_STRING_VIEW) && ((defined(__cplusplus) && __cplusplus >= 201703L) || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L))
+#define NFONT_HAS_STRING_VIEW
+#endif
+
+#ifdef NFONT_HAS_STRING_VIEW
+#include <string_view>
+#endif
+
+#if !defined(NFONT_HAS_MOVE) && ((defined(__cplusplus) && __cplusplus >= 201103L) || (defined(_MSC_VER) && _MSC_VER >= 1900))
+#define NFONT_HAS_MOVE
+#endif
+
 // Let's pretend this exists...
 #ifndef TTF_STYLE_OUTLINE
     #define TTF_STYLE_OUTLINE	16
 #endif
 
 struct FC_Font;
+struct NFont_BatchData;
+struct NFont_LayoutData;
+struct NFont_EditData;
+struct NFont_MeasureCache;
+struct NFont_AsyncLoad;
+struct NFont_FontData;
 
 typedef struct _TTF_Font TTF_Font;
 
@@ -190,9 +208,228 @@ class NFONT_EXPORT NFont
     };
     
     
+    // Pre-formatted text for the non-variadic overloads, which skip printf-style formatting entirely.
+    // The text does not need to be null-terminated.
+	class NFONT_EXPORT StringView
+    {
+        public:
+        const char* text;
+        size_t length;
+        
+        StringView(const char* text)
+            : text(text), length(text == NULL? 0 : SDL_strlen(text))
+        {}
+        StringView(const char* text, size_t length)
+            : text(text), length(length)
+        {}
+        #ifdef NFONT_HAS_STRING_VIEW
+        StringView(std::string_view text)
+            : text(text.data()), length(text.size())
+        {}
+        #endif
+    };
+    
+    
+    // Records the glyphs of every NFont draw to one target, then submits them with one
+    // geometry call per run of glyphs from a glyph cache texture.  A glyph joins an earlier run
+    // of its texture unless it overlaps glyphs drawn since, so overlapping glyphs keep their
+    // draw order.  Each draw keeps its own color and scale.  Fonts must stay loaded until the
+    // batch is flushed, and the target's clip rect at flush time applies to everything in it.
+	class NFONT_EXPORT Batch
+    {
+        public:
+        
+        Batch();
+        ~Batch();
+        
+        #ifdef NFONT_USE_SDL_GPU
+        void begin(GPU_Target* dest);
+        #else
+        void begin(SDL_Renderer* dest);
+        #endif
+        void flush();
+        void end();
+        
+        bool isActive() const;
+        
+        private:
+        NFont_BatchData* data;
+        
+        Batch(const Batch&);
+        Batch& operator=(const Batch&);
+    };
+    
+    
+    // Text that has been wrapped and positioned once, so it can be drawn and queried every
+    // frame without measuring again.  A width of 0 lays the text out like draw(), aligned
+    // around the origin, while a positive width lays it out like drawColumn().  Positions
+    // are relative to the layout's origin, scale and alignment included.  The layout is
+    // rebuilt by itself after the font is reloaded or its spacing changes, and must not
+    // outlive its font.
+	class NFONT_EXPORT TextLayout
+    {
+        public:
+        
+        TextLayout();
+        TextLayout(NFont& font, const StringView& text, Uint16 width = 0, const Effect& effect = Effect());
+        TextLayout(const TextLayout& layout);
+        ~TextLayout();
+        
+        TextLayout& operator=(const TextLayout& layout);
+        
+        void set(NFont& font, const StringView& text, Uint16 width = 0, const Effect& effect = Effect());
+        void clear();
+        
+        #ifdef NFONT_USE_SDL_GPU
+        Rectf draw(GPU_Target* dest, float x, float y);
+        #else
+        Rectf draw(SDL_Renderer* dest, float x, float y);
+        #endif
+        
+        Rectf getBounds(float x, float y);
+        Uint16 getColumnHeight();
+        int getNumLines();
+        
+        Rectf getCharacterOffset(Uint16 position_index);
+        Uint16 getPositionFromOffset(float x, float y);
+        
+        private:
+        NFont_LayoutData* data;
+    };
+    
+    
+    // Editable text that stays wrapped to a column, for text input.  It keeps an index of
+    // its wrapped lines with the caret positions along each one, so an edit only wraps
+    // from the line before it until the old line breaks line up again, and caret queries
+    // are binary searches.  Positions count characters, newlines included, and offsets
+    // are relative to the upper-left corner of left-aligned, unscaled text.  A width of 0
+    // only breaks lines at newlines.
+	class NFONT_EXPORT EditBuffer
+    {
+        public:
+        
+        EditBuffer();
+        EditBuffer(NFont& font, Uint16 width, const StringView& text = StringView(""));
+        ~EditBuffer();
+        
+        void setFont(NFont& font);
+        void setWidth(Uint16 width);
+        void setText(const StringView& text);
+        
+        void insert(Uint32 position, const StringView& text);
+        void erase(Uint32 position, Uint32 count);
+        
+        const char* getText() const;
+        Uint32 getLength() const;
+        int getNumLines();
+        Uint16 getColumnHeight();
+        
+        Rectf getCharacterOffset(Uint32 position);
+        Uint32 getPositionFromOffset(float x, float y);
+        
+        private:
+        NFont_EditData* data;
+        
+        bool isCurrent() const;
+        bool update();
+        Uint32 getByteOffset(Uint32 position) const;
+        
+        EditBuffer(const EditBuffer&);
+        EditBuffer& operator=(const EditBuffer&);
+    };
+    
+    
+    // Process-wide fonts keyed by file (or RWops), point size, color and style, so widgets that ask for the
+    // same font share one TTF and one glyph cache instead of loading their own.  load() points the given
+    // font at the shared one, loading it on first use.  It is freed along with its last handle.
+    // An RWops is matched by identity and, once shared, is read until that font is freed.
+	class NFONT_EXPORT Registry
+    {
+        public:
+        
+        #ifdef NFONT_USE_SDL_GPU
+        static bool load(NFont& font, const char* filename_ttf, Uint32 pointSize, const Color& color = Color(0,0,0,255), int style = 0);
+        static bool load(NFont& font, SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const Color& color = Color(0,0,0,255), int style = 0);
+        #else
+        static bool load(NFont& font, SDL_Renderer* renderer, const char* filename_ttf, Uint32 pointSize, const Color& color = Color(0,0,0,255), int style = 0);
+        static bool load(NFont& font, SDL_Renderer* renderer, SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const Color& color = Color(0,0,0,255), int style = 0);
+        #endif
+        
+        static int getNumFonts();
+        // Cache texture memory that extra handles would have used loading their own copies, in bytes
+        static Uint64 getSavedTextureBytes();
+        
+        private:
+        Registry();
+    };
+    
+    
+    // Counters of what drawing and measuring cost a font, for finding out why a frame was slow.  Copies of a
+    // font count together, as they share its glyph cache.  Loading is not counted.
+	class NFONT_EXPORT Stats
+    {
+        public:
+        Uint64 draw_calls;  // draw() calls and the like, including TextLayout::draw()
+        Uint64 glyphs_submitted;  // Glyphs handed to the renderer, a Batch or a surface
+        Uint64 cache_hits;  // Glyph cache lookups by draws, getWidth(), getAscent() and getDescent()
+        Uint64 cache_misses;  // Lookups of glyphs that were not cached yet, or that the font does not have
+        Uint64 glyphs_rasterized;  // Misses rendered into the cache, and glyphs added by preloadGlyphs()
+        Uint64 texture_uploads;  // Glyph cache texture updates: a glyph, a draw's new glyphs, or a whole level
+        Uint64 texture_upload_bytes;
+        Uint64 new_cache_levels;  // Cache levels allocated, each one more texture (see getNumCacheLevels())
+        Uint64 cache_evictions;  // Times cache levels were evicted for going over the budget
+        Uint64 bytes_formatted;  // Output of the printf-style overloads
+        Uint64 long_formats;  // Formatted text too long for the default buffer (NFONT_BUFFER_SIZE) to hold
+        Uint64 truncations;  // getWrappedText() results cut off at max_result_size
+        
+        Stats()
+            : draw_calls(0), glyphs_submitted(0), cache_hits(0), cache_misses(0), glyphs_rasterized(0),
+            texture_uploads(0), texture_upload_bytes(0), new_cache_levels(0), cache_evictions(0), bytes_formatted(0),
+            long_formats(0), truncations(0)
+        {}
+    };
+    
+    // A span of work reported to the trace callbacks.  The zones are "NFont load", "NFont rasterize",
+    // "NFont cache level", "NFont texture upload", "NFont evict", "NFont compact", "NFont wrap", "NFont draw"
+    // and "NFont submit" (a Batch or TextLayout sending its geometry).  Zones nest, and glyphs and bytes are
+    // only final when the zone ends.
+	class NFONT_EXPORT TraceZone
+    {
+        public:
+        const char* name;  // A string literal, so it can be kept or compared by address
+        Uint32 font_id;  // getID() of the font, or 0 when the work is not tied to one
+        Uint32 glyphs;  // Glyphs rasterized, drawn or submitted
+        Uint64 bytes;  // Text wrapped or drawn, or pixels rasterized or uploaded
+    };
+    
+    typedef void (*TraceCallback)(const TraceZone& zone, void* userdata);
+    
+    // How full a glyph cache level is, to see what compactAtlas() would save
+	class NFONT_EXPORT CacheLevelUsage
+    {
+        public:
+        int glyphs;
+        int width, height;  // Of the level's texture
+        Uint64 glyph_pixels;  // Covered by glyphs
+        Uint64 extent_pixels;  // The rows down to the bottom of the lowest glyph
+        float occupancy;  // glyph_pixels over the texture's pixels
+        float fragmentation;  // The share of extent_pixels that no glyph covers
+        
+        CacheLevelUsage()
+            : glyphs(0), width(0), height(0), glyph_pixels(0), extent_pixels(0), occupancy(0.0f), fragmentation(0.0f)
+        {}
+    };
+    
+    
     // Constructors
+    // Copies share the glyph cache.  Each keeps its own spacing, line spacing, default color and filter, and
+    // loading into one gives it a font of its own.  A moved-from font can only be assigned, loaded or destroyed.
+    // TextLayouts and EditBuffers keep using the NFont object they were given, not the one it was moved to.
     NFont();
     NFont(const NFont& font);
+    #ifdef NFONT_HAS_MOVE
+    NFont(NFont&& font) noexcept;
+    #endif
     #ifdef NFONT_USE_SDL_GPU
     NFont(SDL_Surface* src);
     NFont(TTF_Font* ttf);
@@ -212,10 +449,15 @@ class NFONT_EXPORT NFont
     ~NFont();
     
     NFont& operator=(const NFont& font);
+    #ifdef NFONT_HAS_MOVE
+    NFont& operator=(NFont&& font) noexcept;
+    #endif
 
     // Loading
     void setLoadingString(const char* str);
     
+    // With SDL_Renderer, a NULL renderer gives the font a software renderer of its own, for drawing into
+    // SDL_Surfaces and measuring without a window.
     #ifdef NFONT_USE_SDL_GPU
     bool load(SDL_Surface* FontSurface);
     bool load(TTF_Font* ttf);
@@ -232,76 +474,250 @@ class NFONT_EXPORT NFont
     bool load(SDL_Renderer* renderer, SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color, int style = 0);
     #endif
     
+    // Loads an AngelCode BMFont descriptor (.fnt, text or binary) and its kerning pairs.  pages holds the page
+    // images in page order and stays owned by the caller.  Given only a filename, the page files it names are
+    // loaded as BMP, or with SDL_image when NFONT_USE_SDL_IMAGE is defined.
+    #ifdef NFONT_USE_SDL_GPU
+    bool load(const char* filename_fnt);
+    bool load(const char* filename_fnt, SDL_Surface** pages, int num_pages);
+    bool load(SDL_RWops* file_rwops_fnt, Uint8 own_rwops, SDL_Surface** pages, int num_pages);
+    bool load(const void* fnt_data, size_t fnt_size, SDL_Surface** pages, int num_pages);
+    #else
+    bool load(SDL_Renderer* renderer, const char* filename_fnt);
+    bool load(SDL_Renderer* renderer, const char* filename_fnt, SDL_Surface** pages, int num_pages);
+    bool load(SDL_Renderer* renderer, SDL_RWops* file_rwops_fnt, Uint8 own_rwops, SDL_Surface** pages, int num_pages);
+    bool load(SDL_Renderer* renderer, const void* fnt_data, size_t fnt_size, SDL_Surface** pages, int num_pages);
+    #endif
+    
+    // Opens the TTF and renders the loading string's glyphs on a background thread.  poll() and finishLoading()
+    // upload them from the render thread once it is done.  Until then, the font draws nothing and measures empty.
+    #ifdef NFONT_USE_SDL_GPU
+    bool loadAsync(const char* filename_ttf, Uint32 pointSize, const NFont::Color& color = NFont::Color(0,0,0,255), int style = 0);
+    bool loadAsync(SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color = NFont::Color(0,0,0,255), int style = 0);
+    #else
+    bool loadAsync(SDL_Renderer* renderer, const char* filename_ttf, Uint32 pointSize, const NFont::Color& color = NFont::Color(0,0,0,255), int style = 0);
+    bool loadAsync(SDL_Renderer* renderer, SDL_RWops* file_rwops_ttf, Uint8 own_rwops, Uint32 pointSize, const NFont::Color& color = NFont::Color(0,0,0,255), int style = 0);
+    #endif
+    bool isLoading() const;
+    bool poll();  // Returns true once no load is pending
+    bool finishLoading();  // Waits for the load.  Returns true if the font is loaded.
+    
+    // Loads like load(), but takes the glyph cache from a file saved for the same TTF contents, size, style and
+    // color, so those glyphs are not rendered again.  Without a matching file, it loads normally and writes one.
+    #ifdef NFONT_USE_SDL_GPU
+    bool loadCached(const char* filename_ttf, Uint32 pointSize, const char* cache_filename, const NFont::Color& color = NFont::Color(0,0,0,255), int style = 0);
+    bool saveGlyphCache(const char* cache_filename);
+    #else
+    bool loadCached(SDL_Renderer* renderer, const char* filename_ttf, Uint32 pointSize, const char* cache_filename, const NFont::Color& color = NFont::Color(0,0,0,255), int style = 0);
+    bool saveGlyphCache(SDL_Renderer* renderer, const char* cache_filename);
+    #endif
+    
+    // A surface-only reference compositor for scaled text, not an atlas mode.  Loads like load(), with the same
+    // glyph cache at pointSize, which measuring and renderer draws keep using, and also keeps the glyphs as
+    // signed distance fields on the CPU.  Only draws into an SDL_Surface read the fields, which stay sharp at
+    // any Scale.  The fields come on top of the glyph cache, so an SDF font takes more memory than a load() at
+    // the same size.  It only saves memory against several load()s at different sizes that are all drawn into
+    // surfaces (see getDistanceFieldBytes() and test/benchmark.cpp).  Use one load() per size for sharp
+    // renderer text.  Glyphs outside the loading string get fields when first drawn into a surface.
+    #ifdef NFONT_USE_SDL_GPU
+    bool loadSDF(const char* filename_ttf, Uint32 pointSize, const NFont::Color& color = NFont::Color(0,0,0,255), int style = 0);
+    #else
+    bool loadSDF(SDL_Renderer* renderer, const char* filename_ttf, Uint32 pointSize, const NFont::Color& color = NFont::Color(0,0,0,255), int style = 0);
+    #endif
+    bool isSDF() const;
+    
+    // Renders and caches the glyphs for a range of Unicode values, skipping those the font does not provide.
+    // Fonts loaded from a file are rendered by num_threads threads (0 for one per CPU) with their own copies
+    // of the TTF, then packed and uploaded here, so call it from the render thread.  Returns the number of
+    // glyphs added.
+    int preloadGlyphs(Uint32 first_codepoint, Uint32 last_codepoint, int num_threads = 0);
+    
     void free();
 
     // Drawing
     #ifdef NFONT_USE_SDL_GPU
     Rectf draw(GPU_Target* dest, float x, float y, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf draw(GPU_Target* dest, float x, float y, const StringView& text);
     Rectf draw(GPU_Target* dest, float x, float y, AlignEnum align, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf draw(GPU_Target* dest, float x, float y, AlignEnum align, const StringView& text);
     Rectf draw(GPU_Target* dest, float x, float y, const Scale& scale, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf draw(GPU_Target* dest, float x, float y, const Scale& scale, const StringView& text);
     Rectf draw(GPU_Target* dest, float x, float y, const Color& color, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf draw(GPU_Target* dest, float x, float y, const Color& color, const StringView& text);
     Rectf draw(GPU_Target* dest, float x, float y, const Effect& effect, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf draw(GPU_Target* dest, float x, float y, const Effect& effect, const StringView& text);
     
     Rectf drawBox(GPU_Target* dest, const Rectf& box, const char* formatted_text, ...) NFONT_FORMAT(4);
+    Rectf drawBox(GPU_Target* dest, const Rectf& box, const StringView& text);
     Rectf drawBox(GPU_Target* dest, const Rectf& box, AlignEnum align, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf drawBox(GPU_Target* dest, const Rectf& box, AlignEnum align, const StringView& text);
     Rectf drawBox(GPU_Target* dest, const Rectf& box, const Scale& scale, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf drawBox(GPU_Target* dest, const Rectf& box, const Scale& scale, const StringView& text);
     Rectf drawBox(GPU_Target* dest, const Rectf& box, const Color& color, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf drawBox(GPU_Target* dest, const Rectf& box, const Color& color, const StringView& text);
     Rectf drawBox(GPU_Target* dest, const Rectf& box, const Effect& effect, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf drawBox(GPU_Target* dest, const Rectf& box, const Effect& effect, const StringView& text);
     
     Rectf drawColumn(GPU_Target* dest, float x, float y, Uint16 width, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf drawColumn(GPU_Target* dest, float x, float y, Uint16 width, const StringView& text);
     Rectf drawColumn(GPU_Target* dest, float x, float y, Uint16 width, AlignEnum align, const char* formatted_text, ...) NFONT_FORMAT(7);
+    Rectf drawColumn(GPU_Target* dest, float x, float y, Uint16 width, AlignEnum align, const StringView& text);
     Rectf drawColumn(GPU_Target* dest, float x, float y, Uint16 width, const Scale& scale, const char* formatted_text, ...) NFONT_FORMAT(7);
+    Rectf drawColumn(GPU_Target* dest, float x, float y, Uint16 width, const Scale& scale, const StringView& text);
     Rectf drawColumn(GPU_Target* dest, float x, float y, Uint16 width, const Color& color, const char* formatted_text, ...) NFONT_FORMAT(7);
+    Rectf drawColumn(GPU_Target* dest, float x, float y, Uint16 width, const Color& color, const StringView& text);
     Rectf drawColumn(GPU_Target* dest, float x, float y, Uint16 width, const Effect& effect, const char* formatted_text, ...) NFONT_FORMAT(7);
+    Rectf drawColumn(GPU_Target* dest, float x, float y, Uint16 width, const Effect& effect, const StringView& text);
     #else
     Rectf draw(SDL_Renderer* dest, float x, float y, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf draw(SDL_Renderer* dest, float x, float y, const StringView& text);
     Rectf draw(SDL_Renderer* dest, float x, float y, AlignEnum align, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf draw(SDL_Renderer* dest, float x, float y, AlignEnum align, const StringView& text);
     Rectf draw(SDL_Renderer* dest, float x, float y, const Scale& scale, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf draw(SDL_Renderer* dest, float x, float y, const Scale& scale, const StringView& text);
     Rectf draw(SDL_Renderer* dest, float x, float y, const Color& color, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf draw(SDL_Renderer* dest, float x, float y, const Color& color, const StringView& text);
     Rectf draw(SDL_Renderer* dest, float x, float y, const Effect& effect, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf draw(SDL_Renderer* dest, float x, float y, const Effect& effect, const StringView& text);
     
     Rectf drawBox(SDL_Renderer* dest, const Rectf& box, const char* formatted_text, ...) NFONT_FORMAT(4);
+    Rectf drawBox(SDL_Renderer* dest, const Rectf& box, const StringView& text);
     Rectf drawBox(SDL_Renderer* dest, const Rectf& box, AlignEnum align, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf drawBox(SDL_Renderer* dest, const Rectf& box, AlignEnum align, const StringView& text);
     Rectf drawBox(SDL_Renderer* dest, const Rectf& box, const Scale& scale, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf drawBox(SDL_Renderer* dest, const Rectf& box, const Scale& scale, const StringView& text);
     Rectf drawBox(SDL_Renderer* dest, const Rectf& box, const Color& color, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf drawBox(SDL_Renderer* dest, const Rectf& box, const Color& color, const StringView& text);
     Rectf drawBox(SDL_Renderer* dest, const Rectf& box, const Effect& effect, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf drawBox(SDL_Renderer* dest, const Rectf& box, const Effect& effect, const StringView& text);
     
     Rectf drawColumn(SDL_Renderer* dest, float x, float y, Uint16 width, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf drawColumn(SDL_Renderer* dest, float x, float y, Uint16 width, const StringView& text);
     Rectf drawColumn(SDL_Renderer* dest, float x, float y, Uint16 width, AlignEnum align, const char* formatted_text, ...) NFONT_FORMAT(7);
+    Rectf drawColumn(SDL_Renderer* dest, float x, float y, Uint16 width, AlignEnum align, const StringView& text);
     Rectf drawColumn(SDL_Renderer* dest, float x, float y, Uint16 width, const Scale& scale, const char* formatted_text, ...) NFONT_FORMAT(7);
+    Rectf drawColumn(SDL_Renderer* dest, float x, float y, Uint16 width, const Scale& scale, const StringView& text);
     Rectf drawColumn(SDL_Renderer* dest, float x, float y, Uint16 width, const Color& color, const char* formatted_text, ...) NFONT_FORMAT(7);
+    Rectf drawColumn(SDL_Renderer* dest, float x, float y, Uint16 width, const Color& color, const StringView& text);
     Rectf drawColumn(SDL_Renderer* dest, float x, float y, Uint16 width, const Effect& effect, const char* formatted_text, ...) NFONT_FORMAT(7);
+    Rectf drawColumn(SDL_Renderer* dest, float x, float y, Uint16 width, const Effect& effect, const StringView& text);
     #endif
     
+    // Blends the text into a surface on the CPU, so no window or GPU is needed.  Glyphs are copied out of the
+    // glyph cache the first time they are drawn here and scaled by nearest neighbor, while loadSDF() fonts read
+    // their distance fields.  A font loaded with a hardware renderer copies glyphs only from render target
+    // textures, so load with a NULL renderer to draw only into surfaces.
+    Rectf draw(SDL_Surface* dest, float x, float y, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf draw(SDL_Surface* dest, float x, float y, const StringView& text);
+    Rectf draw(SDL_Surface* dest, float x, float y, AlignEnum align, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf draw(SDL_Surface* dest, float x, float y, AlignEnum align, const StringView& text);
+    Rectf draw(SDL_Surface* dest, float x, float y, const Scale& scale, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf draw(SDL_Surface* dest, float x, float y, const Scale& scale, const StringView& text);
+    Rectf draw(SDL_Surface* dest, float x, float y, const Color& color, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf draw(SDL_Surface* dest, float x, float y, const Color& color, const StringView& text);
+    Rectf draw(SDL_Surface* dest, float x, float y, const Effect& effect, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf draw(SDL_Surface* dest, float x, float y, const Effect& effect, const StringView& text);
+    
+    Rectf drawBox(SDL_Surface* dest, const Rectf& box, const char* formatted_text, ...) NFONT_FORMAT(4);
+    Rectf drawBox(SDL_Surface* dest, const Rectf& box, const StringView& text);
+    Rectf drawBox(SDL_Surface* dest, const Rectf& box, AlignEnum align, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf drawBox(SDL_Surface* dest, const Rectf& box, AlignEnum align, const StringView& text);
+    Rectf drawBox(SDL_Surface* dest, const Rectf& box, const Scale& scale, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf drawBox(SDL_Surface* dest, const Rectf& box, const Scale& scale, const StringView& text);
+    Rectf drawBox(SDL_Surface* dest, const Rectf& box, const Color& color, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf drawBox(SDL_Surface* dest, const Rectf& box, const Color& color, const StringView& text);
+    Rectf drawBox(SDL_Surface* dest, const Rectf& box, const Effect& effect, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf drawBox(SDL_Surface* dest, const Rectf& box, const Effect& effect, const StringView& text);
+    
+    Rectf drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Rectf drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const StringView& text);
+    Rectf drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, AlignEnum align, const char* formatted_text, ...) NFONT_FORMAT(7);
+    Rectf drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, AlignEnum align, const StringView& text);
+    Rectf drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const Scale& scale, const char* formatted_text, ...) NFONT_FORMAT(7);
+    Rectf drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const Scale& scale, const StringView& text);
+    Rectf drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const Color& color, const char* formatted_text, ...) NFONT_FORMAT(7);
+    Rectf drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const Color& color, const StringView& text);
+    Rectf drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const Effect& effect, const char* formatted_text, ...) NFONT_FORMAT(7);
+    Rectf drawColumn(SDL_Surface* dest, float x, float y, Uint16 width, const Effect& effect, const StringView& text);
+    
     // Getters
+    // getWidth(), getHeight(), getAscent(), getDescent(), getBaseline(), getMaxWidth(), getColumnHeight(), getBounds()
+    // and getWrappedText() may be called from any thread.
+    // Glyphs missing from the loading string are rendered on first use, so preload them (setLoadingString()) before measuring off the render thread.
+    // Copies of a font measure glyphs that any of them measured before without locking the font, unless it has kerning or
+    // the copy has a measure cache.
     FilterEnum getFilterMode() const;
     Uint16 getHeight() const;
     Uint16 getHeight(const char* formatted_text, ...) const NFONT_FORMAT(2);
+    Uint16 getHeight(const StringView& text) const;
     Uint16 getWidth(const char* formatted_text, ...) NFONT_FORMAT(2);
+    Uint16 getWidth(const StringView& text);
     Rectf getCharacterOffset(Uint16 position_index, int column_width, const char* formatted_text, ...) NFONT_FORMAT(4);
+    Rectf getCharacterOffset(Uint16 position_index, int column_width, const StringView& text);
     Uint16 getPositionFromOffset(float x, float y, int column_width, NFont::AlignEnum align, const char* formatted_text, ...) NFONT_FORMAT(6);
+    Uint16 getPositionFromOffset(float x, float y, int column_width, NFont::AlignEnum align, const StringView& text);
     Uint16 getColumnHeight(Uint16 width, const char* formatted_text, ...) NFONT_FORMAT(3);
+    Uint16 getColumnHeight(Uint16 width, const StringView& text);
     int getSpacing() const;
     int getLineSpacing() const;
     Uint16 getBaseline() const;
     int getAscent() const;
     int getAscent(const char character);
     int getAscent(const char* formatted_text, ...) NFONT_FORMAT(2);
+    int getAscent(const StringView& text);
     int getDescent() const;
     int getDescent(const char character);
     int getDescent(const char* formatted_text, ...) NFONT_FORMAT(2);
+    int getDescent(const StringView& text);
     Rectf getBounds(float x, float y, const char* formatted_text, ...) NFONT_FORMAT(4);
+    Rectf getBounds(float x, float y, const StringView& text);
     Rectf getBounds(float x, float y, AlignEnum align, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf getBounds(float x, float y, AlignEnum align, const StringView& text);
     Rectf getBounds(float x, float y, const Scale& scale, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf getBounds(float x, float y, const Scale& scale, const StringView& text);
     Rectf getBounds(float x, float y, const Effect& effect, const char* formatted_text, ...) NFONT_FORMAT(5);
+    Rectf getBounds(float x, float y, const Effect& effect, const StringView& text);
     Uint16 getMaxWidth() const;
+    float getMeasureCacheHitRate() const;
     Color getDefaultColor() const;
     
     int getNumCacheLevels() const;
+    // With SDL_gpu, the levels that NFont packs from white glyphs are GPU_FORMAT_ALPHA images, a quarter of the
+    // memory of RGBA, which NFont draws with a shader of its own that takes the color from the vertices.  They
+    // stay RGBA on renderers without shaders.  SDL_Renderer has no alpha-only texture format it can tint, so
+    // its levels are always RGBA.
     NFont_Image* getCacheLevel(int level) const;
+    // Texture memory of the glyph cache levels
+    Uint64 getCacheBytes() const;
+    // CPU memory of the distance fields of a loadSDF() font, or 0
+    Uint64 getDistanceFieldBytes() const;
+    Uint64 getCacheBudget() const;
+    CacheLevelUsage getCacheLevelUsage(int level) const;
+    
+    // Packs the glyph cache into as few cache levels as it fits in, and frees the rest.  The glyphs are read back
+    // from video memory, so call it on the rendering thread when a hitch will not show, like after a loading
+    // screen.  Only fonts loaded from a TTF file can be compacted.  Frees the textures getCacheLevel() returned.
+    bool compactAtlas();
+    
+    // Counted since the font was loaded or resetStats() was called.  The total adds up every font, freed ones
+    // included, since resetTotalStats().
+    Stats getStats() const;
+    void resetStats();
+    static Stats getTotalStats();
+    static void resetTotalStats();
+    
+    // For profilers like Tracy or Superluminal.  The callbacks are called on the thread doing the work, async
+    // loading and preloadGlyphs() workers included, so they must be thread-safe.  Fonts loaded from a TTF file
+    // render the new glyphs of a draw inside "NFont rasterize" and upload them in one "NFont texture upload"
+    // per cache level; others have SDL_FontCache render and upload each one inside "NFont rasterize".  Set them
+    // while no other thread is using NFont; NULL for either one turns tracing off.
+    static void setTraceCallbacks(TraceCallback begin, TraceCallback end, void* userdata = NULL);
+    // Identifies the font in trace zones.  Copies that share a glyph cache share it.
+    Uint32 getID() const;
     
     // Returns the number of characters copied
     int getWrappedText(char* result, int max_result_size, Uint16 width, const char* formatted_text, ...) NFONT_FORMAT(5);
+    int getWrappedText(char* result, int max_result_size, Uint16 width, const StringView& text);
     
     // Setters
     void setFilterMode(FilterEnum filter);
@@ -311,14 +727,50 @@ class NFONT_EXPORT NFont
     void setBaseline(Uint16 Baseline);
     void setDefaultColor(const Color& color);
     
+    // Caps the texture memory of the glyph cache, for fonts that keep meeting new glyphs, like one showing CJK
+    // chat text.  A draw that finds the cache over budget frees the cache levels that went longest without
+    // being drawn from, down to three quarters of the budget, and their glyphs are rasterized again when they
+    // are drawn.  A budget smaller than what a frame draws still evicts often (see Stats).  Only fonts loaded
+    // from a TTF file are evicted.  Copies share the budget, and loading keeps it.  0 is no limit.  Eviction
+    // frees the textures that getCacheLevel() returned for evicted levels and renumbers the kept ones.
+    void setCacheBudget(Uint64 max_texture_bytes);
+    
     void enableTTFOwnership();
     
+    // Remembers the results of recent getWidth(), getBounds() and getColumnHeight() calls, dropping the least
+    // recently used ones past either budget.  The cache empties itself when the font or its spacing changes.
+    void enableMeasureCache(int max_entries = 256, Uint32 max_bytes = 65536);
+    void disableMeasureCache();
+    void clearMeasureCache();
+    
   private:
+    class Lock;
+    
+    NFont_FontData* shared;  // The glyph cache and its source, shared with copies of this font
+    FC_Font* font;  // shared->font
+    SDL_mutex* mutex;  // shared->mutex, which guards the glyph cache, as it can grow during any lookup
+    Uint32 generation;  // Changes with this copy's spacing.  See getGeneration().
+    NFont_MeasureCache* measure_cache;  // NULL unless enableMeasureCache() was called
+    char* loading_string;  // NULL for SDL_FontCache's default
     
-    static char* buffer;
-    FC_Font* font;
+    // This copy's settings, which Lock swaps into the shared FC_Font
+    mutable int spacing;
+    mutable int line_spacing;
+    mutable Color default_color;
+    mutable FilterEnum filter_mode;
     
     void init();  // Common constructor
+    void share(NFont_FontData* data);  // Points this copy at a shared font, or at an empty one if data is NULL
+    void detach();  // Gives this copy an empty font of its own if it shares one
+    void release();
+    Uint32 getGeneration() const;  // Changes whenever text needs to be laid out again
+    void applyStyle() const;
+    void saveStyle() const;
+    void setSource(const char* filename_ttf, Uint32 pointSize, int style);
+    void clear();  // Unloads the font.  It must be locked.
+    bool startLoading(NFont_AsyncLoad* load);
+    void finishAsyncLoad();
+    void cancelLoading();
 
 };
 
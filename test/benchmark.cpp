@@ -0,0 +1,1207 @@
+// Headless benchmarks for NFont's hot paths.  Runs on SDL's dummy video driver with a software
+// renderer, so it needs no display or GPU, and writes its results as JSON.
+//
+// Usage: benchmark-NFont [--font fonts/FreeSans.ttf] [--sample benchmark_sample.txt] [--time 0.25] [--out results.json]
+//                        [--soak 0]
+// Run it from the test directory, like the demo, or pass the paths.  Returns 4 if the glyphs that draws add
+// to the cache do not come out like SDL_FontCache's own.  --soak 600 also draws random CJK text for ten
+// minutes under a cache budget, best with a CJK font, and returns 5 if the cache outgrew it.  Returns 6 if
+// 1 MB of formatted text gets cut short, allocates on repeated calls or costs more per byte than 16 KB does.
+
+#include "SDL.h"
+
+#include "../NFont/NFont.h"
+#include "../SDL_FontCache/SDL_FontCache.h"
+
+#include <string>
+#include <vector>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef NFONT_USE_SDL_GPU
+#error The benchmarks run on the SDL_Renderer build, as they need its software renderer.  Leave out FC_USE_SDL_GPU.
+#endif
+
+
+struct Corpus
+{
+    std::string name;
+    std::string text;
+};
+
+struct Result
+{
+    std::string name;
+    std::string corpus;
+    size_t bytes;  // Of text handled per call, 0 when it does not apply
+    Uint64 iterations;
+    double ns_per_op;
+    double glyphs_per_op;  // Submitted by ctx.font, from its stats
+};
+
+struct MemoryResult
+{
+    std::string name;
+    Uint64 cache_texture_bytes;
+    Uint64 rgba_bytes;  // What the same levels would take as RGBA
+    Uint64 alpha_bytes;  // With the levels that NFont packed alpha-only, as SDL_gpu keeps them
+    Uint64 distance_field_bytes;  // Kept on the CPU by loadSDF() fonts
+    int cache_levels;
+    float occupancy;  // Of all the levels together, as in NFont::CacheLevelUsage
+    float fragmentation;
+};
+
+// What a benchmark works on.  Each benchmark is a function called until enough time has passed.
+struct Context
+{
+    SDL_Renderer* renderer;
+    SDL_Surface* surface;
+    SDL_Surface* strip;  // An old-style bitmap font
+    NFont* font;
+    FC_Font* cache;  // SDL_FontCache on its own, to compare NFont's glyph metrics against
+    NFont::EditBuffer* edit;
+    const std::string* text;
+    const std::vector<std::string>* strings;  // For the threaded benchmarks
+    std::vector<char> buffer;
+    std::string font_file;
+    std::string cache_file;
+    int num_threads;
+    Uint32 point_size;
+};
+
+typedef void (*BenchFunc)(Context& ctx);
+
+static double min_seconds = 0.25;
+static std::vector<Result> results;
+static std::vector<MemoryResult> memory_results;
+
+
+// Counts C++ allocations, so that the long text check can tell whether a repeated call allocated
+static SDL_atomic_t allocations;
+
+void* operator new(size_t size)
+{
+    SDL_AtomicIncRef(&allocations);
+    void* result = malloc(size > 0? size : 1);
+    if(result == NULL)
+        throw std::bad_alloc();
+    return result;
+}
+
+void operator delete(void* ptr) throw()
+{
+    free(ptr);
+}
+
+
+static double get_seconds(Uint64 ticks)
+{
+    return double(ticks)/SDL_GetPerformanceFrequency();
+}
+
+// Calls the benchmark in rounds that double in size until one takes at least min_seconds, then records
+// the time per call of that round.
+static void measure(const std::string& name, const std::string& corpus, size_t bytes, BenchFunc func, Context& ctx)
+{
+    func(ctx);  // Warm up the glyph cache
+
+    Uint64 iterations = 1;
+    while(1)
+    {
+        Uint64 glyphs = (ctx.font != NULL? ctx.font->getStats().glyphs_submitted : 0);
+        Uint64 start = SDL_GetPerformanceCounter();
+        for(Uint64 i = 0; i < iterations; ++i)
+            func(ctx);
+        double seconds = get_seconds(SDL_GetPerformanceCounter() - start);
+        if(ctx.font != NULL)
+            glyphs = ctx.font->getStats().glyphs_submitted - glyphs;
+
+        if(seconds >= min_seconds || iterations >= (Uint64(1) << 32))
+        {
+            Result result;
+            result.name = name;
+            result.corpus = corpus;
+            result.bytes = bytes;
+            result.iterations = iterations;
+            result.ns_per_op = seconds*1e9/iterations;
+            result.glyphs_per_op = double(glyphs)/iterations;
+            results.push_back(result);
+            if(glyphs > 0)
+                fprintf(stderr, "%-32s %-12s %14.1f ns %12.0f glyphs/s\n", name.c_str(), corpus.c_str(), result.ns_per_op,
+                        result.glyphs_per_op/result.ns_per_op*1e9);
+            else
+                fprintf(stderr, "%-32s %-12s %14.1f ns\n", name.c_str(), corpus.c_str(), result.ns_per_op);
+            return;
+        }
+        iterations *= 2;
+    }
+}
+
+// Adds up the glyph caches and distance fields of the fonts.  Levels from packed_level on are the ones that
+// NFont packed from coverage, which are alpha-only with SDL_gpu.
+static void record_memory(const std::string& name, NFont* const* fonts, int num_fonts, int packed_level = 0x7FFFFFFF)
+{
+    MemoryResult result;
+    result.name = name;
+    result.cache_texture_bytes = 0;
+    result.rgba_bytes = 0;
+    result.alpha_bytes = 0;
+    result.distance_field_bytes = 0;
+    result.cache_levels = 0;
+    Uint64 pixels = 0, glyph_pixels = 0, extent_pixels = 0;
+    for(int i = 0; i < num_fonts; ++i)
+    {
+        NFont& font = *fonts[i];
+        int numLevels = font.getNumCacheLevels();
+        for(int j = 0; j < numLevels; ++j)
+        {
+            NFont::CacheLevelUsage usage = font.getCacheLevelUsage(j);
+            pixels += Uint64(usage.width)*usage.height;
+            glyph_pixels += usage.glyph_pixels;
+            extent_pixels += usage.extent_pixels;
+
+            Uint32 format;
+            int w, h;
+            if(SDL_QueryTexture(font.getCacheLevel(j), &format, NULL, &w, &h) == 0)
+            {
+                result.cache_texture_bytes += Uint64(w)*h*SDL_BYTESPERPIXEL(format);
+                result.rgba_bytes += Uint64(w)*h*4;
+                result.alpha_bytes += Uint64(w)*h*(j >= packed_level? 1 : 4);
+            }
+        }
+        result.cache_levels += numLevels;
+        result.distance_field_bytes += font.getDistanceFieldBytes();
+    }
+    result.occupancy = (pixels > 0? float(double(glyph_pixels)/pixels) : 0.0f);
+    result.fragmentation = (extent_pixels > 0? float(double(extent_pixels - glyph_pixels)/extent_pixels) : 0.0f);
+    memory_results.push_back(result);
+    fprintf(stderr, "%-32s %d cache levels, %llu texture bytes (%llu as RGBA, %llu alpha-only), %llu distance field bytes\n",
+            name.c_str(), result.cache_levels, (unsigned long long)result.cache_texture_bytes, (unsigned long long)result.rgba_bytes,
+            (unsigned long long)result.alpha_bytes, (unsigned long long)result.distance_field_bytes);
+    fprintf(stderr, "%-32s %.1f%% occupied, %.1f%% fragmented\n", "", result.occupancy*100, result.fragmentation*100);
+    if(result.alpha_bytes < result.rgba_bytes)
+        fprintf(stderr, "%-32s %-12s %14.2fx\n", "  RGBA over alpha-only", "", double(result.rgba_bytes)/result.alpha_bytes);
+}
+
+static void record_memory(const std::string& name, NFont& font, int packed_level = 0x7FFFFFFF)
+{
+    NFont* fonts[] = {&font};
+    record_memory(name, fonts, 1, packed_level);
+}
+
+
+static std::string read_file(const std::string& filename)
+{
+    std::string result;
+    SDL_RWops* rwops = SDL_RWFromFile(filename.c_str(), "rb");
+    if(rwops == NULL)
+        return result;
+
+    char buffer[4096];
+    size_t n;
+    while((n = SDL_RWread(rwops, buffer, 1, sizeof(buffer))) > 0)
+        result.append(buffer, n);
+    SDL_RWclose(rwops);
+
+    if(result.compare(0, 3, "\xEF\xBB\xBF") == 0)
+        result.erase(0, 3);
+    return result;
+}
+
+// Sorts the sample's lines by script: CJK if any character is from U+2E80 up, Latin if any is past ASCII
+static void split_sample(const std::string& sample, std::vector<std::string>& ascii, std::vector<std::string>& latin, std::vector<std::string>& cjk)
+{
+    size_t start = 0;
+    while(start < sample.size())
+    {
+        size_t end = sample.find_first_of("\r\n", start);
+        if(end == std::string::npos)
+            end = sample.size();
+
+        std::string line = sample.substr(start, end - start);
+        start = sample.find_first_not_of("\r\n", end);
+        if(start == std::string::npos)
+            start = sample.size();
+        if(line.empty())
+            continue;
+
+        bool wide = false, extended = false;
+        for(size_t i = 0; i < line.size(); ++i)
+        {
+            unsigned char c = line[i];
+            if(c >= 0x80)
+                extended = true;
+            // Lead bytes of U+2E80 and beyond
+            if(c == 0xE2 && i + 1 < line.size() && (unsigned char)line[i+1] >= 0xBA)
+                wide = true;
+            if(c >= 0xE3)
+                wide = true;
+        }
+        if(wide)
+            cjk.push_back(line);
+        else if(extended)
+            latin.push_back(line);
+        else
+            ascii.push_back(line);
+    }
+}
+
+// Repeats the lines, one per line of text, to about the given size without splitting a character
+static Corpus make_corpus(const std::string& script, const std::vector<std::string>& lines, size_t size)
+{
+    Corpus result;
+    char name[64];
+    sprintf(name, "%s-%u", script.c_str(), unsigned(size));
+    result.name = name;
+    if(lines.empty())
+        return result;
+
+    for(size_t i = 0; result.text.size() < size; ++i)
+    {
+        if(!result.text.empty())
+            result.text += '\n';
+        result.text += lines[i % lines.size()];
+    }
+
+    if(result.text.size() > size)
+    {
+        size_t end = size;
+        while(end > 0 && (result.text[end] & 0xC0) == 0x80)
+            --end;
+        result.text.erase(end);
+    }
+    return result;
+}
+
+
+// An old-style NFont bitmap: glyph columns along the top row, split by magenta separators, each holding
+// a white box on black
+static SDL_Surface* make_bitmap_strip(int width, int height)
+{
+    SDL_Surface* result = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888);
+    if(result == NULL)
+        return NULL;
+
+    SDL_FillRect(result, NULL, SDL_MapRGB(result->format, 0, 0, 0));
+    const int column_width = 18;  // 4096 pixels fit every glyph from '!' up
+    for(int x = 0; x < width; x += column_width)
+    {
+        SDL_Rect separator = {x, 0, 1, 1};
+        SDL_FillRect(result, &separator, SDL_MapRGB(result->format, 255, 0, 255));
+        SDL_Rect glyph = {x + 3, 4, column_width - 6, height - 8};
+        SDL_FillRect(result, &glyph, SDL_MapRGB(result->format, 255, 255, 255));
+    }
+    return result;
+}
+
+static NFont::StringView view(const std::string& str)
+{
+    return NFont::StringView(str.data(), str.size());
+}
+
+
+// Draws the text into the software renderer's target and reads it back
+static void render_text(Context& ctx, NFont& font, const std::string& text, std::vector<Uint8>& pixels)
+{
+    pixels.resize(size_t(ctx.surface->pitch)*ctx.surface->h);
+    SDL_SetRenderDrawColor(ctx.renderer, 255, 255, 255, 255);
+    SDL_RenderClear(ctx.renderer);
+    font.drawColumn(ctx.renderer, 0, 0, Uint16(ctx.surface->w), view(text));
+    SDL_RenderReadPixels(ctx.renderer, NULL, ctx.surface->format->format, &pixels[0], ctx.surface->pitch);
+}
+
+static void append_utf8(std::string& str, Uint32 codepoint)
+{
+    if(codepoint < 0x80)
+        str += char(codepoint);
+    else if(codepoint < 0x800)
+    {
+        str += char(0xC0 | (codepoint >> 6));
+        str += char(0x80 | (codepoint & 0x3F));
+    }
+    else
+    {
+        str += char(0xE0 | (codepoint >> 12));
+        str += char(0x80 | ((codepoint >> 6) & 0x3F));
+        str += char(0x80 | (codepoint & 0x3F));
+    }
+}
+
+// Draws a line of random CJK ideographs every frame, like a font showing CJK chat, under a cache budget far
+// smaller than the glyphs it meets.  The cache may only go past the budget by what one draw adds, a cache level
+// of NFont's and one of SDL_FontCache's, and it must have evicted to stay there.
+static bool soak_cache_budget(Context& ctx, double seconds)
+{
+    const Uint64 budget = 8*1024*1024;
+    NFont font(ctx.renderer, ctx.font_file.c_str(), ctx.point_size);
+    font.setCacheBudget(budget);
+    srand(11);
+
+    Uint64 peak = 0;
+    Uint64 largest_level = 0;
+    Uint64 frames = 0;
+    std::string line;
+    Uint64 start = SDL_GetPerformanceCounter();
+    while(get_seconds(SDL_GetPerformanceCounter() - start) < seconds)
+    {
+        line.clear();
+        for(int i = 0; i < 40; ++i)
+            append_utf8(line, 0x4E00 + Uint32(rand()) % (0x9FFF - 0x4E00 + 1));
+
+        SDL_RenderClear(ctx.renderer);
+        font.draw(ctx.renderer, 0, 0, view(line));
+        ++frames;
+
+        Uint64 bytes = font.getCacheBytes();
+        if(bytes > peak)
+            peak = bytes;
+        for(int i = 0; i < font.getNumCacheLevels(); ++i)
+        {
+            Uint32 format;
+            int w, h;
+            if(SDL_QueryTexture(font.getCacheLevel(i), &format, NULL, &w, &h) == 0 && Uint64(w)*h*SDL_BYTESPERPIXEL(format) > largest_level)
+                largest_level = Uint64(w)*h*SDL_BYTESPERPIXEL(format);
+        }
+    }
+
+    Uint64 evictions = font.getStats().cache_evictions;
+    Uint64 bound = budget + 2*largest_level;
+    fprintf(stderr, "cache soak: %llu frames, %llu evictions, peak %llu bytes for a budget of %llu (at most %llu)\n",
+            (unsigned long long)frames, (unsigned long long)evictions, (unsigned long long)peak, (unsigned long long)budget,
+            (unsigned long long)bound);
+    if(peak > bound)
+    {
+        fprintf(stderr, "cache soak: the glyph cache outgrew its budget\n");
+        return false;
+    }
+    if(evictions == 0)
+    {
+        fprintf(stderr, "cache soak: the glyph cache never reached its budget, so nothing was checked\n");
+        return false;
+    }
+    return true;
+}
+
+// Checks the cache levels that draws add for their new glyphs against SDL_FontCache's own, on real textures.
+// A font loaded from the file renders a draw's new glyphs into levels of its own, while one loaded from
+// SDL_RWops leaves them to SDL_FontCache, so the same text must come out the same from both.  Measuring then
+// has SDL_FontCache render more glyphs on its own, behind the added levels, and those must draw the same too.
+static bool check_staged_glyphs(Context& ctx, const std::string& drawn, const std::string& measured)
+{
+    NFont staged(ctx.renderer, ctx.font_file.c_str(), ctx.point_size);
+    NFont plain;
+    SDL_RWops* rwops = SDL_RWFromFile(ctx.font_file.c_str(), "rb");
+    if(rwops == NULL || !plain.load(ctx.renderer, rwops, 1, ctx.point_size, NFont::Color(0,0,0,255)))
+    {
+        fprintf(stderr, "staged glyphs: could not load %s from SDL_RWops\n", ctx.font_file.c_str());
+        return false;
+    }
+
+    std::vector<Uint8> expected, result;
+    render_text(ctx, plain, drawn, expected);
+    render_text(ctx, staged, drawn, result);
+    int stagedLevels = staged.getNumCacheLevels();
+    if(staged.getStats().glyphs_rasterized == 0 || stagedLevels < 2)
+    {
+        fprintf(stderr, "staged glyphs: the draw added no cache level\n");
+        return false;
+    }
+    if(result != expected)
+    {
+        fprintf(stderr, "staged glyphs: the added cache levels draw differently\n");
+        return false;
+    }
+
+    plain.getCharacterOffset(0, 0, view(measured));
+    staged.getCharacterOffset(0, 0, view(measured));
+    render_text(ctx, plain, measured, expected);
+    render_text(ctx, staged, measured, result);
+    if(result != expected)
+    {
+        fprintf(stderr, "staged glyphs: SDL_FontCache's glyphs behind the added cache levels draw differently\n");
+        return false;
+    }
+
+    fprintf(stderr, "staged glyphs: match, %d cache levels from SDL_RWops, %d from the file\n",
+            plain.getNumCacheLevels(), staged.getNumCacheLevels());
+    return true;
+}
+
+
+static void bench_load(Context& ctx)
+{
+    NFont font(ctx.renderer, ctx.font_file.c_str(), ctx.point_size);
+}
+
+static void bench_load_sdf(Context& ctx)
+{
+    NFont font;
+    font.loadSDF(ctx.renderer, ctx.font_file.c_str(), ctx.point_size);
+}
+
+// The sizes that one loadSDF() font stands in for when drawing into surfaces, as multiples of the point size
+static const float sdf_scales[] = {0.5f, 0.75f, 1.0f, 1.5f, 2.0f};
+static const int num_sdf_scales = int(sizeof(sdf_scales)/sizeof(sdf_scales[0]));
+
+static void bench_load_sizes(Context& ctx)
+{
+    for(int i = 0; i < num_sdf_scales; ++i)
+        NFont font(ctx.renderer, ctx.font_file.c_str(), Uint32(ctx.point_size*sdf_scales[i]));
+}
+
+static void bench_load_cached_cold(Context& ctx)
+{
+    remove(ctx.cache_file.c_str());
+    NFont font;
+    font.loadCached(ctx.renderer, ctx.font_file.c_str(), ctx.point_size, ctx.cache_file.c_str());
+}
+
+static void bench_load_cached_warm(Context& ctx)
+{
+    NFont font;
+    font.loadCached(ctx.renderer, ctx.font_file.c_str(), ctx.point_size, ctx.cache_file.c_str());
+}
+
+// Latin-1 and Latin Extended, past what the loading string covers
+static void bench_preload(Context& ctx)
+{
+    NFont font(ctx.renderer, ctx.font_file.c_str(), ctx.point_size);
+    font.preloadGlyphs(0xA0, 0x24F, ctx.num_threads);
+}
+
+static void bench_load_bitmap(Context& ctx)
+{
+    NFont font;
+    font.load(ctx.renderer, ctx.strip);
+}
+
+static void bench_registry(Context& ctx)
+{
+    NFont font;
+    NFont::Registry::load(font, ctx.renderer, ctx.font_file.c_str(), ctx.point_size);
+}
+
+static void bench_draw(Context& ctx)
+{
+    ctx.font->draw(ctx.renderer, 0, 0, view(*ctx.text));
+}
+
+static void bench_draw_column(Context& ctx)
+{
+    ctx.font->drawColumn(ctx.renderer, 0, 0, 400, view(*ctx.text));
+}
+
+static void bench_draw_box(Context& ctx)
+{
+    ctx.font->drawBox(ctx.renderer, NFont::Rectf(0, 0, 400, 300), view(*ctx.text));
+}
+
+static void bench_draw_surface(Context& ctx)
+{
+    ctx.font->draw(ctx.surface, 0, 0, view(*ctx.text));
+}
+
+static void bench_get_width(Context& ctx)
+{
+    ctx.font->getWidth(view(*ctx.text));
+}
+
+static void bench_draw_format(Context& ctx)
+{
+    ctx.font->draw(ctx.renderer, 0, 0, "%s", ctx.text->c_str());
+}
+
+static void bench_get_width_format(Context& ctx)
+{
+    ctx.font->getWidth("%s", ctx.text->c_str());
+}
+
+static void bench_get_ascent(Context& ctx)
+{
+    ctx.font->getAscent(view(*ctx.text));
+}
+
+static void bench_get_ascent_format(Context& ctx)
+{
+    ctx.font->getAscent("%s", ctx.text->c_str());
+}
+
+// SDL_FontCache looks up each character's glyph, where NFont reads its metrics table
+static void bench_fc_get_width(Context& ctx)
+{
+    FC_GetWidth(ctx.cache, "%s", ctx.text->c_str());
+}
+
+static void bench_fc_get_ascent(Context& ctx)
+{
+    FC_GetAscent(ctx.cache, "%s", ctx.text->c_str());
+}
+
+static void bench_get_wrapped_text(Context& ctx)
+{
+    ctx.font->getWrappedText(&ctx.buffer[0], int(ctx.buffer.size()), 400, view(*ctx.text));
+}
+
+// Formatted through the font's scratch buffer, which has to grow for long text
+static void bench_draw_column_format(Context& ctx)
+{
+    ctx.font->drawColumn(ctx.renderer, 0, 0, 400, "%s", ctx.text->c_str());
+}
+
+static void bench_get_wrapped_text_format(Context& ctx)
+{
+    ctx.font->getWrappedText(&ctx.buffer[0], int(ctx.buffer.size()), 400, "%s", ctx.text->c_str());
+}
+
+static void bench_get_column_height_format(Context& ctx)
+{
+    ctx.font->getColumnHeight(400, "%s", ctx.text->c_str());
+}
+
+static void bench_get_character_offset(Context& ctx)
+{
+    ctx.font->getCharacterOffset(Uint16(SDL_min(ctx.text->size()/2, size_t(65535))), 400, view(*ctx.text));
+}
+
+static void bench_get_position_from_offset(Context& ctx)
+{
+    ctx.font->getPositionFromOffset(200, 150, 400, NFont::LEFT, view(*ctx.text));
+}
+
+// A thread's share of the strings, measured with its own copy of the font
+struct MeasureJob
+{
+    NFont font;
+    const std::vector<std::string>* strings;
+    size_t begin;
+    size_t end;
+    bool all_getters;  // getHeight(), getColumnHeight() and getBounds() too, not only getWidth()
+};
+
+static int measure_strings(void* data)
+{
+    MeasureJob* job = (MeasureJob*)data;
+    for(size_t i = job->begin; i < job->end; ++i)
+    {
+        NFont::StringView text = view((*job->strings)[i]);
+        job->font.getWidth(text);
+        if(!job->all_getters)
+            continue;
+        job->font.getHeight(text);
+        job->font.getColumnHeight(200, text);
+        job->font.getBounds(0, 0, text);
+    }
+    return 0;
+}
+
+static void run_measure_threads(Context& ctx, bool all_getters)
+{
+    std::vector<MeasureJob> jobs(ctx.num_threads);
+    std::vector<SDL_Thread*> threads(ctx.num_threads);
+    size_t count = ctx.strings->size();
+    for(int i = 0; i < ctx.num_threads; ++i)
+    {
+        jobs[i].font = *ctx.font;
+        jobs[i].strings = ctx.strings;
+        jobs[i].begin = count*i/ctx.num_threads;
+        jobs[i].end = count*(i + 1)/ctx.num_threads;
+        jobs[i].all_getters = all_getters;
+        threads[i] = SDL_CreateThread(measure_strings, "NFont measure", &jobs[i]);
+    }
+    for(int i = 0; i < ctx.num_threads; ++i)
+    {
+        if(threads[i] != NULL)
+            SDL_WaitThread(threads[i], NULL);
+        else
+            measure_strings(&jobs[i]);
+    }
+}
+
+static void bench_get_width_threads(Context& ctx)
+{
+    run_measure_threads(ctx, false);
+}
+
+static void bench_measure_threads(Context& ctx)
+{
+    run_measure_threads(ctx, true);
+}
+
+static void bench_typing(Context& ctx)
+{
+    // Types a character in the middle and takes it back, so the text stays the same size
+    Uint32 middle = ctx.edit->getLength()/2;
+    ctx.edit->insert(middle, "x");
+    ctx.edit->erase(middle, 1);
+}
+
+static void bench_edit_character_offset(Context& ctx)
+{
+    ctx.edit->getCharacterOffset(ctx.edit->getLength()/2);
+}
+
+static void bench_edit_position_from_offset(Context& ctx)
+{
+    ctx.edit->getPositionFromOffset(200, ctx.edit->getColumnHeight()/2);
+}
+
+static void bench_keystroke(Context& ctx)
+{
+    // What a text field does per key: edit, then place the caret
+    Uint32 middle = ctx.edit->getLength()/2;
+    ctx.edit->insert(middle, "x");
+    ctx.edit->getCharacterOffset(middle + 1);
+    ctx.edit->erase(middle, 1);
+    ctx.edit->getCharacterOffset(middle);
+}
+
+
+static size_t count_visible(const char* text)
+{
+    size_t result = 0;
+    for(const char* c = text; *c != '\0'; ++c)
+    {
+        if(*c != ' ' && *c != '\n')
+            ++result;
+    }
+    return result;
+}
+
+static int count_lines(const char* text)
+{
+    int result = 1;
+    for(const char* c = text; *c != '\0'; ++c)
+    {
+        if(*c == '\n')
+            ++result;
+    }
+    return result;
+}
+
+// Checks that the formatted overloads handle 1 MB of text whole: getWrappedText() keeps every character and
+// wraps it into as many lines per byte as the 16 KB text, and drawColumn() reports the height of those lines,
+// which getColumnHeight() saturates at 65535.  Repeating a call must not allocate once the font's scratch
+// buffer has grown.
+static bool check_long_text(Context& ctx, const Corpus& small, const Corpus& big)
+{
+    NFont& font = *ctx.font;
+    std::vector<char> wrapped(big.text.size()*2 + 1);
+    std::vector<char> small_wrapped(small.text.size()*2 + 1);
+    Uint64 truncations = font.getStats().truncations;
+    font.getWrappedText(&wrapped[0], int(wrapped.size()), 400, "%s", big.text.c_str());
+    font.getWrappedText(&small_wrapped[0], int(small_wrapped.size()), 400, "%s", small.text.c_str());
+    bool ok = true;
+    if(font.getStats().truncations != truncations || count_visible(&wrapped[0]) != count_visible(big.text.c_str()))
+    {
+        SDL_Log("getWrappedText() cut %s short\n", big.name.c_str());
+        ok = false;
+    }
+
+    int lines = count_lines(&wrapped[0]);
+    double expected_lines = double(count_lines(&small_wrapped[0]))*big.text.size()/small.text.size();
+    if(lines < expected_lines*0.9 || lines > expected_lines*1.1)
+    {
+        SDL_Log("getWrappedText() wrapped %s into %d lines, expected about %.0f\n", big.name.c_str(), lines, expected_lines);
+        ok = false;
+    }
+
+    NFont::Rectf box = font.drawColumn(ctx.renderer, 0, 0, 400, "%s", big.text.c_str());
+    Uint16 height = font.getColumnHeight(400, "%s", big.text.c_str());
+    Uint16 lines_height = font.getHeight("%s", &wrapped[0]);
+    if(height != lines_height || Uint16(box.h) != height)
+    {
+        SDL_Log("%s measured %u high in a column, %u wrapped and drew %g high\n", big.name.c_str(), unsigned(height),
+                unsigned(lines_height), box.h);
+        ok = false;
+    }
+
+    const char* names[] = {"drawColumn", "getWrappedText", "getColumnHeight"};
+    BenchFunc funcs[] = {bench_draw_column_format, bench_get_wrapped_text_format, bench_get_column_height_format};
+    const std::string* text = ctx.text;
+    ctx.text = &big.text;
+    ctx.buffer.resize(wrapped.size());
+    for(int i = 0; i < 3; ++i)
+    {
+        funcs[i](ctx);
+        int before = SDL_AtomicGet(&allocations);
+        funcs[i](ctx);
+        int count = SDL_AtomicGet(&allocations) - before;
+        if(count != 0)
+        {
+            SDL_Log("%s allocated %d times on a repeated call with %s\n", names[i], count, big.name.c_str());
+            ok = false;
+        }
+    }
+    ctx.text = text;
+    return ok;
+}
+
+
+static std::string json_string(const std::string& str)
+{
+    std::string result = "\"";
+    for(size_t i = 0; i < str.size(); ++i)
+    {
+        char c = str[i];
+        if(c == '"' || c == '\\')
+            result += '\\';
+        if((unsigned char)c < 0x20)
+        {
+            char code[8];
+            sprintf(code, "\\u%04x", c);
+            result += code;
+        }
+        else
+            result += c;
+    }
+    return result + "\"";
+}
+
+static void write_json(FILE* out, const std::string& font_file)
+{
+    SDL_version version;
+    SDL_GetVersion(&version);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"sdl_version\": \"%d.%d.%d\",\n", version.major, version.minor, version.patch);
+    fprintf(out, "  \"renderer\": \"software\",\n");
+    fprintf(out, "  \"font\": %s,\n", json_string(font_file).c_str());
+    fprintf(out, "  \"min_seconds\": %g,\n", min_seconds);
+    fprintf(out, "  \"results\": [\n");
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        const Result& r = results[i];
+        double mb_per_s = (r.bytes > 0? r.bytes/r.ns_per_op*1e9/(1024*1024) : 0);
+        double glyphs_per_s = r.glyphs_per_op/r.ns_per_op*1e9;
+        fprintf(out, "    {\"name\": %s, \"corpus\": %s, \"bytes\": %u, \"iterations\": %llu, \"ns_per_op\": %.1f, \"mb_per_s\": %.3f, \"glyphs_per_op\": %.1f, \"glyphs_per_s\": %.0f}%s\n",
+                json_string(r.name).c_str(), json_string(r.corpus).c_str(), unsigned(r.bytes), (unsigned long long)r.iterations,
+                r.ns_per_op, mb_per_s, r.glyphs_per_op, glyphs_per_s, (i + 1 < results.size()? "," : ""));
+    }
+    fprintf(out, "  ],\n");
+    fprintf(out, "  \"memory\": [\n");
+    for(size_t i = 0; i < memory_results.size(); ++i)
+    {
+        const MemoryResult& m = memory_results[i];
+        fprintf(out, "    {\"name\": %s, \"cache_levels\": %d, \"cache_texture_bytes\": %llu, \"rgba_bytes\": %llu, \"alpha_bytes\": %llu, \"distance_field_bytes\": %llu, \"total_bytes\": %llu, \"occupancy\": %.4f, \"fragmentation\": %.4f}%s\n",
+                json_string(m.name).c_str(), m.cache_levels, (unsigned long long)m.cache_texture_bytes,
+                (unsigned long long)m.rgba_bytes, (unsigned long long)m.alpha_bytes, (unsigned long long)m.distance_field_bytes,
+                (unsigned long long)(m.cache_texture_bytes + m.distance_field_bytes), m.occupancy, m.fragmentation,
+                (i + 1 < memory_results.size()? "," : ""));
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+    std::string font_file = "fonts/FreeSans.ttf";
+    std::string sample_file = "benchmark_sample.txt";
+    const char* out_file = NULL;
+    double soak_seconds = 0;
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        if(strcmp(argv[i], "--font") == 0)
+            font_file = argv[i+1];
+        else if(strcmp(argv[i], "--sample") == 0)
+            sample_file = argv[i+1];
+        else if(strcmp(argv[i], "--time") == 0)
+            min_seconds = atof(argv[i+1]);
+        else if(strcmp(argv[i], "--out") == 0)
+            out_file = argv[i+1];
+        else if(strcmp(argv[i], "--soak") == 0)
+            soak_seconds = atof(argv[i+1]);
+        else
+        {
+            fprintf(stderr, "Usage: %s [--font file.ttf] [--sample benchmark_sample.txt] [--time seconds] [--out results.json] [--soak seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // An SDL_VIDEODRIVER set in the environment still wins
+    SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+    if(SDL_Init(SDL_INIT_VIDEO) < 0)
+    {
+        SDL_Log("Failed to initialize SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    Context ctx;
+    SDL_Surface* target = SDL_CreateRGBSurfaceWithFormat(0, 1024, 768, 32, SDL_PIXELFORMAT_ARGB8888);
+    ctx.surface = target;
+    ctx.renderer = (target != NULL? SDL_CreateSoftwareRenderer(target) : NULL);
+    if(ctx.renderer == NULL)
+    {
+        SDL_Log("Failed to create the software renderer: %s\n", SDL_GetError());
+        SDL_Quit();
+        return 2;
+    }
+    ctx.strip = make_bitmap_strip(4096, 25);
+    ctx.font = NULL;
+    ctx.cache = NULL;
+    ctx.edit = NULL;
+    ctx.text = NULL;
+    ctx.strings = NULL;
+    ctx.font_file = font_file;
+    ctx.cache_file = "benchmark-glyphs.cache";
+    ctx.num_threads = 0;
+    ctx.point_size = 20;
+
+    std::string sample = read_file(sample_file);
+    std::vector<std::string> ascii, latin, cjk;
+    split_sample(sample, ascii, latin, cjk);
+    if(ascii.empty() || latin.empty() || cjk.empty())
+        SDL_Log("%s is missing ASCII, Latin or CJK lines.  Those corpora are skipped.\n", sample_file.c_str());
+
+    std::vector<Corpus> corpora;
+    const size_t sizes[] = {64, 1024, 16384};
+    for(int i = 0; i < 3; ++i)
+    {
+        corpora.push_back(make_corpus("ascii", ascii, sizes[i]));
+        corpora.push_back(make_corpus("latin", latin, sizes[i]));
+        corpora.push_back(make_corpus("cjk", cjk, sizes[i]));
+    }
+
+    NFont font;
+    if(!font.load(ctx.renderer, font_file.c_str(), ctx.point_size))
+    {
+        SDL_Log("Failed to load %s\n", font_file.c_str());
+        SDL_Quit();
+        return 3;
+    }
+    ctx.font = &font;
+
+    // Loading
+    measure("load", "", 0, bench_load, ctx);
+    measure("loadSDF", "", 0, bench_load_sdf, ctx);
+    measure("load 5 sizes", "", 0, bench_load_sizes, ctx);
+    measure("loadCached cold", "", 0, bench_load_cached_cold, ctx);
+    measure("loadCached warm", "", 0, bench_load_cached_warm, ctx);
+    remove(ctx.cache_file.c_str());
+    const int threads[] = {1, 2, 4, 8};
+    for(int i = 0; i < 4; ++i)
+    {
+        char name[64];
+        sprintf(name, "load + preloadGlyphs %d threads", threads[i]);
+        ctx.num_threads = threads[i];
+        measure(name, "", 0, bench_preload, ctx);
+    }
+    if(ctx.strip != NULL)
+        measure("load bitmap 4096px strip", "", 0, bench_load_bitmap, ctx);
+    {
+        NFont shared;
+        NFont::Registry::load(shared, ctx.renderer, font_file.c_str(), ctx.point_size);
+        measure("Registry::load shared", "", 0, bench_registry, ctx);
+    }
+
+    {
+        // loadSDF() keeps a glyph cache at its own size for measuring, so its fields only pay off against the
+        // fonts it replaces for surface draws at other sizes
+        NFont sdf;
+        sdf.loadSDF(ctx.renderer, font_file.c_str(), ctx.point_size);
+        NFont sizes[num_sdf_scales];
+        NFont* sized[num_sdf_scales];
+        for(int i = 0; i < num_sdf_scales; ++i)
+        {
+            sizes[i].load(ctx.renderer, font_file.c_str(), Uint32(ctx.point_size*sdf_scales[i]));
+            sized[i] = &sizes[i];
+        }
+        record_memory("load", font);
+        record_memory("loadSDF", sdf);
+        record_memory("load 5 sizes", sized, num_sdf_scales);
+    }
+    {
+        // Every Latin letter and CJK ideograph.  SDL_gpu packs these into alpha-only levels, but the software
+        // renderer has no texture format for that, so here they take what RGBA does and alpha_bytes gives what
+        // the same levels take with SDL_gpu.
+        NFont preloaded(ctx.renderer, font_file.c_str(), ctx.point_size);
+        int loaded_levels = preloaded.getNumCacheLevels();
+        preloaded.preloadGlyphs(0x20, 0x24F);
+        preloaded.preloadGlyphs(0x4E00, 0x9FFF);
+        record_memory("preloadGlyphs Latin + CJK", preloaded, loaded_levels);
+    }
+    {
+        // Glyphs of different heights preloaded a range at a time, each leaving a page partly empty, then
+        // packed together
+        NFont mixed_heights(ctx.renderer, font_file.c_str(), ctx.point_size);
+        mixed_heights.preloadGlyphs(0x2000, 0x206F);  // Punctuation: dashes, dots and quotes
+        mixed_heights.preloadGlyphs(0x20, 0x24F);
+        mixed_heights.preloadGlyphs(0x2190, 0x21FF);  // Arrows
+        mixed_heights.preloadGlyphs(0x4E00, 0x4FFF);
+        mixed_heights.preloadGlyphs(0x300, 0x36F);  // Combining marks
+        record_memory("compactAtlas before", mixed_heights);
+        if(mixed_heights.compactAtlas())
+            record_memory("compactAtlas after", mixed_heights);
+        else
+            SDL_Log("compactAtlas() failed\n");
+    }
+
+    // New glyphs that draws add to the cache, checked on real textures before timing them
+    bool staged_ok = true;
+    if(!latin.empty() && !cjk.empty())
+    {
+        std::string drawn = latin[0] + "\n" + cjk[0];
+        std::string measured;
+        for(size_t i = 1; i < cjk.size(); ++i)
+            measured += cjk[i] + "\n";
+        staged_ok = check_staged_glyphs(ctx, drawn, measured);
+    }
+    bool soak_ok = (soak_seconds <= 0 || soak_cache_budget(ctx, soak_seconds));
+
+    // Text far past NFONT_BUFFER_SIZE, through the printf-style overloads.  Cost per byte should stay about
+    // the same from 16 KB up.
+    bool long_ok = true;
+    static const struct { const char* name; BenchFunc func; } long_benchmarks[] = {
+        {"drawColumn %s", bench_draw_column_format},
+        {"getWrappedText %s", bench_get_wrapped_text_format},
+        {"getColumnHeight %s", bench_get_column_height_format}
+    };
+    const struct { const char* name; const std::vector<std::string>* lines; } scripts[] = {
+        {"ascii", &ascii},
+        {"latin", &latin},
+        {"cjk", &cjk}
+    };
+    for(int i = 0; i < 3; ++i)
+    {
+        const Corpus& small = corpora[6 + i];  // 16 KB of the same script
+        Corpus big = make_corpus(scripts[i].name, *scripts[i].lines, 1 << 20);
+        if(big.text.empty())
+            continue;
+
+        long_ok = check_long_text(ctx, small, big) && long_ok;
+        for(size_t j = 0; j < sizeof(long_benchmarks)/sizeof(long_benchmarks[0]); ++j)
+        {
+            ctx.text = &small.text;
+            ctx.buffer.resize(ctx.text->size()*2 + 1);
+            measure(long_benchmarks[j].name, small.name, ctx.text->size(), long_benchmarks[j].func, ctx);
+            double small_ns = results.back().ns_per_op/small.text.size();
+
+            ctx.text = &big.text;
+            ctx.buffer.resize(ctx.text->size()*2 + 1);
+            measure(long_benchmarks[j].name, big.name, ctx.text->size(), long_benchmarks[j].func, ctx);
+            double big_ns = results.back().ns_per_op/big.text.size();
+            fprintf(stderr, "%-32s %-12s %14.2fx\n", "  per byte vs 16 KB", "", big_ns/small_ns);
+            if(big_ns > small_ns*2)
+            {
+                SDL_Log("%s costs %.2fx as much per byte on %s as on %s\n", long_benchmarks[j].name, big_ns/small_ns,
+                        big.name.c_str(), small.name.c_str());
+                long_ok = false;
+            }
+        }
+        ctx.text = NULL;
+    }
+
+    // Drawing and measuring
+    static const struct { const char* name; BenchFunc func; } text_benchmarks[] = {
+        {"draw", bench_draw},
+        {"drawColumn", bench_draw_column},
+        {"drawBox", bench_draw_box},
+        {"draw surface", bench_draw_surface},
+        {"getWidth", bench_get_width},
+        {"getWrappedText", bench_get_wrapped_text},
+        {"getCharacterOffset", bench_get_character_offset},
+        {"getPositionFromOffset", bench_get_position_from_offset}
+    };
+    for(size_t i = 0; i < corpora.size(); ++i)
+    {
+        if(corpora[i].text.empty())
+            continue;
+
+        ctx.text = &corpora[i].text;
+        ctx.buffer.resize(ctx.text->size()*2 + 1);
+        for(size_t j = 0; j < sizeof(text_benchmarks)/sizeof(text_benchmarks[0]); ++j)
+            measure(text_benchmarks[j].name, corpora[i].name, ctx.text->size(), text_benchmarks[j].func, ctx);
+
+        ctx.font->enableMeasureCache();
+        measure("getWidth cached", corpora[i].name, ctx.text->size(), bench_get_width, ctx);
+        ctx.font->disableMeasureCache();
+
+        NFont::EditBuffer edit(font, 400, view(*ctx.text));
+        ctx.edit = &edit;
+        measure("EditBuffer typing", corpora[i].name, ctx.text->size(), bench_typing, ctx);
+        ctx.edit = NULL;
+    }
+
+    // Short strings, where formatting costs the most next to the work, as "%s" and as the same StringView
+    static const struct { const char* name; BenchFunc func; } format_pairs[][2] = {
+        {{"draw StringView", bench_draw}, {"draw %s", bench_draw_format}},
+        {{"getWidth StringView", bench_get_width}, {"getWidth %s", bench_get_width_format}}
+    };
+    for(int i = 0; i < 3; ++i)
+    {
+        if(corpora[i].text.empty())  // 64 bytes
+            continue;
+
+        ctx.text = &corpora[i].text;
+        for(int j = 0; j < 2; ++j)
+        {
+            measure(format_pairs[j][0].name, corpora[i].name, ctx.text->size(), format_pairs[j][0].func, ctx);
+            double direct = results.back().ns_per_op;
+            measure(format_pairs[j][1].name, corpora[i].name, ctx.text->size(), format_pairs[j][1].func, ctx);
+            fprintf(stderr, "%-32s %-12s %14.1f ns\n", "  formatting", "", results.back().ns_per_op - direct);
+        }
+    }
+    ctx.text = NULL;
+
+    std::vector<std::string> lines(ascii);
+    lines.insert(lines.end(), latin.begin(), latin.end());
+    lines.insert(lines.end(), cjk.begin(), cjk.end());
+
+    // Glyph metrics against SDL_FontCache, on ASCII and on a line of each script in turn.  SDL_FontCache
+    // formats into a 1024 byte buffer, so the text stays under that.
+    std::vector<std::string> mixed;
+    for(size_t i = 0; i < lines.size() && !ascii.empty() && !latin.empty() && !cjk.empty(); ++i)
+    {
+        mixed.push_back(ascii[i % ascii.size()]);
+        mixed.push_back(latin[i % latin.size()]);
+        mixed.push_back(cjk[i % cjk.size()]);
+    }
+    ctx.cache = FC_CreateFont();
+    if(!mixed.empty() && FC_LoadFont(ctx.cache, ctx.renderer, font_file.c_str(), ctx.point_size, FC_MakeColor(0, 0, 0, 255), TTF_STYLE_NORMAL))
+    {
+        static const struct { const char* name; BenchFunc func; } metrics_benchmarks[] = {
+            {"getWidth", bench_get_width},
+            {"getWidth %s", bench_get_width_format},
+            {"FC_GetWidth", bench_fc_get_width},
+            {"getAscent", bench_get_ascent},
+            {"getAscent %s", bench_get_ascent_format},
+            {"FC_GetAscent", bench_fc_get_ascent}
+        };
+        std::vector<Corpus> metrics_corpora;
+        metrics_corpora.push_back(make_corpus("ascii", ascii, 160));
+        metrics_corpora.push_back(make_corpus("ascii", ascii, 1000));
+        metrics_corpora.push_back(make_corpus("mixed", mixed, 160));
+        metrics_corpora.push_back(make_corpus("mixed", mixed, 1000));
+        for(size_t i = 0; i < metrics_corpora.size(); ++i)
+        {
+            if(metrics_corpora[i].text.empty())
+                continue;
+
+            ctx.text = &metrics_corpora[i].text;
+            for(size_t j = 0; j < sizeof(metrics_benchmarks)/sizeof(metrics_benchmarks[0]); ++j)
+                measure(metrics_benchmarks[j].name, metrics_corpora[i].name, ctx.text->size(), metrics_benchmarks[j].func, ctx);
+        }
+        ctx.text = NULL;
+    }
+    FC_FreeFont(ctx.cache);
+    ctx.cache = NULL;
+
+    // A 100k character document of every script, edited and queried in the middle.  NFont's own
+    // getCharacterOffset() and getPositionFromOffset() rescan it on each call, for comparison.
+    std::string document;
+    Uint32 document_length = 0;
+    for(size_t i = 0; document_length < 100000 && !lines.empty(); ++i)
+    {
+        if(i > 0)
+        {
+            document += '\n';
+            ++document_length;
+        }
+        const std::string& line = lines[i % lines.size()];
+        for(size_t j = 0; j < line.size() && document_length < 100000; ++document_length)
+        {
+            size_t next = j + 1;
+            while(next < line.size() && (line[next] & 0xC0) == 0x80)
+                ++next;
+            document.append(line, j, next - j);
+            j = next;
+        }
+    }
+    if(!document.empty())
+    {
+        NFont::EditBuffer edit(font, 400, view(document));
+        ctx.edit = &edit;
+        ctx.text = &document;
+        measure("EditBuffer typing", "mixed-100k-chars", document.size(), bench_typing, ctx);
+        measure("EditBuffer keystroke + caret", "mixed-100k-chars", document.size(), bench_keystroke, ctx);
+        measure("EditBuffer getCharacterOffset", "mixed-100k-chars", document.size(), bench_edit_character_offset, ctx);
+        measure("EditBuffer getPositionFromOffset", "mixed-100k-chars", document.size(), bench_edit_position_from_offset, ctx);
+        measure("getCharacterOffset", "mixed-100k-chars", document.size(), bench_get_character_offset, ctx);
+        measure("getPositionFromOffset", "mixed-100k-chars", document.size(), bench_get_position_from_offset, ctx);
+        ctx.edit = NULL;
+        ctx.text = NULL;
+    }
+
+    // Measuring from several threads at once, each with its own copy of the font, which share the glyph cache
+    std::vector<std::string> strings;
+    size_t strings_size = 0;
+    for(size_t i = 0; i < 100000 && !lines.empty(); ++i)
+    {
+        strings.push_back(lines[i % lines.size()]);
+        strings_size += strings.back().size();
+    }
+    if(!strings.empty())
+    {
+        ctx.strings = &strings;
+        // getWidth() alone, then with getHeight(), getColumnHeight() and getBounds() on each string too
+        static const struct { const char* name; BenchFunc func; } thread_benchmarks[] = {
+            {"getWidth", bench_get_width_threads},
+            {"all getters", bench_measure_threads}
+        };
+        for(int j = 0; j < 2; ++j)
+        {
+            double one_thread = 0;
+            for(int i = 0; i < 4; ++i)
+            {
+                char name[64];
+                sprintf(name, "%s 100k strings %d threads", thread_benchmarks[j].name, threads[i]);
+                ctx.num_threads = threads[i];
+                measure(name, "mixed-100k", strings_size, thread_benchmarks[j].func, ctx);
+                if(i == 0)
+                    one_thread = results.back().ns_per_op;
+                fprintf(stderr, "%-32s %-12s %14.2fx\n", "  scaling", "", one_thread/results.back().ns_per_op);
+            }
+        }
+        ctx.strings = NULL;
+    }
+
+    // Surface blending by destination format and glyph size, which sets the span width
+    const struct { const char* name; Uint32 format; } formats[] = {
+        {"ARGB8888", SDL_PIXELFORMAT_ARGB8888},
+        {"RGB888", SDL_PIXELFORMAT_RGB888},
+        {"RGB565", SDL_PIXELFORMAT_RGB565},
+        {"INDEX8", SDL_PIXELFORMAT_INDEX8}
+    };
+    const Uint32 point_sizes[] = {12, 32, 96};
+    for(int i = 0; i < 3 && !ascii.empty(); ++i)
+    {
+        NFont sized(ctx.renderer, font_file.c_str(), point_sizes[i]);
+        ctx.font = &sized;
+        ctx.text = &corpora[3].text;  // ascii-1024
+        for(int j = 0; j < 4; ++j)
+        {
+            SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, 1024, 768, SDL_BITSPERPIXEL(formats[j].format), formats[j].format);
+            if(surface == NULL)
+                continue;
+
+            char name[64];
+            sprintf(name, "draw surface %s %upt", formats[j].name, unsigned(point_sizes[i]));
+            ctx.surface = surface;
+            measure(name, corpora[3].name, ctx.text->size(), bench_draw_surface, ctx);
+            SDL_FreeSurface(surface);
+        }
+    }
+
+    FILE* out = stdout;
+    if(out_file != NULL && (out = fopen(out_file, "w")) == NULL)
+    {
+        SDL_Log("Failed to open %s\n", out_file);
+        out = stdout;
+    }
+    write_json(out, font_file);
+    if(out != stdout)
+        fclose(out);
+
+    font.free();
+    SDL_FreeSurface(ctx.strip);
+    SDL_DestroyRenderer(ctx.renderer);
+    SDL_FreeSurface(target);
+    SDL_Quit();
+    if(!staged_ok)
+        return 4;
+    if(!soak_ok)
+        return 5;
+    return (long_ok? 0 : 6);
+}
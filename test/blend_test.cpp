@@ -0,0 +1,210 @@
+// Checks NFont's span blenders against drawPixel() and the blenders' own scalar loop, byte for byte, over
+// every span width up to a few vectors, misaligned starts and the alphas at the edges of the weight math.
+// The vector code is picked when NFont.cpp is compiled, so build this once per instruction set the host
+// runs: with the default flags (SSE2 on x86-64, NEON on ARM64) and again with -mavx2.  The scalar loop is
+// the reference either way.
+//
+// Usage: blend-test-NFont [--iterations 200]
+// Prints the instruction set and each format's result, and returns 2 if any format mismatched.
+
+// The blenders are internal to NFont.cpp
+#include "../NFont/NFont.cpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+
+static const int max_width = 80;  // Two AVX2 565 vectors and then some
+static const int max_offset = 16;  // Pixels, so every start within a 32-byte vector comes up
+static const int row_pixels = max_offset + max_width + 8;  // Room to see writes past the span
+static const int max_alpha_offset = 8;
+
+static const char* get_isa_name()
+{
+    #if defined(NFONT_USE_AVX2)
+    return "AVX2";
+    #elif defined(NFONT_USE_SSE2)
+    return "SSE2";
+    #elif defined(NFONT_USE_NEON)
+    return "NEON";
+    #else
+    return "scalar";
+    #endif
+}
+
+static Uint32 random_uint32()
+{
+    return (Uint32(rand() & 0xFFFF) << 16) | Uint32(rand() & 0xFFFF);
+}
+
+// 0 and 255 take the skip and opaque paths, 1 and 254 sit next to them
+static Uint8 edge_alpha()
+{
+    static const Uint8 edges[] = {0, 1, 2, 127, 128, 253, 254, 255};
+    return edges[rand() % 8];
+}
+
+// Alpha rows shaped like glyphs: empty, solid, edges only, random, and runs of zeros that let whole vectors skip
+static void fill_alpha(Uint8* alpha, int pattern)
+{
+    for(int i = 0; i < max_width; ++i)
+    {
+        switch(pattern)
+        {
+        case 0:
+            alpha[i] = 0;
+            break;
+        case 1:
+            alpha[i] = 255;
+            break;
+        case 2:
+            alpha[i] = edge_alpha();
+            break;
+        case 3:
+            alpha[i] = Uint8(rand());
+            break;
+        default:
+            alpha[i] = ((i/8) % 2 == 0? 0 : edge_alpha());
+            break;
+        }
+    }
+}
+
+// What blendSpan() would give with no vector loop
+template<class Format>
+static void blend_scalar(Uint8* row, const Uint8* alpha, int n, Uint32 color)
+{
+    typename Format::Pixel* pixels = (typename Format::Pixel*)row;
+    for(int x = 0; x < n; ++x)
+    {
+        if(alpha[x] != 0)
+            pixels[x] = Format::blend(pixels[x], color, alpha[x]);
+    }
+}
+
+static void report_mismatch(const char* format_name, const char* reference, int width, int offset, int bpp, const Uint8* result, const Uint8* expected)
+{
+    for(int i = 0; i < row_pixels*bpp; ++i)
+    {
+        if(result[i] != expected[i])
+        {
+            printf("%s: mismatch with %s at width %d, offset %d, pixel %d byte %d: 0x%02X instead of 0x%02X\n",
+                   format_name, reference, width, offset, i/bpp - offset, i % bpp, result[i], expected[i]);
+            return;
+        }
+    }
+}
+
+// Blends every width at every offset with the blender, drawPixel() and the scalar loop, comparing whole rows
+static bool check_format(const char* name, Uint32 pixel_format, NFont_SpanBlender scalar, int iterations)
+{
+    SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, row_pixels, 1, SDL_BITSPERPIXEL(pixel_format), pixel_format);
+    if(surface == NULL)
+    {
+        printf("%s: could not create a surface: %s\n", name, SDL_GetError());
+        return false;
+    }
+
+    NFont_SpanBlender blend = getSpanBlender(surface->format);
+    if(blend == NULL)
+    {
+        printf("%s: no span blender\n", name);
+        SDL_FreeSurface(surface);
+        return false;
+    }
+
+    int bpp = surface->format->BytesPerPixel;
+    Uint8* expected = (Uint8*)surface->pixels;  // drawPixel() needs a surface
+    std::vector<Uint8> initial(row_pixels*bpp);
+    std::vector<Uint8> result(row_pixels*bpp);
+    std::vector<Uint8> reference(row_pixels*bpp);
+    Uint8 alphas[max_alpha_offset + max_width];
+    Uint64 pixels = 0;
+    for(int i = 0; i < iterations; ++i)
+    {
+        Uint32 color = (i < 2? (i == 0? 0 : 0xFFFFFFFF) : random_uint32());
+        if(bpp == 2)
+            color &= 0xFFFF;
+        for(size_t j = 0; j < initial.size(); ++j)
+            initial[j] = Uint8(i < 2? (i == 0? 0xFF : 0) : rand());
+
+        for(int offset = 0; offset < max_offset; ++offset)
+        {
+            // The alphas start misaligned too
+            Uint8* alpha = alphas + (offset*3) % max_alpha_offset;
+            fill_alpha(alpha, i % 5);
+            for(int width = 0; width <= max_width; ++width)
+            {
+                memcpy(&result[0], &initial[0], initial.size());
+                blend(&result[offset*bpp], alpha, width, color);
+
+                memcpy(&reference[0], &initial[0], initial.size());
+                scalar(&reference[offset*bpp], alpha, width, color);
+                if(memcmp(&result[0], &reference[0], result.size()) != 0)
+                {
+                    report_mismatch(name, "the scalar loop", width, offset, bpp, &result[0], &reference[0]);
+                    SDL_FreeSurface(surface);
+                    return false;
+                }
+
+                memcpy(expected, &initial[0], initial.size());
+                for(int x = 0; x < width; ++x)
+                {
+                    if(alpha[x] != 0)
+                        drawPixel(surface, Sint16(offset + x), 0, color, alpha[x]);
+                }
+                if(memcmp(&result[0], expected, result.size()) != 0)
+                {
+                    report_mismatch(name, "drawPixel()", width, offset, bpp, &result[0], expected);
+                    SDL_FreeSurface(surface);
+                    return false;
+                }
+                pixels += width;
+            }
+        }
+    }
+
+    printf("%s: %llu pixels match\n", name, (unsigned long long)pixels);
+    SDL_FreeSurface(surface);
+    return true;
+}
+
+
+int main(int argc, char* argv[])
+{
+    int iterations = 200;
+    for(int i = 1; i + 1 < argc; i += 2)
+    {
+        if(strcmp(argv[i], "--iterations") == 0)
+            iterations = atoi(argv[i+1]);
+        else
+        {
+            fprintf(stderr, "Usage: %s [--iterations count]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    #if defined(NFONT_USE_AVX2)
+    if(!SDL_HasAVX2())
+    {
+        printf("Built for AVX2, which this CPU does not have.  Skipped.\n");
+        return 0;
+    }
+    #endif
+
+    printf("Span blenders: %s\n", get_isa_name());
+    srand(7);
+    static const struct { const char* name; Uint32 format; NFont_SpanBlender scalar; } formats[] = {
+        {"ARGB8888", SDL_PIXELFORMAT_ARGB8888, blend_scalar<SpanFormat8888<true> >},
+        {"ABGR8888", SDL_PIXELFORMAT_ABGR8888, blend_scalar<SpanFormat8888<true> >},
+        {"RGB888", SDL_PIXELFORMAT_RGB888, blend_scalar<SpanFormat8888<false> >},
+        {"BGR888", SDL_PIXELFORMAT_BGR888, blend_scalar<SpanFormat8888<false> >},
+        {"RGB565", SDL_PIXELFORMAT_RGB565, blend_scalar<SpanFormat565>},
+        {"BGR565", SDL_PIXELFORMAT_BGR565, blend_scalar<SpanFormat565>}
+    };
+    bool ok = true;
+    for(size_t i = 0; i < sizeof(formats)/sizeof(formats[0]); ++i)
+        ok = check_format(formats[i].name, formats[i].format, formats[i].scalar, iterations) && ok;
+    return (ok? 0 : 2);
+}